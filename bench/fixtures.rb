@@ -0,0 +1,74 @@
+# Generates Jsonnet sources for the benchmarks.
+#
+# The sources resemble deployment configurations: a library of helper
+# functions imported by a main file which expands many services into objects.
+module Jsonnet
+  module Bench
+    module Fixtures
+      module_function
+
+      LIBRARY = <<~JSONNET
+        {
+          labels(name, team):: { app: name, team: team, 'managed-by': 'jsonnet' },
+          container(name, image, port):: {
+            name: name,
+            image: image,
+            ports: [{ containerPort: port, protocol: 'TCP' }],
+            env: [{ name: 'SERVICE_NAME', value: name }, { name: 'PORT', value: std.toString(port) }],
+            resources: { limits: { cpu: '500m', memory: '256Mi' } },
+          },
+          deployment(svc):: {
+            apiVersion: 'apps/v1',
+            kind: 'Deployment',
+            metadata: { name: svc.name, labels: $.labels(svc.name, svc.team) },
+            spec: {
+              replicas: svc.replicas,
+              selector: { matchLabels: $.labels(svc.name, svc.team) },
+              template: {
+                metadata: { labels: $.labels(svc.name, svc.team) },
+                spec: { containers: [$.container(svc.name, svc.image, svc.port)] },
+              },
+            },
+          },
+        }
+      JSONNET
+
+      # A snippet which expands +count+ services into Deployments.
+      # The library is imported as "lib.libsonnet".
+      def services(count)
+        <<~JSONNET
+          local lib = import 'lib.libsonnet';
+          local services = [
+            {
+              name: 'service-%d' % i,
+              team: 'team-%d' % (i % 7),
+              image: 'registry.example.com/service-%d:1.%d.0' % [i, i % 13],
+              port: 8000 + i,
+              replicas: 1 + i % 3,
+            }
+            for i in std.range(1, #{Integer(count)})
+          ];
+          { [svc.name + '.json']: lib.deployment(svc) for svc in services }
+        JSONNET
+      end
+
+      # A snippet which imports +count+ distinct files.
+      def imports(count)
+        (1..Integer(count)).map {|i| "(import 'config-#{i}.libsonnet').value" }.join(" + ")
+      end
+
+      # Content of an imported file for #imports.
+      def imported(rel)
+        "{ value: #{rel[/\d+/].to_i} }"
+      end
+
+      # A poorly formatted snippet of +count+ fields for the formatter.
+      def unformatted(count)
+        fields = (1..Integer(count)).map {|i|
+          "field_#{i}:{a:[1,2,3],b:'x#{i}',c:{d:#{i}}}"
+        }
+        "local x='y';{#{fields.join(',')}}"
+      end
+    end
+  end
+end
@@ -0,0 +1,177 @@
+# Benchmarks of the bridge between Ruby and libjsonnet.
+#
+# Usage: ruby -Ilib bench/run.rb [options]
+#   --output FILE    writes the results as JSON (default: bench/results/latest.json)
+#   --baseline FILE  compares the results with FILE (default: bench/baseline.json)
+#   --save-baseline  writes the results to the baseline file instead of comparing
+#   --no-compare     does not compare the results with the baseline
+#   --threshold R    ratio of slowdown reported as a regression (default: 0.1)
+#   --filter REGEX   runs only the benchmarks whose names match REGEX
+#   --time SECONDS   minimum time to run each benchmark (default: 1)
+#
+# Exits with 1 if any benchmark regressed from the baseline.
+require 'jsonnet'
+require 'json'
+require 'optparse'
+require 'rbconfig'
+require 'time'
+require 'fileutils'
+require_relative 'fixtures'
+
+module Jsonnet
+  module Bench
+    Result = Struct.new(:name, :iterations, :median, :mean, :allocations) do
+      def to_h
+        {
+          'iterations' => iterations,
+          'median' => median,
+          'mean' => mean,
+          'allocations' => allocations,
+        }
+      end
+    end
+
+    class Runner
+      MIN_ITERATIONS = 5
+
+      def initialize(min_time:, filter:)
+        @min_time = min_time
+        @filter = filter
+        @results = []
+      end
+
+      attr_reader :results
+
+      # Measures the block. The setup block is run once and its result is
+      # passed to the measured block.
+      def bench(name, setup: nil, &block)
+        return if @filter && name !~ @filter
+
+        arg = setup&.call
+        block.call(arg)  # warm up
+
+        times = []
+        allocations = 0
+        started = now
+        while times.size < MIN_ITERATIONS || now - started < @min_time
+          allocated = GC.stat(:total_allocated_objects)
+          t = now
+          block.call(arg)
+          times << now - t
+          allocations += GC.stat(:total_allocated_objects) - allocated
+        end
+
+        times.sort!
+        result = Result.new(name, times.size, times[times.size / 2], times.sum / times.size,
+                            allocations / times.size)
+        @results << result
+        $stderr.printf("%-32s %12.3f ms %10d objects/iter\n",
+                       name, result.median * 1000, result.allocations)
+      end
+
+      private
+      def now
+        Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      end
+    end
+
+    module_function
+
+    def run(runner)
+      lib = Fixtures::LIBRARY
+      import_lib = ->(base, rel) { [lib, "/#{rel}"] }
+
+      runner.bench('vm_new') { Jsonnet::VM.new }
+
+      runner.bench('evaluate_small', setup: -> { Jsonnet::VM.new }) {|vm|
+        vm.evaluate('{ a: 1, b: [true, null, "c"] }')
+      }
+
+      large = Fixtures.services(500)
+      new_vm = -> { Jsonnet::VM.new.tap {|vm| vm.handle_import(&import_lib) } }
+      runner.bench('evaluate_large', setup: new_vm) {|vm| vm.evaluate(large) }
+      runner.bench('evaluate_large_parse', setup: new_vm) {|vm| vm.evaluate(large, parse: true) }
+      runner.bench('evaluate_large_json_parse', setup: new_vm) {|vm| JSON.parse(vm.evaluate(large)) }
+      runner.bench('evaluate_multi', setup: new_vm) {|vm| vm.evaluate(large, multi: true) }
+
+      imports = Fixtures.imports(200)
+      runner.bench('import_callback', setup: -> {
+        Jsonnet::VM.new.tap {|vm|
+          vm.handle_import {|base, rel| [Fixtures.imported(rel), "/#{rel}"] }
+        }
+      }) {|vm| vm.evaluate(imports) }
+      runner.bench('import_callback_cached', setup: -> {
+        Jsonnet::VM.new(import_cache: Jsonnet::ImportCache.new).tap {|vm|
+          vm.handle_import {|base, rel| [Fixtures.imported(rel), "/#{rel}"] }
+        }
+      }) {|vm| vm.evaluate(imports) }
+
+      echo = 'std.length([std.native("echo")(i, "s", true) for i in std.range(1, 2000)])'
+      runner.bench('native_callback', setup: -> {
+        Jsonnet::VM.new.tap {|vm|
+          vm.define_function(:echo) {|i, s, b| { 'x' => [i, s, b, 1.5], 'y' => { 'z' => nil } } }
+        }
+      }) {|vm| vm.evaluate(echo) }
+
+      unformatted = Fixtures.unformatted(2000)
+      runner.bench('format', setup: -> { Jsonnet::VM.new }) {|vm| vm.format(unformatted) }
+    end
+
+    # Returns the names of the benchmarks slower than the baseline by more
+    # than +threshold+, printing the comparison.
+    def compare(results, baseline, threshold)
+      regressions = []
+      results.each do |result|
+        base = baseline.dig('results', result.name)
+        next $stderr.printf("%-32s %12s\n", result.name, 'new') unless base
+
+        ratio = result.median / base['median']
+        regressed = ratio > 1 + threshold
+        regressions << result.name if regressed
+        $stderr.printf("%-32s %+11.1f%% %s\n", result.name, (ratio - 1) * 100,
+                       regressed ? 'REGRESSION' : '')
+      end
+      regressions
+    end
+
+    def main(argv)
+      options = {
+        output: File.expand_path('results/latest.json', __dir__),
+        baseline: File.expand_path('baseline.json', __dir__),
+        threshold: 0.1,
+        time: 1.0,
+        compare: true,
+      }
+      OptionParser.new do |opts|
+        opts.on('--output FILE') {|v| options[:output] = v }
+        opts.on('--baseline FILE') {|v| options[:baseline] = v }
+        opts.on('--save-baseline') { options[:save_baseline] = true }
+        opts.on('--no-compare') { options[:compare] = false }
+        opts.on('--threshold RATIO', Float) {|v| options[:threshold] = v }
+        opts.on('--filter REGEX', Regexp) {|v| options[:filter] = v }
+        opts.on('--time SECONDS', Float) {|v| options[:time] = v }
+      end.parse!(argv)
+
+      runner = Runner.new(min_time: options[:time], filter: options[:filter])
+      run(runner)
+
+      report = {
+        'ruby' => RUBY_DESCRIPTION,
+        'platform' => RbConfig::CONFIG['arch'],
+        'jsonnet' => Jsonnet.libversion,
+        'time' => Time.now.utc.iso8601,
+        'results' => runner.results.to_h {|r| [r.name, r.to_h] },
+      }
+      path = options[:save_baseline] ? options[:baseline] : options[:output]
+      FileUtils.mkdir_p(File.dirname(path))
+      File.write(path, JSON.pretty_generate(report) + "\n")
+      $stderr.puts "wrote #{path}"
+      return 0 if options[:save_baseline] || !options[:compare] || !File.exist?(options[:baseline])
+
+      baseline = JSON.parse(File.read(options[:baseline]))
+      compare(runner.results, baseline, options[:threshold]).empty? ? 0 : 1
+    end
+  end
+end
+
+exit Jsonnet::Bench.main(ARGV) if $0 == __FILE__
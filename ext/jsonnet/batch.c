@@ -0,0 +1,852 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjsonnet.h>
+#ifdef HAVE_LIBJSONNET_FMT_H
+# include <libjsonnet_fmt.h>
+#endif
+#include <ruby/ruby.h>
+#include <ruby/encoding.h>
+#include <ruby/thread.h>
+/* HAVE_PTHREAD_H comes from the configuration of Ruby */
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "ruby_jsonnet.h"
+
+/*
+ * Batch evaluation and formatting on native worker threads.
+ *
+ * Each worker thread evaluates or formats items with its own JsonnetVm
+ * without the GVL.
+ * The worker VMs are configured like the VM the batch runs on, and they
+ * forward their callbacks to the Ruby thread which started the batch through
+ * a dispatcher.
+ */
+
+#ifdef HAVE_PTHREAD_H
+
+/* Deep recursion in Jsonnet consumes the native stack of the worker threads. */
+#define RUBYJSONNET_WORKER_STACK_SIZE (8 * 1024 * 1024)
+
+struct batch;
+
+struct dispatch_request {
+    void *(*func)(void *);
+    void *data;
+    void *result;
+    int done;
+    struct dispatch_request *next;
+};
+
+struct rubyjsonnet_dispatcher {
+    pthread_mutex_t lock;
+    /* signaled when a worker posts a request or finishes, or on interrupt */
+    pthread_cond_t posted;
+    /* broadcasted when the Ruby thread has done requests */
+    pthread_cond_t done;
+    struct dispatch_request *requests;
+    /* number of workers which have not finished yet */
+    long running;
+    /* set by the unblocking function */
+    int wakeup;
+    /* lets the workers stop taking items. Written only by the Ruby thread */
+    int cancelled;
+    /* the batch served by this dispatcher */
+    struct batch *batch;
+};
+
+/**
+ * Calls \c func on the Ruby thread served by \c dispatcher and waits for it.
+ * Must be called on a worker thread.
+ */
+static void *
+dispatch(struct rubyjsonnet_dispatcher *dispatcher, void *(*func)(void *), void *data)
+{
+    struct dispatch_request req;
+
+    req.func = func;
+    req.data = data;
+    req.result = NULL;
+    req.done = 0;
+
+    pthread_mutex_lock(&dispatcher->lock);
+    req.next = dispatcher->requests;
+    dispatcher->requests = &req;
+    pthread_cond_signal(&dispatcher->posted);
+    while (!req.done) {
+	pthread_cond_wait(&dispatcher->done, &dispatcher->lock);
+    }
+    pthread_mutex_unlock(&dispatcher->lock);
+
+    return req.result;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/**
+ * Calls \c func with the GVL on behalf of a VM evaluating without the GVL.
+ *
+ * If the VM runs on a worker thread of a batch, the call is forwarded to the
+ * Ruby thread which serves the batch.
+ */
+void *
+rubyjsonnet_call_with_gvl(struct jsonnet_vm_wrap *vm, void *(*func)(void *), void *data)
+{
+#ifdef HAVE_PTHREAD_H
+    if (vm->dispatcher) {
+	return dispatch(vm->dispatcher, func, data);
+    }
+#endif
+    return rb_thread_call_with_gvl(func, data);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+struct batch_item {
+    const char *fname;
+    /* NULL when evaluating the file \c fname */
+    const char *snippet;
+    rb_encoding *enc;
+    rb_encoding *fname_enc;
+    int error;
+    char *result;
+    /* the VM which allocated \c result */
+    struct JsonnetVm *vm;
+    /* non-zero if formatting changed the file */
+    int changed;
+    /* non-zero if the evaluation exceeded the timeout of the VM */
+    int timed_out;
+};
+
+struct batch_worker {
+    struct batch *batch;
+    struct jsonnet_vm_wrap wrap;
+    pthread_t thread;
+};
+
+/* what the workers do with the items */
+enum batch_kind {
+    BATCH_EVALUATE,
+    /* formats the files and reports whether they change */
+    BATCH_FORMAT_CHECK,
+    /* formats the files and rewrites the changed ones */
+    BATCH_FORMAT_WRITE
+};
+
+struct batch {
+    struct jsonnet_vm_wrap *vm;
+    enum batch_kind kind;
+    enum rubyjsonnet_eval_mode mode;
+    struct batch_item *items;
+    /* the filenames of the items in an Array */
+    VALUE fnames;
+    long len;
+    /* index of the next item to evaluate. protected by dispatcher.lock */
+    long next;
+    struct batch_worker *workers;
+    long nworkers;
+    /* number of workers whose threads have started */
+    long nstarted;
+    struct rubyjsonnet_dispatcher dispatcher;
+};
+
+#ifdef HAVE_JSONNET_FMT_SNIPPET
+/*
+ * Leaves an error message on \c item, prefixed with the filename.
+ */
+static void
+batch_item_fail(struct batch_item *item, const char *msg)
+{
+    const size_t len = strlen(item->fname) + strlen(msg) + 3;
+
+    item->result = jsonnet_realloc(item->vm, NULL, len);
+    snprintf(item->result, len, "%s: %s", item->fname, msg);
+    item->error = 1;
+}
+
+/*
+ * Reads the whole file into a buffer allocated with malloc(3).
+ * Returns NULL with errno on failure.
+ */
+static char *
+batch_read_file(const char *fname, size_t *lenp)
+{
+    FILE *const fp = fopen(fname, "rb");
+    size_t len = 0, capa = 8192;
+    char *buf;
+
+    if (!fp) {
+	return NULL;
+    }
+    buf = malloc(capa + 1);
+    while (buf) {
+	const size_t n = fread(buf + len, 1, capa - len, fp);
+	len += n;
+	if (len < capa) {
+	    if (ferror(fp)) {
+		free(buf);
+		buf = NULL;
+		errno = EIO;
+	    }
+	    break;
+	} else {
+	    char *const grown = realloc(buf, capa * 2 + 1);
+	    if (!grown) {
+		free(buf);
+		errno = ENOMEM;
+	    }
+	    buf = grown;
+	    capa *= 2;
+	}
+    }
+    fclose(fp);
+    if (buf) {
+	buf[len] = '\0';
+	*lenp = len;
+    }
+    return buf;
+}
+
+/*
+ * Formats the file of \c item and compares the result with the file in
+ * place, so that no Ruby string is built for unchanged files. Replaces the
+ * file if it changed and \c kind is BATCH_FORMAT_WRITE.
+ *
+ * The formatter takes a NUL-terminated snippet, so files which contain NUL
+ * bytes are rejected instead of being formatted, and rewritten, only up to
+ * the first NUL.
+ */
+static void
+batch_format_item(enum batch_kind kind, struct batch_item *item)
+{
+    size_t len, rlen;
+    char *const src = batch_read_file(item->fname, &len);
+    char *result;
+    int error;
+
+    if (!src) {
+	batch_item_fail(item, strerror(errno));
+	return;
+    }
+    if (memchr(src, '\0', len)) {
+	free(src);
+	batch_item_fail(item, "contains a NUL byte");
+	return;
+    }
+    result = jsonnet_fmt_snippet(item->vm, item->fname, src, &error);
+    if (error) {
+	free(src);
+	item->result = result;
+	item->error = 1;
+	return;
+    }
+    rlen = strlen(result);
+    item->changed = rlen != len || memcmp(result, src, len) != 0;
+    free(src);
+
+    if (item->changed && kind == BATCH_FORMAT_WRITE &&
+	rubyjsonnet_replace_file(item->fname, result, rlen)) {
+	const int err = errno;
+	jsonnet_realloc(item->vm, result, 0);
+	batch_item_fail(item, strerror(err));
+	return;
+    }
+    jsonnet_realloc(item->vm, result, 0);
+}
+#endif
+
+static void *
+batch_worker_main(void *ptr)
+{
+    struct batch_worker *const worker = (struct batch_worker *)ptr;
+    struct batch *const batch = worker->batch;
+    struct rubyjsonnet_dispatcher *const dispatcher = &batch->dispatcher;
+
+    for (;;) {
+	struct batch_item *item;
+	long i;
+
+	pthread_mutex_lock(&dispatcher->lock);
+	i = dispatcher->cancelled ? batch->len : batch->next;
+	if (i < batch->len) {
+	    batch->next++;
+	}
+	/* each item has its own time limit */
+	worker->wrap.deadline =
+	    worker->wrap.timeout > 0 ? rubyjsonnet_monotonic_now() + worker->wrap.timeout : 0;
+	if (worker->wrap.cancel == RUBYJSONNET_CANCEL_TIMEOUT) {
+	    worker->wrap.cancel = RUBYJSONNET_CANCEL_NONE;
+	}
+	pthread_mutex_unlock(&dispatcher->lock);
+	if (i >= batch->len) {
+	    break;
+	}
+
+	item = &batch->items[i];
+	item->vm = worker->wrap.vm;
+#ifdef HAVE_JSONNET_FMT_SNIPPET
+	if (batch->kind != BATCH_EVALUATE) {
+	    batch_format_item(batch->kind, item);
+	    continue;
+	}
+#endif
+	item->result = rubyjsonnet_evaluate(item->vm, item->fname, item->snippet, batch->mode,
+					    &item->error);
+	item->timed_out = item->error && worker->wrap.cancel == RUBYJSONNET_CANCEL_TIMEOUT;
+    }
+
+    pthread_mutex_lock(&dispatcher->lock);
+    dispatcher->running--;
+    pthread_cond_signal(&dispatcher->posted);
+    pthread_mutex_unlock(&dispatcher->lock);
+    return NULL;
+}
+
+static void *
+batch_wait(void *ptr)
+{
+    struct rubyjsonnet_dispatcher *const dispatcher = (struct rubyjsonnet_dispatcher *)ptr;
+
+    pthread_mutex_lock(&dispatcher->lock);
+    while (!dispatcher->requests && dispatcher->running > 0 && !dispatcher->wakeup) {
+	pthread_cond_wait(&dispatcher->posted, &dispatcher->lock);
+    }
+    dispatcher->wakeup = 0;
+    pthread_mutex_unlock(&dispatcher->lock);
+    return NULL;
+}
+
+static void
+batch_ubf(void *ptr)
+{
+    struct rubyjsonnet_dispatcher *const dispatcher = (struct rubyjsonnet_dispatcher *)ptr;
+
+    pthread_mutex_lock(&dispatcher->lock);
+    dispatcher->wakeup = 1;
+    pthread_cond_signal(&dispatcher->posted);
+    pthread_mutex_unlock(&dispatcher->lock);
+}
+
+static VALUE
+batch_check_ints(VALUE unused)
+{
+    rb_thread_check_ints();
+    return Qnil;
+}
+
+static VALUE
+batch_call_request(VALUE ptr)
+{
+    struct dispatch_request *const req = (struct dispatch_request *)ptr;
+    req->result = req->func(req->data);
+    return Qnil;
+}
+
+/*
+ * Cancels \c batch: the workers take no more items, and the evaluations in
+ * flight fail at their next callback. Must be called on the Ruby thread.
+ */
+static void
+batch_cancel(struct batch *batch)
+{
+    long i;
+
+    pthread_mutex_lock(&batch->dispatcher.lock);
+    batch->dispatcher.cancelled = 1;
+    for (i = 0; i < batch->nworkers; ++i) {
+	batch->workers[i].wrap.cancel = RUBYJSONNET_CANCEL_INTERRUPT;
+    }
+    pthread_mutex_unlock(&batch->dispatcher.lock);
+}
+
+/**
+ * Cancels the batch which \c dispatcher serves, e.g. when a callback of one
+ * of its items escaped globally.
+ * Must be called on the Ruby thread which serves \c dispatcher.
+ */
+void
+rubyjsonnet_dispatcher_cancel(struct rubyjsonnet_dispatcher *dispatcher)
+{
+    batch_cancel(dispatcher->batch);
+}
+
+/*
+ * Serves callbacks from the workers until all of them finish.
+ *
+ * Interrupts to the Ruby thread cancel the batch. The callbacks requested
+ * after that fail without entering Ruby, and the evaluations in flight fail
+ * at their next callback.
+ * Global escapes are deferred until the workers finish, and the last
+ * interrupt wins.
+ */
+static VALUE
+batch_serve(VALUE ptr)
+{
+    struct batch *const batch = (struct batch *)ptr;
+    struct rubyjsonnet_dispatcher *const dispatcher = &batch->dispatcher;
+    volatile VALUE errinfo = Qnil;
+    int state = 0;
+
+    for (;;) {
+	struct dispatch_request *req, *requests;
+	long running;
+	int st = 0;
+
+	rb_thread_call_without_gvl2(batch_wait, dispatcher, batch_ubf, dispatcher);
+	rb_protect(batch_check_ints, Qnil, &st);
+	if (st) {
+	    /* a later interrupt, e.g. Thread#kill while draining, supersedes
+	     * the earlier error as an exception raised in an ensure clause does */
+	    state = st;
+	    errinfo = rb_errinfo();
+	    batch_cancel(batch);
+	}
+
+	pthread_mutex_lock(&dispatcher->lock);
+	requests = dispatcher->requests;
+	dispatcher->requests = NULL;
+	running = dispatcher->running;
+	pthread_mutex_unlock(&dispatcher->lock);
+
+	for (req = requests; req; req = req->next) {
+	    /* the result stays NULL, which the callbacks take as an interrupt */
+	    if (dispatcher->cancelled) {
+		continue;
+	    }
+	    rb_protect(batch_call_request, (VALUE)req, &st);
+	    if (st) {
+		state = st;
+		errinfo = rb_errinfo();
+		batch_cancel(batch);
+	    }
+	}
+
+	pthread_mutex_lock(&dispatcher->lock);
+	for (req = requests; req; req = req->next) {
+	    req->done = 1;
+	}
+	pthread_cond_broadcast(&dispatcher->done);
+	pthread_mutex_unlock(&dispatcher->lock);
+
+	if (!requests && running == 0) {
+	    break;
+	}
+    }
+
+    if (state) {
+	rb_set_errinfo(errinfo);
+	rb_jump_tag(state);
+    }
+    return Qnil;
+}
+
+static VALUE
+batch_run(VALUE ptr)
+{
+    struct batch *const batch = (struct batch *)ptr;
+    pthread_attr_t attr;
+    long i;
+    int err = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RUBYJSONNET_WORKER_STACK_SIZE);
+    for (i = 0; i < batch->nworkers; ++i) {
+	struct batch_worker *const worker = &batch->workers[i];
+
+	pthread_mutex_lock(&batch->dispatcher.lock);
+	batch->dispatcher.running++;
+	pthread_mutex_unlock(&batch->dispatcher.lock);
+	err = pthread_create(&worker->thread, &attr, batch_worker_main, worker);
+	if (err) {
+	    pthread_mutex_lock(&batch->dispatcher.lock);
+	    batch->dispatcher.running--;
+	    pthread_mutex_unlock(&batch->dispatcher.lock);
+	    break;
+	}
+    }
+    pthread_attr_destroy(&attr);
+    batch->nstarted = i;
+
+    if (batch->nstarted == 0) {
+	rb_syserr_fail(err, "failed to start a Jsonnet worker thread");
+    }
+    return batch_serve(ptr);
+}
+
+static VALUE
+batch_cleanup(VALUE ptr)
+{
+    struct batch *const batch = (struct batch *)ptr;
+    long i;
+
+    for (i = 0; i < batch->nstarted; ++i) {
+	pthread_join(batch->workers[i].thread, NULL);
+    }
+    batch->vm->evaluating = 0;
+    return Qnil;
+}
+
+static VALUE
+batch_execute(VALUE ptr)
+{
+    return rb_ensure(batch_run, ptr, batch_cleanup, ptr);
+}
+
+static void
+batch_free(struct batch *batch)
+{
+    long i;
+
+    for (i = 0; i < batch->len; ++i) {
+	struct batch_item *const item = &batch->items[i];
+	if (item->result) {
+	    jsonnet_realloc(item->vm, item->result, 0);
+	}
+    }
+    for (i = 0; i < batch->nworkers; ++i) {
+	struct jsonnet_vm_wrap *const wrap = &batch->workers[i].wrap;
+	jsonnet_destroy(wrap->vm);
+	rubyjsonnet_vm_free_callbacks(wrap);
+    }
+    xfree(batch->workers);
+    xfree(batch->items);
+    pthread_cond_destroy(&batch->dispatcher.done);
+    pthread_cond_destroy(&batch->dispatcher.posted);
+    pthread_mutex_destroy(&batch->dispatcher.lock);
+}
+
+/*
+ * Converts the results of the items into Ruby objects and frees them.
+ */
+static VALUE
+batch_results(VALUE ptr)
+{
+    struct batch *const batch = (struct batch *)ptr;
+    VALUE results = rb_ary_new_capa(batch->len);
+    int state = 0;
+    long i;
+
+    for (i = 0; i < batch->len; ++i) {
+	struct batch_item *const item = &batch->items[i];
+	char *buf;
+	VALUE result;
+
+	if (!item->result) {
+	    rb_ary_push(results, Qnil);
+	    continue;
+	}
+	if (item->error) {
+	    const int st = rubyjsonnet_jump_tag(item->result);
+	    if (st) {
+		/* re-raised after freeing the other results */
+		state = state ? state : st;
+		jsonnet_realloc(item->vm, item->result, 0);
+		item->result = NULL;
+		continue;
+	    }
+	}
+	/* the constructors below free the buffer even if they raise */
+	buf = item->result;
+	item->result = NULL;
+	if (item->timed_out) {
+	    jsonnet_realloc(item->vm, buf, 0);
+	    result = rubyjsonnet_timeout_error_new(batch->vm->timeout);
+	} else if (item->error) {
+	    result = rubyjsonnet_eval_error_new(item->vm, buf, item->fname_enc);
+	} else if (batch->mode == RUBYJSONNET_EVAL_MULTI) {
+	    result = rubyjsonnet_fileset_new(item->vm, buf, item->enc, NULL);
+	} else {
+	    result = rubyjsonnet_str_new_json(item->vm, buf, item->enc);
+	}
+	rb_ary_push(results, result);
+    }
+
+    if (state) {
+	rb_jump_tag(state);
+    }
+    return results;
+}
+
+/*
+ * Returns the number of worker threads for \c len items.
+ */
+static long
+batch_nworkers(VALUE nthreads, long len)
+{
+    long nworkers = NUM2LONG(nthreads);
+
+    if (nworkers <= 0) {
+	rb_raise(rb_eArgError, "number of threads must be positive: %ld", nworkers);
+    }
+    return nworkers > len ? len : nworkers;
+}
+
+/*
+ * Runs \c batch, whose items are set up, on \c nworkers worker threads, and
+ * converts the results with \c results. Frees the batch.
+ */
+static VALUE
+batch_process(struct batch *batch, long nworkers, VALUE (*results)(VALUE))
+{
+    struct jsonnet_vm_wrap *const vm = batch->vm;
+    VALUE ret = Qnil;
+    long i;
+    int state = 0;
+
+    pthread_mutex_init(&batch->dispatcher.lock, NULL);
+    pthread_cond_init(&batch->dispatcher.posted, NULL);
+    pthread_cond_init(&batch->dispatcher.done, NULL);
+    batch->dispatcher.requests = NULL;
+    batch->dispatcher.running = 0;
+    batch->dispatcher.wakeup = 0;
+    batch->dispatcher.cancelled = 0;
+    batch->dispatcher.batch = batch;
+
+    /* the workers share the configuration and the callbacks of this VM.
+     * The VM is marked as evaluating before they copy the callbacks so that
+     * GC compaction does not move the callbacks under them. */
+    vm->evaluating = 1;
+
+    batch->nworkers = nworkers;
+    batch->nstarted = 0;
+    batch->workers = ALLOC_N(struct batch_worker, nworkers);
+    for (i = 0; i < nworkers; ++i) {
+	struct batch_worker *const worker = &batch->workers[i];
+	struct jsonnet_vm_wrap *const wrap = &worker->wrap;
+
+	MEMZERO(wrap, struct jsonnet_vm_wrap, 1);
+	worker->batch = batch;
+	wrap->vm = jsonnet_make();
+	wrap->dispatcher = &batch->dispatcher;
+	rubyjsonnet_vm_configure(wrap->vm, vm);
+	wrap->timeout = vm->timeout;
+	if (batch->kind == BATCH_EVALUATE) {
+	    rubyjsonnet_vm_copy_callbacks(wrap, vm, 1);
+	}
+	/* read-only view for the native import resolver */
+	wrap->config = vm->config;
+    }
+
+    rb_protect(batch_execute, (VALUE)batch, &state);
+    if (!state) {
+	ret = rb_protect(results, (VALUE)batch, &state);
+    }
+    batch_free(batch);
+
+    if (state) {
+	rb_jump_tag(state);
+    }
+    /* interrupts which arrived while joining the workers */
+    rb_thread_check_ints();
+    return ret;
+}
+
+
+/*
+ * Allocates the items of \c batch together with a pool of \c strsize bytes
+ * for copies of their strings. The workers read the strings without the GVL,
+ * and GC compaction can move the buffers of Ruby strings in the meantime.
+ * A single block keeps the copies from leaking if an allocation fails.
+ */
+static char *
+batch_alloc_items(struct batch *batch, long len, size_t strsize)
+{
+    const size_t itemsize = sizeof(struct batch_item) * (size_t)len;
+
+    batch->len = len;
+    batch->next = 0;
+    batch->items = ruby_xmalloc(itemsize + strsize);
+    MEMZERO(batch->items, struct batch_item, len);
+    return (char *)batch->items + itemsize;
+}
+
+/* Copies \c str, which has no NUL, into \c *pool. */
+static const char *
+batch_strdup(char **pool, VALUE str)
+{
+    char *const dup = *pool;
+    const long len = RSTRING_LEN(str);
+
+    memcpy(dup, RSTRING_PTR(str), len);
+    dup[len] = '\0';
+    *pool += len + 1;
+    return dup;
+}
+
+/*
+ * Evaluates items on native worker threads.
+ *
+ * @param [Array] items  list of [filename, snippet or nil, encoding]
+ * @param [Integer] nthreads  number of worker threads
+ * @param [Boolean] multi  enables multi-mode
+ * @return [Array] a String or a Hash for each successfully evaluated item,
+ *   or an EvaluationError for each item which failed.
+ */
+static VALUE
+vm_evaluate_many(VALUE self, VALUE items, VALUE nthreads, VALUE multi_p)
+{
+    struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
+    struct batch batch;
+    VALUE specs, results;
+    long i, nworkers;
+    size_t strsize;
+    char *pool;
+
+    items = rb_Array(items);
+    nworkers = batch_nworkers(nthreads, RARRAY_LEN(items));
+    if (nworkers == 0) {
+	return rb_ary_new();
+    }
+
+    /* Validates the items before allocating anything. */
+    specs = rb_ary_tmp_new(RARRAY_LEN(items));
+    strsize = 0;
+    for (i = 0; i < RARRAY_LEN(items); ++i) {
+	VALUE spec = rb_Array(RARRAY_AREF(items, i));
+	VALUE fname = rb_ary_entry(spec, 0);
+	VALUE snippet = rb_ary_entry(spec, 1);
+	VALUE encoding = Qnil;
+
+	FilePathValue(fname);
+	fname = rb_str_new_frozen(fname);
+	StringValueCStr(fname);
+	strsize += RSTRING_LEN(fname) + 1;
+	if (NIL_P(snippet)) {
+	    encoding = rb_enc_from_encoding(rb_to_encoding(rb_ary_entry(spec, 2)));
+	} else {
+	    rubyjsonnet_assert_asciicompat(StringValue(snippet));
+	    snippet = rb_str_new_frozen(snippet);
+	    StringValueCStr(snippet);
+	    strsize += RSTRING_LEN(snippet) + 1;
+	}
+	rb_ary_push(specs, rb_ary_new_from_args(3, fname, snippet, encoding));
+    }
+
+    batch.mode = RTEST(multi_p) ? RUBYJSONNET_EVAL_MULTI : RUBYJSONNET_EVAL_SINGLE;
+    pool = batch_alloc_items(&batch, RARRAY_LEN(specs), strsize);
+    for (i = 0; i < batch.len; ++i) {
+	struct batch_item *const item = &batch.items[i];
+	const VALUE spec = RARRAY_AREF(specs, i);
+	const VALUE fname = RARRAY_AREF(spec, 0);
+	const VALUE snippet = RARRAY_AREF(spec, 1);
+
+	item->fname = batch_strdup(&pool, fname);
+	item->fname_enc = rb_enc_get(fname);
+	if (NIL_P(snippet)) {
+	    item->enc = rb_to_encoding(RARRAY_AREF(spec, 2));
+	} else {
+	    item->snippet = batch_strdup(&pool, snippet);
+	    item->enc = rb_enc_get(snippet);
+	}
+    }
+
+    batch.vm = vm;
+    batch.kind = BATCH_EVALUATE;
+    batch.fnames = Qnil;
+    /* the workers share the callbacks and their memos of this VM */
+    rubyjsonnet_vm_reset_memos(vm);
+    results = batch_process(&batch, nworkers, batch_results);
+    RB_GC_GUARD(specs);
+    return results;
+}
+
+#ifdef HAVE_JSONNET_FMT_SNIPPET
+/*
+ * Collects the files which the formatter changed, and FormatErrors.
+ */
+static VALUE
+batch_format_results(VALUE ptr)
+{
+    struct batch *const batch = (struct batch *)ptr;
+    VALUE results = rb_ary_new();
+    long i;
+
+    for (i = 0; i < batch->len; ++i) {
+	struct batch_item *const item = &batch->items[i];
+
+	if (item->error && item->result) {
+	    char *const msg = item->result;
+	    item->result = NULL;
+	    rb_ary_push(results, rubyjsonnet_format_error_new(item->vm, msg, item->fname_enc));
+	} else if (item->changed) {
+	    rb_ary_push(results, RARRAY_AREF(batch->fnames, i));
+	}
+    }
+    return results;
+}
+
+/*
+ * Formats files on native worker threads.
+ *
+ * The formatted files are compared with the original ones in native code.
+ *
+ * @param [Array<String>] fnames  the files
+ * @param [Integer] nthreads  number of worker threads
+ * @param [Boolean] write  rewrites the files which change
+ * @return [Array<String, FormatError>] the filenames whose formatting
+ *   differs from the files, or FormatErrors for the files which failed, in
+ *   the order of +fnames+.
+ */
+static VALUE
+vm_format_many(VALUE self, VALUE fnames, VALUE nthreads, VALUE write)
+{
+    struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
+    struct batch batch;
+    VALUE specs, results;
+    long i, nworkers;
+    size_t strsize;
+    char *pool;
+
+    fnames = rb_Array(fnames);
+    nworkers = batch_nworkers(nthreads, RARRAY_LEN(fnames));
+    if (nworkers == 0) {
+	return rb_ary_new();
+    }
+
+    specs = rb_ary_tmp_new(RARRAY_LEN(fnames));
+    strsize = 0;
+    for (i = 0; i < RARRAY_LEN(fnames); ++i) {
+	VALUE fname = RARRAY_AREF(fnames, i);
+
+	FilePathValue(fname);
+	fname = rb_str_new_frozen(fname);
+	StringValueCStr(fname);
+	strsize += RSTRING_LEN(fname) + 1;
+	rb_ary_push(specs, fname);
+    }
+
+    pool = batch_alloc_items(&batch, RARRAY_LEN(specs), strsize);
+    for (i = 0; i < batch.len; ++i) {
+	struct batch_item *const item = &batch.items[i];
+	const VALUE fname = RARRAY_AREF(specs, i);
+
+	item->fname = batch_strdup(&pool, fname);
+	item->fname_enc = rb_enc_get(fname);
+    }
+
+    batch.vm = vm;
+    batch.kind = RTEST(write) ? BATCH_FORMAT_WRITE : BATCH_FORMAT_CHECK;
+    batch.mode = RUBYJSONNET_EVAL_SINGLE;
+    batch.fnames = specs;
+    results = batch_process(&batch, nworkers, batch_format_results);
+    RB_GC_GUARD(specs);
+    return results;
+}
+#endif
+
+#endif /* HAVE_PTHREAD_H */
+
+void
+rubyjsonnet_init_batch(VALUE cVM)
+{
+#ifdef HAVE_PTHREAD_H
+    rb_define_private_method(cVM, "eval_many", vm_evaluate_many, 3);
+# ifdef HAVE_JSONNET_FMT_SNIPPET
+    rb_define_private_method(cVM, "fmt_many", vm_format_many, 3);
+# endif
+#endif
+}
@@ -1,7 +1,14 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_FNMATCH_H
+# include <fnmatch.h>
+#endif
 
 #include <libjsonnet.h>
 #include <ruby/ruby.h>
+#include <ruby/util.h>
 
 #include "ruby_jsonnet.h"
 
@@ -46,11 +53,13 @@ invoke_callback(VALUE args)
  * in the right way.
  * Also the caller of the VM must handle evaluation failure caused by the
  * error message.
+ * A global escape in a callback of a batch cancels the batch, whose results
+ * are discarded by the escape anyway.
  * \sa rubyjsonnet_jump_tag
  * \sa raise_eval_error
  */
 static VALUE
-rescue_callback(int state, const char *fmt, ...)
+rescue_callback(struct jsonnet_vm_wrap *vm, int state, const char *fmt, ...)
 {
     if (state == RUBY_TAG_RAISE) {
 	VALUE err = rb_errinfo();
@@ -72,6 +81,11 @@ rescue_callback(int state, const char *fmt, ...)
      * But we'll translate the error into an non-exception global escape
      * in Ruby again in raise_eval_error().
      */
+#ifdef HAVE_PTHREAD_H
+    if (vm->dispatcher) {
+	rubyjsonnet_dispatcher_cancel(vm->dispatcher);
+    }
+#endif
     return rb_sprintf("%s%d%s", RUBYJSONNET_GLOBAL_ESCAPE_MAGIC, state,
 		      RUBYJSONNET_GLOBAL_ESCAPE_MAGIC);
 }
@@ -104,51 +118,425 @@ rubyjsonnet_jump_tag(const char *exc_mesg)
     return 0;
 }
 
+struct import_callback_args {
+    struct jsonnet_vm_wrap *vm;
+    const char *base;
+    const char *rel;
+    /* how the VM resolves imports, for the import cache */
+    const char *cache_scope;
+    char **found_here;
+    /* the content of the imported file on success, or an error message */
+    char *buf;
+    size_t buflen;
+    int success;
+};
+
+static void
+import_callback_set_buf(struct import_callback_args *args, VALUE str)
+{
 #ifdef HAVE_JSONNET_IMPORT_CALLBACK_0_19
-static int
-import_callback_entrypoint(void *ctx, const char *base, const char *rel, char **found_here,
-			   char **buf, size_t *buflen)
+    args->buf = rubyjsonnet_str_to_ptr(args->vm->vm, str, &args->buflen);
 #else
-static char *
-import_callback_entrypoint(void *ctx, const char *base, const char *rel, char **found_here,
-			   int *success)
+    args->buf = rubyjsonnet_str_to_cstr(args->vm->vm, str);
 #endif
+}
+
+/*
+ * Stores the successfully imported file in the import cache of the VM.
+ * Must be called with the GVL.
+ */
+static void *
+import_cache_store_with_gvl(void *ptr)
 {
-    struct jsonnet_vm_wrap *const vm = (struct jsonnet_vm_wrap *)ctx;
-    int state;
-    VALUE result, args;
+    const struct import_callback_args *const params = (const struct import_callback_args *)ptr;
+    rubyjsonnet_import_cache_store(rubyjsonnet_obj_to_import_cache(params->vm->import_cache),
+				   params->cache_scope, params->base, params->rel,
+				   *params->found_here, params->buf, params->buflen);
+    return NULL;
+}
 
-    args = rb_ary_tmp_new(3);
+/*
+ * Calls the import callback and converts its result for the VM.
+ * Must be called under rb_protect().
+ */
+static VALUE
+import_callback_call(VALUE ptr)
+{
+    struct import_callback_args *const params = (struct import_callback_args *)ptr;
+    struct jsonnet_vm_wrap *const vm = params->vm;
+    VALUE args, result, content, found_here;
 
+    args = rb_ary_tmp_new(3);
     rb_ary_push(args, vm->import_callback);
-    rb_ary_push(args, rb_enc_str_new_cstr(base, rb_filesystem_encoding()));
-    rb_ary_push(args, rb_enc_str_new_cstr(rel, rb_filesystem_encoding()));
-    result = rb_protect(invoke_callback, args, &state);
-
+    rb_ary_push(args, rb_enc_str_new_cstr(params->base, rb_filesystem_encoding()));
+    rb_ary_push(args, rb_enc_str_new_cstr(params->rel, rb_filesystem_encoding()));
+    result = rb_Array(invoke_callback(args));
     rb_ary_free(args);
 
-    if (state) {
-	VALUE msg = rescue_callback(state, "cannot import %s from %s", rel, base);
+    content = rb_ary_entry(result, 0);
+    found_here = rb_ary_entry(result, 1);
+    /* validated before allocating the buffers so that none of them leaks */
+    StringValueCStr(found_here);
 #ifdef HAVE_JSONNET_IMPORT_CALLBACK_0_19
-	*buf = rubyjsonnet_str_to_ptr(vm->vm, msg, buflen);
+    StringValue(content);
+#else
+    StringValueCStr(content);
+#endif
+    *params->found_here = rubyjsonnet_str_to_cstr(vm->vm, found_here);
+    import_callback_set_buf(params, content);
+    RB_GC_GUARD(args);
+    RB_GC_GUARD(result);
+    return Qnil;
+}
+
+/*
+ * Calls the import callback in Ruby. Must be called with the GVL.
+ * Errors in the callback and in its result are reported as import errors.
+ */
+static void *
+import_callback_with_gvl(void *ptr)
+{
+    struct import_callback_args *const params = (struct import_callback_args *)ptr;
+    int state;
+
+    rb_protect(import_callback_call, (VALUE)params, &state);
+    if (state) {
+	VALUE msg = rescue_callback(params->vm, state, "cannot import %s from %s", params->rel,
+				    params->base);
+	import_callback_set_buf(params, msg);
+	params->success = 0;
+	return NULL;
+    }
+    params->success = 1;
+
+    if (params->cache_scope) {
+#ifndef HAVE_JSONNET_IMPORT_CALLBACK_0_19
+	params->buflen = strlen(params->buf);
+#endif
+	import_cache_store_with_gvl(params);
+    }
+    return NULL;
+}
+
+enum import_status {
+    IMPORT_STATUS_OK,
+    IMPORT_STATUS_FILE_NOT_FOUND,
+    IMPORT_STATUS_IO_ERROR,
+};
+
+/*
+ * Reads \c rel in \c dir as the default import callback of libjsonnet does,
+ * or from the files preloaded into the import cache.
+ * Can be called without the GVL.
+ *
+ * @param[in] add_slash  appends a slash to \c dir if missing, as
+ *                       jsonnet_jpath_add() does.
+ * @param[out] err       error message on IMPORT_STATUS_IO_ERROR
+ */
+static enum import_status
+import_try_path(struct import_callback_args *args, const char *dir, const char *rel, int add_slash,
+		const char **err)
+{
+    struct JsonnetVm *const vm = args->vm->vm;
+    const size_t rel_len = strlen(rel);
+    size_t dir_len = 0, len = 0, capa = 4096, n;
+    char *path, *content;
+    FILE *fp;
+
+    if (!rel_len) {
+	*err = "the empty string is not a valid path";
+	return IMPORT_STATUS_IO_ERROR;
+    }
+    if (rel[rel_len - 1] == '/') {
+	*err = "attempted to import a directory";
+	return IMPORT_STATUS_IO_ERROR;
+    }
+    if (rel[0] != '/') {
+	dir_len = strlen(dir);
+    }
+    add_slash = add_slash && dir_len && dir[dir_len - 1] != '/';
+
+    path = jsonnet_realloc(vm, NULL, dir_len + add_slash + rel_len + 1);
+    memcpy(path, dir, dir_len);
+    if (add_slash) {
+	path[dir_len] = '/';
+    }
+    memcpy(path + dir_len + add_slash, rel, rel_len + 1);
+
+    if (!NIL_P(args->vm->import_cache) &&
+	rubyjsonnet_import_cache_read(rubyjsonnet_obj_to_import_cache(args->vm->import_cache), vm,
+				      path, &args->buf, &args->buflen)) {
+	*args->found_here = path;
+	return IMPORT_STATUS_OK;
+    }
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+	if (args->vm->track_dependencies) {
+	    rubyjsonnet_vm_add_dependency(args->vm, path, 0, 0, 1);
+	}
+	jsonnet_realloc(vm, path, 0);
+	return IMPORT_STATUS_FILE_NOT_FOUND;
+    }
+    content = jsonnet_realloc(vm, NULL, capa);
+    while ((n = fread(content + len, 1, capa - len - 1, fp)) > 0) {
+	len += n;
+	if (len + 1 == capa) {
+	    capa *= 2;
+	    content = jsonnet_realloc(vm, content, capa);
+	}
+    }
+    if (ferror(fp)) {
+	*err = strerror(errno);
+	fclose(fp);
+	jsonnet_realloc(vm, content, 0);
+	jsonnet_realloc(vm, path, 0);
+	return IMPORT_STATUS_IO_ERROR;
+    }
+    fclose(fp);
+
+    content[len] = '\0';
+    args->buf = content;
+    args->buflen = len;
+    *args->found_here = path;
+    return IMPORT_STATUS_OK;
+}
+
+/*
+ * Resolves an import without Ruby, in the same way as libjsonnet does by
+ * default: relative to the importing file first, and then in the library
+ * search paths from the last added one.
+ * Can be called without the GVL.
+ */
+static void
+import_native(struct import_callback_args *args)
+{
+    const char *err = NULL;
+    enum import_status status = import_try_path(args, args->base, args->rel, 0, &err);
+    long i;
+
+    for (i = 0; status == IMPORT_STATUS_FILE_NOT_FOUND; ++i) {
+	const char *const jpath = rubyjsonnet_vm_jpath(args->vm, i);
+	if (!jpath) {
+	    err = "no match locally or in the Jsonnet library paths.";
+	    break;
+	}
+#ifndef RUBYJSONNET_GO_JSONNET
+	/* libjsonnet ignores empty library paths, while go-jsonnet looks up
+	 * the current directory for them */
+	if (!*jpath) {
+	    continue;
+	}
+#endif
+	status = import_try_path(args, jpath, args->rel, 1, &err);
+    }
+
+    if (status == IMPORT_STATUS_OK) {
+	args->success = 1;
+	return;
+    }
+    args->buflen = strlen(err);
+    args->buf = jsonnet_realloc(args->vm->vm, NULL, args->buflen + 1);
+    memcpy(args->buf, err, args->buflen + 1);
+    args->success = 0;
+}
+
+/*
+ * Returns non-zero if \c rel should be imported by the import callback in Ruby.
+ * Without the callback, everything is imported natively.
+ */
+static int
+import_callback_handles_p(const struct jsonnet_vm_wrap *vm, const char *rel)
+{
+    long i;
+
+    if (NIL_P(vm->import_callback)) {
+	return 0;
+    }
+    if (!vm->import_patterns.len) {
 	return 1;
+    }
+    for (i = 0; i < vm->import_patterns.len; ++i) {
+	const char *const pattern = vm->import_patterns.patterns[i];
+#ifdef HAVE_FNMATCH_H
+	if (strpbrk(pattern, "*?[")) {
+	    if (!fnmatch(pattern, rel, 0)) {
+		return 1;
+	    }
+	    continue;
+	}
+#endif
+	if (!strncmp(pattern, rel, strlen(pattern))) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Records a path looked up by the current evaluation of \c vm.
+ * Can be called without the GVL. Silently gives up on memory shortage because
+ * the dependencies are only used to validate caches.
+ *
+ * @param[in] missing  non-zero if \c path was not found. Such paths make
+ *                     cached results stale when they appear.
+ * @return non-zero on success
+ */
+int
+rubyjsonnet_vm_add_dependency(struct jsonnet_vm_wrap *vm, const char *path, size_t size,
+			      uint64_t hash, int missing)
+{
+    struct rubyjsonnet_dependency *dep;
+
+    if (vm->dependencies.len == vm->dependencies.capa) {
+	const long capa = vm->dependencies.capa ? vm->dependencies.capa * 2 : 16;
+	void *const items = realloc(vm->dependencies.items, sizeof(*dep) * capa);
+	if (!items) {
+	    return 0;
+	}
+	vm->dependencies.items = items;
+	vm->dependencies.capa = capa;
+    }
+    dep = &vm->dependencies.items[vm->dependencies.len];
+    if (!(dep->path = strdup(path))) {
+	return 0;
+    }
+    dep->size = size;
+    dep->hash = hash;
+    dep->missing = missing;
+    vm->dependencies.len++;
+    return 1;
+}
+
+/*
+ * Returns what decides how \c vm resolves imports: the import callback, its
+ * patterns and the library paths. VMs sharing an import cache look up only
+ * the entries stored by the VMs with the same scope.
+ * Allocated with malloc(3), or NULL on memory shortage.
+ * Can be called without the GVL.
+ */
+static char *
+import_cache_scope(const struct jsonnet_vm_wrap *vm)
+{
+    /* room for the serial and the decimal length of each piece */
+    size_t size = 24, len = 0;
+    const char *jpath;
+    char *scope;
+    long i;
+
+    for (i = 0; i < vm->import_patterns.len; ++i) {
+	size += strlen(vm->import_patterns.patterns[i]) + 24;
+    }
+    for (i = 0; (jpath = rubyjsonnet_vm_jpath(vm, i)) != NULL; ++i) {
+	size += strlen(jpath) + 24;
+    }
+    if (!(scope = malloc(size))) {
+	return NULL;
+    }
+
+    len += snprintf(scope + len, size - len, "%lu", vm->import_callback_id);
+    for (i = 0; i < vm->import_patterns.len; ++i) {
+	const char *const pattern = vm->import_patterns.patterns[i];
+	len += snprintf(scope + len, size - len, "p%lu:%s", (unsigned long)strlen(pattern), pattern);
+    }
+    for (i = 0; (jpath = rubyjsonnet_vm_jpath(vm, i)) != NULL; ++i) {
+	len += snprintf(scope + len, size - len, "j%lu:%s", (unsigned long)strlen(jpath), jpath);
+    }
+    return scope;
+}
+
+/*
+ * Adapts the import callback in Ruby to JsonnetImportCallback.
+ * The VM calls this function without the GVL.
+ */
+#ifdef HAVE_JSONNET_IMPORT_CALLBACK_0_19
+static int
+import_callback_entrypoint(void *ctx, const char *base, const char *rel, char **found_here,
+			   char **buf, size_t *buflen)
 #else
-	*success = 0;
-	return rubyjsonnet_str_to_cstr(vm->vm, msg);
+static char *
+import_callback_entrypoint(void *ctx, const char *base, const char *rel, char **found_here,
+			   int *success)
 #endif
+{
+    struct import_callback_args args;
+    const double started = rubyjsonnet_monotonic_now();
+
+    args.vm = (struct jsonnet_vm_wrap *)ctx;
+    args.base = base;
+    args.rel = rel;
+    /* imports bypass the cache on memory shortage */
+    args.cache_scope = NIL_P(args.vm->import_cache) ? NULL : import_cache_scope(args.vm);
+    args.found_here = found_here;
+    args.buf = NULL;
+    args.buflen = 0;
+    args.success = 0;
+    if (rubyjsonnet_vm_cancelled_p(args.vm)) {
+	/* fails below */
+    } else if (args.cache_scope &&
+	rubyjsonnet_import_cache_lookup(rubyjsonnet_obj_to_import_cache(args.vm->import_cache),
+					args.vm->vm, args.cache_scope, base, rel, found_here,
+					&args.buf, &args.buflen)) {
+	args.success = 1;
+	args.vm->stats.import_cache_hits++;
+    } else if (!import_callback_handles_p(args.vm, rel)) {
+	import_native(&args);
+	if (args.success && args.cache_scope) {
+	    rubyjsonnet_call_with_gvl(args.vm, import_cache_store_with_gvl, &args);
+	}
+    } else {
+	rubyjsonnet_call_with_gvl(args.vm, import_callback_with_gvl, &args);
+    }
+    if (!args.buf) {
+	/* aborted by an interrupt, also to the Ruby thread serving a batch, or the timeout */
+	static const char msg[] = "import callback was interrupted";
+	args.buf = jsonnet_realloc(args.vm->vm, NULL, sizeof(msg));
+	memcpy(args.buf, msg, sizeof(msg));
+	args.buflen = sizeof(msg) - 1;
+	args.success = 0;
+    }
+    if (args.success && *found_here && args.vm->track_dependencies) {
+	rubyjsonnet_vm_add_dependency(args.vm, *found_here, args.buflen,
+				      rubyjsonnet_fnv1a(args.buf, args.buflen), 0);
     }
+    free((char *)args.cache_scope);
+    args.vm->stats.imports++;
+    args.vm->stats.import_time += rubyjsonnet_monotonic_now() - started;
 
-    result = rb_Array(result);
-    *found_here = rubyjsonnet_str_to_cstr(vm->vm, rb_ary_entry(result, 1));
 #ifdef HAVE_JSONNET_IMPORT_CALLBACK_0_19
-    *buf = rubyjsonnet_str_to_ptr(vm->vm, rb_ary_entry(result, 0), buflen);
-    return 0;
+    *buf = args.buf;
+    *buflen = args.buflen;
+    return args.success ? 0 : 1;
 #else
-    *success = 1;
-    return rubyjsonnet_str_to_cstr(vm->vm, rb_ary_entry(result, 0));
+    *success = args.success;
+    return args.buf;
 #endif
 }
 
+/*
+ * Registers import_callback_entrypoint() if anything needs it. Otherwise the
+ * Jsonnet implementation resolves imports by itself.
+ */
+static void
+import_register_entrypoint(struct jsonnet_vm_wrap *vm)
+{
+    if (!NIL_P(vm->import_callback) || !NIL_P(vm->import_cache) || vm->track_dependencies) {
+	jsonnet_import_callback(vm->vm, import_callback_entrypoint, vm);
+    }
+}
+
+static void
+vm_free_import_patterns(struct jsonnet_vm_wrap *vm)
+{
+    long i;
+    for (i = 0; i < vm->import_patterns.len; ++i) {
+	xfree(vm->import_patterns.patterns[i]);
+    }
+    xfree(vm->import_patterns.patterns);
+    vm->import_patterns.len = 0;
+    vm->import_patterns.patterns = NULL;
+}
+
 /*
  * Sets a custom way to resolve "import" expression.
  * @param [#call] callback receives two parameters and returns two values.
@@ -165,14 +553,252 @@ vm_set_import_callback(VALUE self, VALUE callback)
     struct jsonnet_vm_wrap *const vm = rubyjsonnet_obj_to_vm(self);
 
     vm->import_callback = callback;
-    jsonnet_import_callback(vm->vm, import_callback_entrypoint, vm);
+    vm->import_callback_id = NIL_P(callback) ? 0 : NUM2ULONG(rb_obj_id(callback));
+    vm_free_import_patterns(vm);
+    import_register_entrypoint(vm);
 
     return callback;
 }
 
+/*
+ * Limits the imports which the import callback handles.
+ * The other imports are resolved natively in the same way as Jsonnet does
+ * without the callback. Reset by #import_callback=.
+ *
+ * @param [Array<String>] patterns  prefixes of the paths to import, or
+ *   patterns of File.fnmatch if they contain "*", "?" or "[".
+ *   The callback handles all imports if empty.
+ */
+static VALUE
+vm_set_import_patterns(VALUE self, VALUE patterns)
+{
+    struct jsonnet_vm_wrap *const vm = rubyjsonnet_obj_to_vm(self);
+    long i, len;
+
+    patterns = rb_Array(patterns);
+    len = RARRAY_LEN(patterns);
+    for (i = 0; i < len; ++i) {
+	VALUE pattern = RARRAY_AREF(patterns, i);
+	StringValueCStr(pattern);
+#ifndef HAVE_FNMATCH_H
+	if (strpbrk(RSTRING_PTR(pattern), "*?[")) {
+	    rb_raise(rb_eNotImpError, "import patterns are not supported on this platform: %s",
+		     RSTRING_PTR(pattern));
+	}
+#endif
+    }
+
+    vm_free_import_patterns(vm);
+    vm->import_patterns.patterns = ALLOC_N(char *, len);
+    for (i = 0; i < len; ++i) {
+	VALUE pattern = RARRAY_AREF(patterns, i);
+	vm->import_patterns.patterns[i] = ruby_strdup(StringValueCStr(pattern));
+	vm->import_patterns.len++;
+    }
+    return patterns;
+}
+
+/*
+ * Memoizes the files imported by the import callback, or resolved natively,
+ * in the given cache.
+ * Repeated imports of the same path from the same base directory are
+ * served from the cache without calling the callback or reading the file.
+ *
+ * @param [Jsonnet::ImportCache, nil] cache  the cache. It can be shared by VMs.
+ *                                           nil disables caching.
+ */
+static VALUE
+vm_set_import_cache(VALUE self, VALUE cache)
+{
+    struct jsonnet_vm_wrap *const vm = rubyjsonnet_obj_to_vm(self);
+
+    if (!NIL_P(cache)) {
+	rubyjsonnet_obj_to_import_cache(cache);
+    }
+    vm->import_cache = cache;
+    import_register_entrypoint(vm);
+    return cache;
+}
+
+/*
+ * Records the files imported by each evaluation for #last_dependencies.
+ *
+ * Imports are resolved natively in the same way as Jsonnet does, but the
+ * resolver of this library replaces the one of the Jsonnet implementation
+ * for the VM once enabled.
+ *
+ * @param [Boolean] val  true to track the dependencies
+ */
+static VALUE
+vm_set_track_dependencies(VALUE self, VALUE val)
+{
+    struct jsonnet_vm_wrap *const vm = rubyjsonnet_obj_to_vm(self);
+
+    vm->track_dependencies = RTEST(val);
+    if (!vm->track_dependencies) {
+	rubyjsonnet_vm_clear_dependencies(vm);
+    }
+    import_register_entrypoint(vm);
+    return val;
+}
+
+/*
+ * @return [Boolean] true if the VM tracks the dependencies of evaluations.
+ * @see #track_dependencies=
+ */
+static VALUE
+vm_track_dependencies_p(VALUE self)
+{
+    return rubyjsonnet_obj_to_vm(self)->track_dependencies ? Qtrue : Qfalse;
+}
+
+/*
+ * Returns the files imported by the last evaluation by #evaluate or
+ * #evaluate_file, directly or transitively, whether resolved natively, by
+ * the import callback or from the import cache. The evaluated file itself
+ * is not included. Failed imports are not included either.
+ * Empty unless #track_dependencies= is enabled.
+ *
+ * @return [Array<Array(String, Integer, Integer)>] the resolved path, the
+ *   content hash by Jsonnet.content_hash and the size in bytes of each file,
+ *   in the order of their first import.
+ */
+static VALUE
+vm_last_dependencies(VALUE self)
+{
+    struct jsonnet_vm_wrap *const vm = rubyjsonnet_obj_to_vm(self);
+    VALUE deps = rb_ary_new_capa(vm->dependencies.len), seen = rb_hash_new();
+    long i;
+
+    for (i = 0; i < vm->dependencies.len; ++i) {
+	const struct rubyjsonnet_dependency *const dep = &vm->dependencies.items[i];
+	VALUE path;
+
+	if (dep->missing) {
+	    continue;
+	}
+	path = rb_str_new_cstr(dep->path);
+	if (RTEST(rb_hash_lookup(seen, path))) {
+	    continue;
+	}
+	rb_hash_aset(seen, path, Qtrue);
+	rb_ary_push(deps, rb_ary_new_from_args(3, path, ULL2NUM(dep->hash), SIZET2NUM(dep->size)));
+    }
+    return deps;
+}
+
+/*
+ * Returns the paths which the last evaluation looked up for imports but did
+ * not find, e.g. in the library search paths before the one which had the
+ * file. Used by Jsonnet::ResultCache.
+ *
+ * @return [Array<String>]
+ */
+static VALUE
+vm_last_missing_files(VALUE self)
+{
+    struct jsonnet_vm_wrap *const vm = rubyjsonnet_obj_to_vm(self);
+    VALUE paths = rb_ary_new(), seen = rb_hash_new();
+    long i;
+
+    for (i = 0; i < vm->dependencies.len; ++i) {
+	const struct rubyjsonnet_dependency *const dep = &vm->dependencies.items[i];
+	VALUE path;
+
+	if (!dep->missing) {
+	    continue;
+	}
+	path = rb_str_new_cstr(dep->path);
+	if (!RTEST(rb_hash_lookup(seen, path))) {
+	    rb_hash_aset(seen, path, Qtrue);
+	    rb_ary_push(paths, path);
+	}
+    }
+    return paths;
+}
+
+struct native_callback_args {
+    struct native_callback_ctx *ctx;
+    const struct JsonnetJsonValue *const *argv;
+    int success;
+    struct JsonnetJsonValue *result;
+};
+
+struct native_callback_invoke_args {
+    struct native_callback_args *params;
+    VALUE args;
+};
+
+/*
+ * Converts the arguments of a native callback, and invokes it.
+ * Parameters marked in json_params receive Ruby objects decoded from JSON
+ * strings.
+ */
+static VALUE
+native_callback_invoke(VALUE ptr)
+{
+    static const struct rubyjsonnet_parse_options json_params_options = {0, 0};
+    const struct native_callback_invoke_args *const invoke_args =
+	(const struct native_callback_invoke_args *)ptr;
+    const struct native_callback_args *const params = invoke_args->params;
+    const struct native_callback_ctx *const ctx = params->ctx;
+    struct JsonnetVm *const vm = ctx->vm->vm;
+    long i;
+
+    rb_ary_push(invoke_args->args, ctx->callback);
+    for (i = 0; i < ctx->arity; ++i) {
+	const char *json;
+	if (ctx->json_params && ctx->json_params[i] &&
+	    (json = jsonnet_json_extract_string(vm, params->argv[i]))) {
+	    rb_ary_push(invoke_args->args, rubyjsonnet_parse_json(json, &json_params_options));
+	} else {
+	    rb_ary_push(invoke_args->args, rubyjsonnet_json_to_obj(vm, params->argv[i]));
+	}
+    }
+    return invoke_callback(invoke_args->args);
+}
+
+/*
+ * Calls a native callback in Ruby. Must be called with the GVL.
+ */
+static void *
+native_callback_with_gvl(void *ptr)
+{
+    int state = 0;
+
+    struct native_callback_args *const params = (struct native_callback_args *)ptr;
+    struct native_callback_ctx *const ctx = params->ctx;
+    struct JsonnetVm *const vm = ctx->vm->vm;
+    struct native_callback_invoke_args invoke_args;
+    VALUE result;
+
+    invoke_args.params = params;
+    invoke_args.args = rb_ary_tmp_new(ctx->arity + 1);
+    result = rb_protect(native_callback_invoke, (VALUE)&invoke_args, &state);
+
+    rb_ary_free(invoke_args.args);
+
+    if (state) {
+	VALUE msg = rescue_callback(ctx->vm, state, "something wrong in %" PRIsVALUE,
+				    ctx->callback);
+	params->success = 0;
+	params->result = rubyjsonnet_obj_to_json(vm, msg, &state);
+	return NULL;
+    }
+
+    if (ctx->memo) {
+	params->result = rubyjsonnet_memo_store(ctx->memo, vm, params->argv, ctx->arity, result,
+						&params->success);
+	return NULL;
+    }
+    params->result = rubyjsonnet_obj_to_json(vm, result, &params->success);
+    return NULL;
+}
+
 /**
  * Generic entrypoint of native callbacks which adapts callable objects in Ruby to \c
  * JsonnetNativeCallback.
+ * The VM calls this function without the GVL.
  *
  * @param[in] data pointer to a {\c struct native_callback_ctx}
  * @param[in] argv NULL-terminated array of arguments
@@ -182,70 +808,94 @@ vm_set_import_callback(VALUE self, VALUE callback)
 static struct JsonnetJsonValue *
 native_callback_entrypoint(void *data, const struct JsonnetJsonValue *const *argv, int *success)
 {
-    long i;
-    int state = 0;
+    struct native_callback_args args;
+    const double started = rubyjsonnet_monotonic_now();
 
-    struct native_callback_ctx *const ctx = (struct native_callback_ctx *)data;
-    struct JsonnetVm *const vm = rubyjsonnet_obj_to_vm(ctx->vm)->vm;
-    VALUE result, args = rb_ary_tmp_new(ctx->arity + 1);
-
-    rb_ary_push(args, ctx->callback);
-    for (i = 0; i < ctx->arity; ++i) {
-	rb_ary_push(args, rubyjsonnet_json_to_obj(vm, argv[i]));
+    args.ctx = (struct native_callback_ctx *)data;
+    args.argv = argv;
+    args.success = 0;
+    args.result = NULL;
+    if (rubyjsonnet_vm_cancelled_p(args.ctx->vm)) {
+	*success = 0;
+	return jsonnet_json_make_string(args.ctx->vm->vm, "native callback was interrupted");
     }
-
-    result = rb_protect(invoke_callback, args, &state);
-
-    rb_ary_free(args);
-
-    if (state) {
-	VALUE msg = rescue_callback(state, "something wrong in %" PRIsVALUE, ctx->callback);
+    if (args.ctx->memo) {
+	args.result =
+	    rubyjsonnet_memo_lookup(args.ctx->memo, args.ctx->vm->vm, argv, args.ctx->arity);
+	args.success = args.result != NULL;
+    }
+    if (!args.result) {
+	rubyjsonnet_call_with_gvl(args.ctx->vm, native_callback_with_gvl, &args);
+    }
+    args.ctx->calls++;
+    args.ctx->time += rubyjsonnet_monotonic_now() - started;
+    if (!args.result) {
+	/* aborted by an interrupt, also to the Ruby thread serving a batch, or the timeout */
 	*success = 0;
-	return rubyjsonnet_obj_to_json(vm, msg, &state);
+	return jsonnet_json_make_string(args.ctx->vm->vm, "native callback was interrupted");
     }
 
-    return rubyjsonnet_obj_to_json(vm, result, success);
+    *success = args.success;
+    return args.result;
 }
 
 /*
  * Registers a native extension written in Ruby.
  * @param callback [#call] a PURE callable object
  * @param params [Array]   names of the parameters of the function
+ * @param memo [Array, nil] memoizes the results if non-nil. A pair of
+ *   whether the memo is cleared per evaluation and the maximum number of
+ *   results (nil for unlimited).
+ * @param json_params [Array, nil] flags of the parameters which receive
+ *   JSON documents as strings and decode them.
  */
 static VALUE
-vm_register_native_callback(VALUE self, VALUE name, VALUE callback, VALUE params)
+vm_register_native_callback(VALUE self, VALUE name, VALUE callback, VALUE params, VALUE memo,
+			    VALUE json_params)
 {
-    struct {
-	volatile VALUE store;
-	long len;
-	const char **buf;
-    } cstr_params;
     struct native_callback_ctx *ctx;
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    long i;
+    const char **cstr_params;
+    long i, len;
 
     name = rb_to_symbol(name);
     rubyjsonnet_assert_asciicompat(name);
 
     params = rb_Array(params);
-    cstr_params.len = RARRAY_LEN(params);
-    cstr_params.buf = (const char **)rb_alloc_tmp_buffer(
-	&cstr_params.store, sizeof(const char *const) * (cstr_params.len + 1));
-    for (i = 0; i < cstr_params.len; ++i) {
-	const VALUE pname = rb_to_symbol(RARRAY_AREF(params, i));
-	rubyjsonnet_assert_asciicompat(pname);
-	cstr_params.buf[i] = rb_id2name(RB_SYM2ID(pname));
+    len = RARRAY_LEN(params);
+    for (i = 0; i < len; ++i) {
+	rubyjsonnet_assert_asciicompat(rb_to_symbol(RARRAY_AREF(params, i)));
+    }
+    /* names of static symbols live as long as the process */
+    cstr_params = ALLOC_N(const char *, len + 1);
+    for (i = 0; i < len; ++i) {
+	cstr_params[i] = rb_id2name(rb_to_id(RARRAY_AREF(params, i)));
     }
-    cstr_params.buf[cstr_params.len] = NULL;
+    cstr_params[len] = NULL;
 
     ctx = RB_ALLOC_N(struct native_callback_ctx, 1);
     ctx->callback = callback;
-    ctx->arity = cstr_params.len;
-    ctx->vm = self;
-    jsonnet_native_callback(vm->vm, rb_id2name(RB_SYM2ID(name)), native_callback_entrypoint, ctx,
-			    cstr_params.buf);
-
-    rb_free_tmp_buffer(&cstr_params.store);
+    ctx->arity = len;
+    ctx->vm = vm;
+    ctx->name = rb_id2name(RB_SYM2ID(name));
+    ctx->params = cstr_params;
+    ctx->memo = NULL;
+    ctx->json_params = NULL;
+    ctx->shared = 0;
+    ctx->calls = 0;
+    ctx->time = 0;
+    if (!NIL_P(json_params)) {
+	ctx->json_params = ALLOC_N(char, len);
+	for (i = 0; i < len; ++i) {
+	    ctx->json_params[i] = RTEST(rb_ary_entry(json_params, i));
+	}
+    }
+    if (!NIL_P(memo)) {
+	VALUE max_size = rb_ary_entry(memo, 1);
+	ctx->memo = rubyjsonnet_memo_new(NIL_P(max_size) ? 0 : NUM2LONG(max_size),
+					 RTEST(rb_ary_entry(memo, 0)));
+    }
+    jsonnet_native_callback(vm->vm, ctx->name, native_callback_entrypoint, ctx, ctx->params);
 
     RB_REALLOC_N(vm->native_callbacks.contexts, struct native_callback_ctx *,
 		 vm->native_callbacks.len + 1);
@@ -255,11 +905,225 @@ vm_register_native_callback(VALUE self, VALUE name, VALUE callback, VALUE params
     return name;
 }
 
+/**
+ * Lets \c dst call the same callbacks as \c src.
+ *
+ * \c dst->vm must be a VM whose callbacks are not configured yet.
+ * If \c shared is non-zero, the memos of the native callbacks are shared with
+ * \c src. So \c src must outlive \c dst. Otherwise \c dst gets its own empty
+ * memos.
+ */
+void
+rubyjsonnet_vm_copy_callbacks(struct jsonnet_vm_wrap *dst, const struct jsonnet_vm_wrap *src,
+			      int shared)
+{
+    long i;
+
+    dst->import_callback = src->import_callback;
+    dst->import_callback_id = src->import_callback_id;
+    dst->import_cache = src->import_cache;
+    dst->track_dependencies = src->track_dependencies;
+    dst->import_patterns.len = 0;
+    dst->import_patterns.patterns = ALLOC_N(char *, src->import_patterns.len);
+    for (i = 0; i < src->import_patterns.len; ++i) {
+	dst->import_patterns.patterns[i] = ruby_strdup(src->import_patterns.patterns[i]);
+	dst->import_patterns.len++;
+    }
+
+    dst->native_callbacks.len = 0;
+    dst->native_callbacks.contexts = ALLOC_N(struct native_callback_ctx *, src->native_callbacks.len);
+    for (i = 0; i < src->native_callbacks.len; ++i) {
+	const struct native_callback_ctx *const orig = src->native_callbacks.contexts[i];
+	struct native_callback_ctx *const ctx = ALLOC(struct native_callback_ctx);
+	long j;
+
+	*ctx = *orig;
+	ctx->vm = dst;
+	ctx->shared = shared;
+	ctx->calls = 0;
+	ctx->time = 0;
+	if (!shared) {
+	    if (orig->json_params) {
+		ctx->json_params = ALLOC_N(char, orig->arity);
+		MEMCPY(ctx->json_params, orig->json_params, char, orig->arity);
+	    }
+	    if (orig->memo) {
+		ctx->memo = rubyjsonnet_memo_new_like(orig->memo);
+	    }
+	}
+	ctx->params = ALLOC_N(const char *, orig->arity + 1);
+	for (j = 0; j <= orig->arity; ++j) {
+	    ctx->params[j] = orig->params[j];
+	}
+
+	dst->native_callbacks.contexts[i] = ctx;
+	dst->native_callbacks.len++;
+    }
+    rubyjsonnet_vm_register_callbacks(dst);
+}
+
+/**
+ * Registers the callbacks of \c vm to \c vm->vm.
+ * Used when \c vm->vm is replaced with a new JsonnetVm.
+ */
+void
+rubyjsonnet_vm_register_callbacks(struct jsonnet_vm_wrap *vm)
+{
+    long i;
+
+    import_register_entrypoint(vm);
+    for (i = 0; i < vm->native_callbacks.len; ++i) {
+	struct native_callback_ctx *const ctx = vm->native_callbacks.contexts[i];
+	jsonnet_native_callback(vm->vm, ctx->name, native_callback_entrypoint, ctx, ctx->params);
+    }
+}
+
+/**
+ * Returns the number of bytes used for the callbacks of \c vm.
+ * Memos shared with another VM are counted only for their owner.
+ */
+size_t
+rubyjsonnet_vm_callbacks_memsize(const struct jsonnet_vm_wrap *vm)
+{
+    long i;
+    size_t size = sizeof(char *) * vm->import_patterns.len;
+
+    for (i = 0; i < vm->import_patterns.len; ++i) {
+	size += strlen(vm->import_patterns.patterns[i]) + 1;
+    }
+    size += sizeof(struct rubyjsonnet_dependency) * vm->dependencies.capa;
+    for (i = 0; i < vm->dependencies.len; ++i) {
+	size += strlen(vm->dependencies.items[i].path) + 1;
+    }
+    size += sizeof(struct native_callback_ctx *) * vm->native_callbacks.len;
+    for (i = 0; i < vm->native_callbacks.len; ++i) {
+	const struct native_callback_ctx *const ctx = vm->native_callbacks.contexts[i];
+
+	size += sizeof(*ctx) + sizeof(const char *) * (ctx->arity + 1);
+	if (ctx->shared) {
+	    continue;
+	}
+	if (ctx->json_params) {
+	    size += ctx->arity;
+	}
+	if (ctx->memo) {
+	    size += rubyjsonnet_memo_memsize(ctx->memo);
+	}
+    }
+    return size;
+}
+
+/**
+ * Appends the configuration of the callbacks in \c vm which can change the
+ * results of evaluations to \c key. See Jsonnet::VM#config_key.
+ * Native functions are identified only by their names and parameters.
+ */
+void
+rubyjsonnet_vm_callbacks_key(const struct jsonnet_vm_wrap *vm, VALUE key)
+{
+    long i, j;
+
+    rb_str_cat_cstr(key, NIL_P(vm->import_callback) ? "-" : "import_callback");
+    rb_str_cat(key, "", 1);
+    for (i = 0; i < vm->import_patterns.len; ++i) {
+	rb_str_cat(key, vm->import_patterns.patterns[i],
+		   strlen(vm->import_patterns.patterns[i]) + 1);
+    }
+    rb_str_cat(key, "", 1);
+    for (i = 0; i < vm->native_callbacks.len; ++i) {
+	const struct native_callback_ctx *const ctx = vm->native_callbacks.contexts[i];
+
+	rb_str_cat(key, ctx->name, strlen(ctx->name) + 1);
+	for (j = 0; j < ctx->arity; ++j) {
+	    rb_str_cat_cstr(key, ctx->json_params && ctx->json_params[j] ? "json:" : "");
+	    rb_str_cat(key, ctx->params[j], strlen(ctx->params[j]) + 1);
+	}
+	rb_str_cat(key, "", 1);
+    }
+}
+
+/**
+ * Releases the contexts of the callbacks in \c vm.
+ */
+void
+rubyjsonnet_vm_free_callbacks(struct jsonnet_vm_wrap *vm)
+{
+    long i;
+    for (i = 0; i < vm->native_callbacks.len; ++i) {
+	struct native_callback_ctx *ctx = vm->native_callbacks.contexts[i];
+	if (!ctx->shared) {
+	    if (ctx->memo) {
+		rubyjsonnet_memo_free(ctx->memo);
+	    }
+	    xfree(ctx->json_params);
+	}
+	xfree(ctx->params);
+	xfree(ctx);
+    }
+    xfree(vm->native_callbacks.contexts);
+    vm->native_callbacks.len = 0;
+    vm->native_callbacks.contexts = NULL;
+    vm_free_import_patterns(vm);
+    rubyjsonnet_vm_clear_dependencies(vm);
+    free(vm->dependencies.items);
+    vm->dependencies.capa = 0;
+    vm->dependencies.items = NULL;
+}
+
+/**
+ * Clears the per-evaluation memos of the native callbacks in \c vm.
+ */
+void
+rubyjsonnet_vm_reset_memos(struct jsonnet_vm_wrap *vm)
+{
+    long i;
+    for (i = 0; i < vm->native_callbacks.len; ++i) {
+	struct native_callback_ctx *ctx = vm->native_callbacks.contexts[i];
+	if (ctx->memo && !ctx->shared) {
+	    rubyjsonnet_memo_reset(ctx->memo);
+	}
+    }
+}
+
+/**
+ * Clears the statistics of \c vm and its native callbacks.
+ */
+void
+rubyjsonnet_vm_reset_stats(struct jsonnet_vm_wrap *vm)
+{
+    long i;
+
+    MEMZERO(&vm->stats, struct rubyjsonnet_stats, 1);
+    for (i = 0; i < vm->native_callbacks.len; ++i) {
+	vm->native_callbacks.contexts[i]->calls = 0;
+	vm->native_callbacks.contexts[i]->time = 0;
+    }
+}
+
+/**
+ * Forgets the files imported by the last evaluation of \c vm.
+ */
+void
+rubyjsonnet_vm_clear_dependencies(struct jsonnet_vm_wrap *vm)
+{
+    long i;
+    for (i = 0; i < vm->dependencies.len; ++i) {
+	free(vm->dependencies.items[i].path);
+    }
+    vm->dependencies.len = 0;
+}
+
 void
 rubyjsonnet_init_callbacks(VALUE cVM)
 {
     id_call = rb_intern("call");
 
     rb_define_method(cVM, "import_callback=", vm_set_import_callback, 1);
-    rb_define_private_method(cVM, "register_native_callback", vm_register_native_callback, 3);
+    rb_define_method(cVM, "import_cache=", vm_set_import_cache, 1);
+    rb_define_private_method(cVM, "import_patterns=", vm_set_import_patterns, 1);
+    rb_define_method(cVM, "track_dependencies=", vm_set_track_dependencies, 1);
+    rb_define_method(cVM, "track_dependencies?", vm_track_dependencies_p, 0);
+    rb_define_method(cVM, "last_dependencies", vm_last_dependencies, 0);
+    rb_define_private_method(cVM, "last_missing_files", vm_last_missing_files, 0);
+    rb_define_private_method(cVM, "register_native_callback", vm_register_native_callback, 5);
 }
@@ -1,11 +1,63 @@
 require 'mkmf'
 require 'fileutils'
+require 'shellwords'
+
+# Links libgojsonnet, the C API of go-jsonnet, instead of the C++ libjsonnet.
+# Experimental; CI tests it only with go-jsonnet v0.20.0. Implies --use-system-libraries. libjsonnet.h of the same version must be
+# installed as well, e.g. from cpp-jsonnet/include of go-jsonnet.
+def using_go_jsonnet?
+  arg_config('--use-go-jsonnet', !!ENV['JSONNET_USE_GO_JSONNET'])
+end
 
 def using_system_libraries?
-  arg_config('--use-system-libraries', !!ENV['JSONNET_USE_SYSTEM_LIBRARIES'])
+  using_go_jsonnet? ||
+    arg_config('--use-system-libraries', !!ENV['JSONNET_USE_SYSTEM_LIBRARIES'])
+end
+
+# Opt-in optimizations of the packaged libjsonnet and this extension.
+#
+#   --enable-lto                    builds both with -O3 and link-time optimization,
+#                                   so that calls between them can be inlined
+#   --with-pgo=generate|use         builds with profile-guided optimization.
+#                                   "generate" writes profiles into the directory
+#                                   given by --with-pgo-dir, and "use" reads them.
+#                                   `rake compile:pgo` runs both steps with the
+#                                   benchmarks as the training workload.
+#
+# JSONNET_LTO, JSONNET_PGO and JSONNET_PGO_DIR environment variables work as well.
+def lto?
+  enable_config('lto', !!ENV['JSONNET_LTO'])
+end
+
+def pgo_mode
+  mode = with_config('pgo', ENV['JSONNET_PGO'])
+  return nil unless mode
+  abort "unknown PGO mode: #{mode}. Must be generate or use" unless %w[generate use].include?(mode)
+  abort 'PGO is supported only with GCC' if RbConfig::CONFIG['CC'].include?('clang')
+  mode
+end
+
+def pgo_dir
+  File.expand_path(with_config('pgo-dir', ENV['JSONNET_PGO_DIR'] || '../../bench/results/pgo'),
+                   __dir__)
+end
+
+def optimization_flags
+  flags = []
+  flags << '-O3' << '-flto=auto' << '-fno-fat-lto-objects' if lto?
+  case pgo_mode
+  when 'generate'
+    flags << "-fprofile-generate=#{pgo_dir}" << '-fprofile-update=atomic'
+  when 'use'
+    flags << "-fprofile-use=#{pgo_dir}" << '-fprofile-correction' << '-Wno-missing-profile'
+  end
+  flags
 end
 
+OPTIMIZATION_FLAGS = optimization_flags
+
 dir_config('jsonnet')
+dir_config('gojsonnet') if using_go_jsonnet?
 
 unless using_system_libraries?
   message "Building jsonnet using packaged libraries.\n"
@@ -16,6 +68,9 @@ unless using_system_libraries?
   recipe = MiniPortile.new('jsonnet', 'v0.20.0')
   recipe.files = ['https://github.com/google/jsonnet/archive/v0.20.0.tar.gz']
   class << recipe
+    # extra flags for the compiler, and whether they enable LTO
+    attr_accessor :optimization_flags, :lto
+
     CORE_OBJS = %w[
       desugarer.o formatter.o lexer.o libjsonnet.o parser.o pass.o static_analysis.o string_utils.o vm.o
     ].map {|name| File.join('core', name) }
@@ -42,8 +97,14 @@ unless using_system_libraries?
       # however that won't be bundled into the compiled output so instead
       # we compile the c into .o files and then create an archive that can
       # be linked to
-      execute('compile', make_cmd)
-      execute('archive', 'ar rcs libjsonnet.a ' + target_object_files.join(' '))
+      if optimization_flags.empty?
+        execute('compile', make_cmd)
+      else
+        # OPT is where the Makefile of jsonnet puts its optimization flags
+        opt = Shellwords.escape((['-O3'] + optimization_flags).uniq.join(' '))
+        execute('compile', "#{make_cmd} OPT=#{opt}")
+      end
+      execute('archive', "#{archiver} rcs libjsonnet.a " + target_object_files.join(' '))
     end
 
     def configured?
@@ -62,6 +123,13 @@ unless using_system_libraries?
     end
 
     private
+    # LTO objects must be archived with the plugin of the compiler
+    def archiver
+      return ENV['AR'] if ENV['AR']
+      return 'ar' unless lto
+      RbConfig::CONFIG['CC'].include?('clang') ? 'llvm-ar' : 'gcc-ar'
+    end
+
     def target_object_files
       if version >= 'v0.18.0'
         CORE_OBJS + MD5_OBJS + C4_CORE_OBJS + RAPID_YAML_OBJS
@@ -71,6 +139,14 @@ unless using_system_libraries?
     end
   end
 
+  recipe.optimization_flags = OPTIMIZATION_FLAGS
+  recipe.lto = lto?
+  unless OPTIMIZATION_FLAGS.empty?
+    # keeps the default build apart from the optimized ones
+    variant = [lto? && 'lto', pgo_mode && "pgo-#{pgo_mode}"].compact.join('-')
+    recipe.target = File.join(recipe.target, variant)
+    message "Optimizing jsonnet with #{OPTIMIZATION_FLAGS.join(' ')}\n"
+  end
   recipe.cook
   # I tried using recipe.activate here but that caused this file to build ok
   # but the makefile to fail. These commands add the necessary paths to do both
@@ -87,8 +163,24 @@ if rbconfig['LDSHAREDXX']
 end
 
 abort 'libjsonnet.h not found' unless have_header('libjsonnet.h')
-abort 'libjsonnet not found' unless have_library('jsonnet')
-have_header('libjsonnet_fmt.h')
+fmt_header = have_header('libjsonnet_fmt.h')
+if using_go_jsonnet?
+  abort 'libgojsonnet not found' unless have_library('gojsonnet', 'jsonnet_make', 'libjsonnet.h')
+  $defs.push('-DRUBYJSONNET_GO_JSONNET')
+  # go-jsonnet implements the formatter in its C API only in some versions
+  have_func('jsonnet_fmt_snippet', fmt_header ? %w[libjsonnet.h libjsonnet_fmt.h] : 'libjsonnet.h')
+else
+  abort 'libjsonnet not found' unless have_library('jsonnet')
+  # The C++ implementation always has the formatter. Linking a test program
+  # against the static libjsonnet.a fails without the C++ runtime.
+  $defs.push('-DHAVE_JSONNET_FMT_SNIPPET')
+end
+have_func('rb_enc_interned_str', 'ruby/encoding.h')
+have_func('rb_gc_mark_movable', 'ruby.h')
+have_func('rb_io_mode', 'ruby/io.h')
+have_header('fnmatch.h')
+have_func('realpath', 'stdlib.h')
+have_header('sys/inotify.h')
 
 import_callback_0_19 = checking_for checking_message('JsonnetImportCallback >= v0.19.0') do
   try_compile(<<SRC, '-Werror=incompatible-pointer-types')
@@ -106,4 +198,10 @@ if import_callback_0_19
   $defs.push('-DHAVE_JSONNET_IMPORT_CALLBACK_0_19')
 end
 
+# after the checks above, which need not be optimized
+unless OPTIMIZATION_FLAGS.empty?
+  $CFLAGS << ' ' << OPTIMIZATION_FLAGS.join(' ')
+  $LDFLAGS << ' ' << OPTIMIZATION_FLAGS.join(' ')
+end
+
 create_makefile('jsonnet/jsonnet_wrap')
@@ -91,10 +91,42 @@ rubyjsonnet_format_exception(VALUE exc)
     return Qnil;
 }
 
+/**
+ * Returns the 64-bit FNV-1a hash of \c len bytes at \c ptr.
+ * Can be called without the GVL.
+ */
+uint64_t
+rubyjsonnet_fnv1a(const char *ptr, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+	hash ^= (unsigned char)ptr[i];
+	hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * call-seq:
+ *  Jsonnet.content_hash(str) -> Integer
+ *
+ * Returns the hash which VMs record for the contents of imported files,
+ * i.e. 64-bit FNV-1a.
+ */
+static VALUE
+jw_s_content_hash(VALUE mod, VALUE str)
+{
+    StringValue(str);
+    return ULL2NUM(rubyjsonnet_fnv1a(RSTRING_PTR(str), RSTRING_LEN(str)));
+}
+
 void
 rubyjsonnet_init_helpers(VALUE mJsonnet)
 {
     id_message = rb_intern("message");
     eUnsupportedEncodingError =
 	rb_define_class_under(mJsonnet, "UnsupportedEncodingError", rb_eEncodingError);
+    rb_define_singleton_method(mJsonnet, "content_hash", jw_s_content_hash, 1);
 }
@@ -0,0 +1,527 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libjsonnet.h>
+#include <ruby/ruby.h>
+#include <ruby/st.h>
+#include <ruby/thread_native.h>
+
+#include "ruby_jsonnet.h"
+
+/*
+ * Memoizes the results of import callbacks.
+ *
+ * Lookups run without the GVL, on whichever thread libjsonnet calls the
+ * import callback from. So the cache is guarded by a native lock, and
+ * lookups never modify the table.
+ */
+
+/*
+ * Cache of files imported by Jsonnet::VM#handle_import or
+ * Jsonnet::VM#import_callback=.
+ *
+ * call-seq:
+ *   Jsonnet::ImportCache
+ */
+static VALUE cImportCache;
+
+struct import_cache_entry {
+    char *found_here;
+    char *content;
+    size_t len;
+    /* non-zero if found_here was a file when the entry was stored */
+    int has_stat;
+    time_t mtime;
+    long mtime_nsec;
+    off_t size;
+};
+
+struct rubyjsonnet_import_cache {
+    rb_nativethread_lock_t lock;
+    /* "<length of scope>:<scope><length of base>:<base><rel>"
+     * => struct import_cache_entry * */
+    st_table *entries;
+    /* real path of a preloaded file => struct import_cache_entry * */
+    st_table *files;
+    int check_mtime;
+    size_t hits;
+    size_t misses;
+};
+
+static void import_cache_free(void *ptr);
+static void import_cache_insert(struct rubyjsonnet_import_cache *cache, st_table *table, char *key,
+				const char *found_here, const char *content, size_t len);
+static size_t import_cache_memsize(const void *ptr);
+
+static const rb_data_type_t import_cache_type = {
+    "JsonnetImportCache",
+    {
+	/* dmark = */ NULL,
+	/* dfree = */ import_cache_free,
+	/* dsize = */ import_cache_memsize,
+    },
+    /* parent = */ NULL,
+    /* data = */ NULL,
+    /* flags = */ RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/*
+ * Returns the key of the file imported as \c rel from \c base by VMs which
+ * resolve imports in the way described by \c scope, or NULL on memory shortage.
+ */
+static char *
+import_cache_key(const char *scope, const char *base, const char *rel)
+{
+    const size_t scope_len = strlen(scope), base_len = strlen(base), rel_len = strlen(rel);
+    /* enough room for the decimal lengths of scope and base */
+    const size_t size = scope_len + base_len + rel_len + 48;
+    char *const key = malloc(size);
+
+    if (key) {
+	snprintf(key, size, "%lu:%s%lu:%s%s", (unsigned long)scope_len, scope,
+		 (unsigned long)base_len, base, rel);
+    }
+    return key;
+}
+
+static int
+entry_stat(const char *path, time_t *mtime, long *mtime_nsec, off_t *size)
+{
+    struct stat st;
+
+    if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+	return 0;
+    }
+    *mtime = st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    *mtime_nsec = st.st_mtim.tv_nsec;
+#else
+    *mtime_nsec = 0;
+#endif
+    *size = st.st_size;
+    return 1;
+}
+
+/*
+ * Returns non-zero if the file of \c entry is unchanged since it was stored.
+ * Entries whose paths were not files cannot get stale.
+ */
+static int
+entry_fresh_p(const struct import_cache_entry *entry)
+{
+    time_t mtime;
+    long mtime_nsec;
+    off_t size;
+
+    if (!entry->has_stat) {
+	return 1;
+    }
+    return entry_stat(entry->found_here, &mtime, &mtime_nsec, &size) && mtime == entry->mtime &&
+	   mtime_nsec == entry->mtime_nsec && size == entry->size;
+}
+
+static void
+entry_free(struct import_cache_entry *entry)
+{
+    free(entry->found_here);
+    free(entry->content);
+    free(entry);
+}
+
+/* Returns the size of the memory allocated for an entry and its key. */
+static size_t
+entry_memsize(const char *key, const struct import_cache_entry *entry)
+{
+    return strlen(key) + 1 + sizeof(*entry) + strlen(entry->found_here) + 1 + entry->len;
+}
+
+/*
+ * Frees an entry in the table. The entries are allocated with malloc(3), so
+ * their size is reported to the GC with rb_gc_adjust_memory_usage().
+ */
+static int
+entry_free_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+    struct import_cache_entry *const entry = (struct import_cache_entry *)value;
+
+    rb_gc_adjust_memory_usage(-(ssize_t)entry_memsize((const char *)key, entry));
+    free((char *)key);
+    entry_free(entry);
+    return ST_DELETE;
+}
+
+static void
+import_cache_free(void *ptr)
+{
+    struct rubyjsonnet_import_cache *const cache = (struct rubyjsonnet_import_cache *)ptr;
+
+    st_foreach(cache->entries, entry_free_i, 0);
+    st_free_table(cache->entries);
+    st_foreach(cache->files, entry_free_i, 0);
+    st_free_table(cache->files);
+    rb_nativethread_lock_destroy(&cache->lock);
+    xfree(cache);
+}
+
+static int
+entry_memsize_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+    size_t *const total = (size_t *)arg;
+
+    *total += entry_memsize((const char *)key, (const struct import_cache_entry *)value);
+    return ST_CONTINUE;
+}
+
+static size_t
+import_cache_memsize(const void *ptr)
+{
+    const struct rubyjsonnet_import_cache *const cache =
+	(const struct rubyjsonnet_import_cache *)ptr;
+    size_t total = sizeof(*cache) + st_memsize(cache->entries) + st_memsize(cache->files);
+
+    st_foreach(cache->entries, entry_memsize_i, (st_data_t)&total);
+    st_foreach(cache->files, entry_memsize_i, (st_data_t)&total);
+    return total;
+}
+
+static VALUE
+import_cache_s_allocate(VALUE klass)
+{
+    struct rubyjsonnet_import_cache *cache;
+    VALUE self = TypedData_Make_Struct(klass, struct rubyjsonnet_import_cache, &import_cache_type,
+				       cache);
+
+    rb_nativethread_lock_initialize(&cache->lock);
+    cache->entries = st_init_strtable();
+    cache->files = st_init_strtable();
+    cache->check_mtime = 1;
+    cache->hits = 0;
+    cache->misses = 0;
+    return self;
+}
+
+/**
+ * Returns the cache wrapped by \c obj.
+ * @throw TypeError if \c obj is not a Jsonnet::ImportCache.
+ */
+struct rubyjsonnet_import_cache *
+rubyjsonnet_obj_to_import_cache(VALUE obj)
+{
+    struct rubyjsonnet_import_cache *cache;
+    TypedData_Get_Struct(obj, struct rubyjsonnet_import_cache, &import_cache_type, cache);
+    return cache;
+}
+
+/**
+ * Looks up the file imported as \c rel from \c base.
+ * Can be called without the GVL.
+ *
+ * @param[in]  cache      a cache
+ * @param[in]  vm         a JsonnetVm which allocates \c *found_here and \c *buf.
+ * @param[in]  scope      how the importing VM resolves imports. Entries stored
+ *                        with another scope are not looked up.
+ * @param[out] found_here the resolved path of the file on hit
+ * @param[out] buf        the content of the file on hit
+ * @param[out] buflen     the length of \c *buf on hit
+ * @return non-zero on hit.
+ */
+int
+rubyjsonnet_import_cache_lookup(struct rubyjsonnet_import_cache *cache, struct JsonnetVm *vm,
+				const char *scope, const char *base, const char *rel,
+				char **found_here, char **buf, size_t *buflen)
+{
+    char *const key = import_cache_key(scope, base, rel);
+    st_data_t value;
+    int hit = 0;
+
+    if (!key) {
+	return 0;
+    }
+
+    rb_nativethread_lock_lock(&cache->lock);
+    if (st_lookup(cache->entries, (st_data_t)key, &value)) {
+	struct import_cache_entry *const entry = (struct import_cache_entry *)value;
+
+	if (!cache->check_mtime || entry_fresh_p(entry)) {
+	    const size_t path_len = strlen(entry->found_here);
+
+	    *found_here = jsonnet_realloc(vm, NULL, path_len + 1);
+	    memcpy(*found_here, entry->found_here, path_len + 1);
+	    /* NUL-terminated also for libjsonnet older than v0.19 */
+	    *buf = jsonnet_realloc(vm, NULL, entry->len + 1);
+	    memcpy(*buf, entry->content, entry->len);
+	    (*buf)[entry->len] = '\0';
+	    *buflen = entry->len;
+	    hit = 1;
+	}
+	/* a stale entry is replaced by rubyjsonnet_import_cache_store() later */
+    }
+    if (hit) {
+	cache->hits++;
+    } else {
+	cache->misses++;
+    }
+    rb_nativethread_lock_unlock(&cache->lock);
+
+    free(key);
+    return hit;
+}
+
+/**
+ * Stores the file imported as \c rel from \c base.
+ * Must be called with the GVL because the table grows on the Ruby heap.
+ * Silently gives up on memory shortage.
+ *
+ * @param[in] scope      how the importing VM resolves imports
+ * @param[in] found_here the resolved path of the file
+ * @param[in] content    the content of the file
+ * @param[in] len        the length of \c content
+ */
+void
+rubyjsonnet_import_cache_store(struct rubyjsonnet_import_cache *cache, const char *scope,
+			       const char *base, const char *rel, const char *found_here,
+			       const char *content, size_t len)
+{
+    import_cache_insert(cache, cache->entries, import_cache_key(scope, base, rel), found_here,
+			content, len);
+}
+
+/*
+ * Inserts a copy of \c content into \c table under \c key, which is
+ * allocated with malloc(3) and owned by the table from now.
+ * Must be called with the GVL. Silently gives up on memory shortage.
+ */
+static void
+import_cache_insert(struct rubyjsonnet_import_cache *cache, st_table *table, char *key,
+		    const char *found_here, const char *content, size_t len)
+{
+    struct import_cache_entry *entry = calloc(1, sizeof(*entry));
+    st_data_t k, old;
+    size_t memsize;
+
+    if (entry) {
+	entry->found_here = strdup(found_here);
+	entry->content = malloc(len ? len : 1);
+    }
+    if (!key || !entry || !entry->found_here || !entry->content) {
+	free(key);
+	if (entry) {
+	    entry_free(entry);
+	}
+	return;
+    }
+    memcpy(entry->content, content, len);
+    entry->len = len;
+    entry->has_stat = entry_stat(found_here, &entry->mtime, &entry->mtime_nsec, &entry->size);
+    memsize = entry_memsize(key, entry);
+
+    rb_nativethread_lock_lock(&cache->lock);
+    k = (st_data_t)key;
+    if (st_delete(table, &k, &old)) {
+	entry_free_i(k, old, 0);
+    }
+    st_insert(table, (st_data_t)key, (st_data_t)entry);
+    rb_nativethread_lock_unlock(&cache->lock);
+    rb_gc_adjust_memory_usage((ssize_t)memsize);
+}
+
+/**
+ * Reads the preloaded file at \c path.
+ * Can be called without the GVL.
+ *
+ * @param[in]  vm     a JsonnetVm which allocates \c *buf.
+ * @param[out] buf    the content of the file on hit
+ * @param[out] buflen the length of \c *buf on hit
+ * @return non-zero on hit.
+ */
+int
+rubyjsonnet_import_cache_read(struct rubyjsonnet_import_cache *cache, struct JsonnetVm *vm,
+			      const char *path, char **buf, size_t *buflen)
+{
+#ifdef HAVE_REALPATH
+    char *real;
+    st_data_t value;
+    st_index_t nfiles;
+    int hit = 0;
+
+    rb_nativethread_lock_lock(&cache->lock);
+    nfiles = cache->files->num_entries;
+    rb_nativethread_lock_unlock(&cache->lock);
+    if (!nfiles || !(real = realpath(path, NULL))) {
+	return 0;
+    }
+
+    rb_nativethread_lock_lock(&cache->lock);
+    if (st_lookup(cache->files, (st_data_t)real, &value)) {
+	const struct import_cache_entry *const entry = (const struct import_cache_entry *)value;
+
+	if (!cache->check_mtime || entry_fresh_p(entry)) {
+	    *buf = jsonnet_realloc(vm, NULL, entry->len + 1);
+	    memcpy(*buf, entry->content, entry->len);
+	    (*buf)[entry->len] = '\0';
+	    *buflen = entry->len;
+	    hit = 1;
+	}
+    }
+    rb_nativethread_lock_unlock(&cache->lock);
+
+    free(real);
+    return hit;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Adds a file to be served to the native import resolver.
+ *
+ * @param [String] path  the real path of the file
+ * @param [String] content  the content of the file
+ */
+static VALUE
+import_cache_add_file(VALUE self, VALUE path, VALUE content)
+{
+    struct rubyjsonnet_import_cache *const cache = rubyjsonnet_obj_to_import_cache(self);
+
+    FilePathValue(path);
+    StringValue(content);
+    import_cache_insert(cache, cache->files, strdup(StringValueCStr(path)), RSTRING_PTR(path),
+			RSTRING_PTR(content), RSTRING_LEN(content));
+    RB_GC_GUARD(path);
+    RB_GC_GUARD(content);
+    return Qnil;
+}
+
+/*
+ * Whether the cache checks the modification time and the size of the
+ * imported file on each lookup.
+ */
+static VALUE
+import_cache_check_mtime(VALUE self)
+{
+    return rubyjsonnet_obj_to_import_cache(self)->check_mtime ? Qtrue : Qfalse;
+}
+
+static VALUE
+import_cache_set_check_mtime(VALUE self, VALUE val)
+{
+    struct rubyjsonnet_import_cache *const cache = rubyjsonnet_obj_to_import_cache(self);
+
+    rb_nativethread_lock_lock(&cache->lock);
+    cache->check_mtime = RTEST(val);
+    rb_nativethread_lock_unlock(&cache->lock);
+    return val;
+}
+
+struct purge_args {
+    const char *path;
+    long count;
+};
+
+static int
+purge_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+    struct purge_args *const args = (struct purge_args *)arg;
+    const struct import_cache_entry *const entry = (const struct import_cache_entry *)value;
+
+    if (args->path && strcmp(args->path, entry->found_here)) {
+	return ST_CONTINUE;
+    }
+    args->count++;
+    return entry_free_i(key, value, 0);
+}
+
+/*
+ * Removes entries from the cache.
+ *
+ * call-seq:
+ *   purge -> Integer
+ *   purge(path) -> Integer
+ *
+ * Removes all the entries, or the entries whose resolved path is +path+.
+ * Returns the number of removed entries.
+ */
+static VALUE
+import_cache_purge(int argc, VALUE *argv, VALUE self)
+{
+    struct rubyjsonnet_import_cache *const cache = rubyjsonnet_obj_to_import_cache(self);
+    struct purge_args args;
+    VALUE path;
+
+    rb_scan_args(argc, argv, "01", &path);
+    args.path = NULL;
+    args.count = 0;
+    if (!NIL_P(path)) {
+	FilePathValue(path);
+	args.path = StringValueCStr(path);
+    }
+
+    rb_nativethread_lock_lock(&cache->lock);
+    st_foreach(cache->entries, purge_i, (st_data_t)&args);
+    st_foreach(cache->files, purge_i, (st_data_t)&args);
+    rb_nativethread_lock_unlock(&cache->lock);
+    RB_GC_GUARD(path);
+
+    return LONG2NUM(args.count);
+}
+
+/*
+ * Returns the number of entries in the cache.
+ */
+static VALUE
+import_cache_size(VALUE self)
+{
+    struct rubyjsonnet_import_cache *const cache = rubyjsonnet_obj_to_import_cache(self);
+    st_index_t size;
+
+    rb_nativethread_lock_lock(&cache->lock);
+    size = cache->entries->num_entries + cache->files->num_entries;
+    rb_nativethread_lock_unlock(&cache->lock);
+    return SIZET2NUM(size);
+}
+
+/*
+ * Returns statistics of the cache.
+ *
+ * call-seq:
+ *   stats -> Hash
+ *
+ * The Hash has +:size+, +:preloaded+ (the number of the files added by
+ * #preload), +:hits+ and +:misses+.
+ */
+static VALUE
+import_cache_stats(VALUE self)
+{
+    struct rubyjsonnet_import_cache *const cache = rubyjsonnet_obj_to_import_cache(self);
+    size_t size, preloaded, hits, misses;
+    VALUE stats = rb_hash_new();
+
+    rb_nativethread_lock_lock(&cache->lock);
+    preloaded = cache->files->num_entries;
+    size = cache->entries->num_entries + preloaded;
+    hits = cache->hits;
+    misses = cache->misses;
+    rb_nativethread_lock_unlock(&cache->lock);
+
+    rb_hash_aset(stats, ID2SYM(rb_intern("size")), SIZET2NUM(size));
+    rb_hash_aset(stats, ID2SYM(rb_intern("preloaded")), SIZET2NUM(preloaded));
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), SIZET2NUM(hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), SIZET2NUM(misses));
+    return stats;
+}
+
+void
+rubyjsonnet_init_import_cache(VALUE mJsonnet)
+{
+    cImportCache = rb_define_class_under(mJsonnet, "ImportCache", rb_cObject);
+    rb_define_alloc_func(cImportCache, import_cache_s_allocate);
+
+    rb_define_method(cImportCache, "check_mtime", import_cache_check_mtime, 0);
+    rb_define_method(cImportCache, "check_mtime=", import_cache_set_check_mtime, 1);
+    rb_define_method(cImportCache, "purge", import_cache_purge, -1);
+    rb_define_private_method(cImportCache, "add_file", import_cache_add_file, 2);
+    rb_define_method(cImportCache, "size", import_cache_size, 0);
+    rb_define_method(cImportCache, "stats", import_cache_stats, 0);
+}
@@ -0,0 +1,438 @@
+#include <string.h>
+
+#include <libjsonnet.h>
+
+#include <ruby/ruby.h>
+#include <ruby/encoding.h>
+#include <ruby/util.h>
+
+#include "ruby_jsonnet.h"
+
+/*
+ * Builds Ruby objects directly from JSON documents returned by libjsonnet,
+ * so that the result needs neither a Ruby String nor JSON.parse.
+ *
+ * The input is expected to be generated by libjsonnet. So the parser does not
+ * try to give detailed error messages.
+ */
+
+/*
+ * Deeper documents are rejected, as JSON.parse does by default. The parser is
+ * recursive, so the limit also protects the native stack.
+ */
+#define RUBYJSONNET_PARSE_MAX_NESTING 100
+
+struct json_parser {
+    const char *ptr;
+    const char *head;
+    const struct rubyjsonnet_parse_options *opts;
+    int depth;
+};
+
+static VALUE parse_value(struct json_parser *parser);
+
+static void
+NORETURN(parse_error)(struct json_parser *parser)
+{
+    rb_raise(rb_eArgError, "malformed JSON at offset %ld",
+	     (long)(parser->ptr - parser->head));
+}
+
+static void
+skip_whitespace(struct json_parser *parser)
+{
+    for (;;) {
+	switch (*parser->ptr) {
+	    case ' ':
+	    case '\t':
+	    case '\n':
+	    case '\r':
+		parser->ptr++;
+		break;
+	    default:
+		return;
+	}
+    }
+}
+
+static void
+expect_literal(struct json_parser *parser, const char *literal)
+{
+    const size_t len = strlen(literal);
+    if (strncmp(parser->ptr, literal, len)) {
+	parse_error(parser);
+    }
+    parser->ptr += len;
+}
+
+static int
+parse_hex4(struct json_parser *parser)
+{
+    int i, code = 0;
+    for (i = 0; i < 4; ++i) {
+	const char c = *parser->ptr++;
+	code <<= 4;
+	if ('0' <= c && c <= '9') {
+	    code |= c - '0';
+	} else if ('a' <= c && c <= 'f') {
+	    code |= c - 'a' + 10;
+	} else if ('A' <= c && c <= 'F') {
+	    code |= c - 'A' + 10;
+	} else {
+	    parser->ptr--;
+	    parse_error(parser);
+	}
+    }
+    return code;
+}
+
+static void
+append_codepoint(VALUE buf, unsigned int code)
+{
+    char utf8[4];
+    int len;
+
+    if (code < 0x80) {
+	utf8[0] = (char)code;
+	len = 1;
+    } else if (code < 0x800) {
+	utf8[0] = (char)(0xC0 | (code >> 6));
+	utf8[1] = (char)(0x80 | (code & 0x3F));
+	len = 2;
+    } else if (code < 0x10000) {
+	utf8[0] = (char)(0xE0 | (code >> 12));
+	utf8[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+	utf8[2] = (char)(0x80 | (code & 0x3F));
+	len = 3;
+    } else {
+	utf8[0] = (char)(0xF0 | (code >> 18));
+	utf8[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+	utf8[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+	utf8[3] = (char)(0x80 | (code & 0x3F));
+	len = 4;
+    }
+    rb_str_buf_cat(buf, utf8, len);
+}
+
+static void
+append_escape(struct json_parser *parser, VALUE buf)
+{
+    char c;
+    unsigned int code;
+
+    switch (c = *parser->ptr++) {
+	case '"':
+	case '\\':
+	case '/':
+	    rb_str_buf_cat(buf, &c, 1);
+	    return;
+	case 'b':
+	    rb_str_buf_cat(buf, "\b", 1);
+	    return;
+	case 'f':
+	    rb_str_buf_cat(buf, "\f", 1);
+	    return;
+	case 'n':
+	    rb_str_buf_cat(buf, "\n", 1);
+	    return;
+	case 'r':
+	    rb_str_buf_cat(buf, "\r", 1);
+	    return;
+	case 't':
+	    rb_str_buf_cat(buf, "\t", 1);
+	    return;
+	case 'u':
+	    break;
+	default:
+	    parser->ptr--;
+	    parse_error(parser);
+    }
+
+    code = parse_hex4(parser);
+    if (0xD800 <= code && code < 0xDC00 && parser->ptr[0] == '\\' && parser->ptr[1] == 'u') {
+	const char *const saved = parser->ptr;
+	unsigned int low;
+
+	parser->ptr += 2;
+	low = parse_hex4(parser);
+	if (0xDC00 <= low && low < 0xE000) {
+	    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+	} else {
+	    parser->ptr = saved;
+	}
+    }
+    append_codepoint(buf, code);
+}
+
+/*
+ * Parses a string literal.
+ * Sets the position and the length of the string to \c *ptr and \c *len if
+ * the literal has no escape sequence. Returns the decoded String otherwise.
+ */
+static VALUE
+parse_string_raw(struct json_parser *parser, const char **ptr, long *len)
+{
+    const char *const begin = ++parser->ptr;
+    VALUE buf;
+
+    while (*parser->ptr != '"' && *parser->ptr != '\\') {
+	if (!*parser->ptr) {
+	    parse_error(parser);
+	}
+	parser->ptr++;
+    }
+    if (*parser->ptr == '"') {
+	*ptr = begin;
+	*len = parser->ptr - begin;
+	parser->ptr++;
+	return Qnil;
+    }
+
+    buf = rb_utf8_str_new(begin, parser->ptr - begin);
+    for (;;) {
+	const char *segment = parser->ptr;
+	while (*parser->ptr != '"' && *parser->ptr != '\\') {
+	    if (!*parser->ptr) {
+		parse_error(parser);
+	    }
+	    parser->ptr++;
+	}
+	rb_str_buf_cat(buf, segment, parser->ptr - segment);
+	if (*parser->ptr++ == '"') {
+	    return buf;
+	}
+	append_escape(parser, buf);
+    }
+}
+
+static VALUE
+parse_string(struct json_parser *parser)
+{
+    const char *ptr;
+    long len;
+    VALUE str = parse_string_raw(parser, &ptr, &len);
+
+    if (NIL_P(str)) {
+	if (parser->opts->freeze) {
+	    return rubyjsonnet_fstring_new(ptr, len);
+	}
+	return rb_utf8_str_new(ptr, len);
+    }
+    return parser->opts->freeze ? rb_str_freeze(str) : str;
+}
+
+/*
+ * Keys are interned, so equal keys share one String within a document and
+ * across documents on Ruby 2.5 or later.
+ */
+static VALUE
+parse_key(struct json_parser *parser)
+{
+    const char *ptr;
+    long len;
+    VALUE str;
+
+    if (*parser->ptr != '"') {
+	parse_error(parser);
+    }
+    str = parse_string_raw(parser, &ptr, &len);
+    if (!NIL_P(str)) {
+	ptr = RSTRING_PTR(str);
+	len = RSTRING_LEN(str);
+    }
+
+    if (parser->opts->symbolize_names) {
+	return ID2SYM(rb_intern3(ptr, len, rb_utf8_encoding()));
+    }
+    return rubyjsonnet_fstring_new(ptr, len);
+}
+
+static VALUE
+parse_number(struct json_parser *parser)
+{
+    const char *const begin = parser->ptr;
+    int integer = 1;
+
+    if (*parser->ptr == '-') {
+	parser->ptr++;
+    }
+    if (!ISDIGIT(*parser->ptr)) {
+	parse_error(parser);
+    }
+    while (ISDIGIT(*parser->ptr)) {
+	parser->ptr++;
+    }
+    if (*parser->ptr == '.') {
+	integer = 0;
+	parser->ptr++;
+	while (ISDIGIT(*parser->ptr)) {
+	    parser->ptr++;
+	}
+    }
+    if (*parser->ptr == 'e' || *parser->ptr == 'E') {
+	integer = 0;
+	parser->ptr++;
+	if (*parser->ptr == '+' || *parser->ptr == '-') {
+	    parser->ptr++;
+	}
+	while (ISDIGIT(*parser->ptr)) {
+	    parser->ptr++;
+	}
+    }
+
+    if (integer) {
+	const long len = parser->ptr - begin;
+	if (len < 19) {
+	    const char *p = begin;
+	    LONG_LONG n = 0;
+	    const int negative = (*p == '-');
+	    if (negative) {
+		p++;
+	    }
+	    for (; p < parser->ptr; ++p) {
+		n = n * 10 + (*p - '0');
+	    }
+	    return LL2NUM(negative ? -n : n);
+	}
+	return rb_str_to_inum(rb_str_new(begin, len), 10, FALSE);
+    }
+    return DBL2NUM(ruby_strtod(begin, NULL));
+}
+
+static VALUE
+parse_array(struct json_parser *parser)
+{
+    VALUE ary = rb_ary_new();
+
+    parser->ptr++;
+    skip_whitespace(parser);
+    if (*parser->ptr == ']') {
+	parser->ptr++;
+	return parser->opts->freeze ? rb_ary_freeze(ary) : ary;
+    }
+    for (;;) {
+	rb_ary_push(ary, parse_value(parser));
+	skip_whitespace(parser);
+	switch (*parser->ptr++) {
+	    case ',':
+		continue;
+	    case ']':
+		return parser->opts->freeze ? rb_ary_freeze(ary) : ary;
+	    default:
+		parser->ptr--;
+		parse_error(parser);
+	}
+    }
+}
+
+static VALUE
+parse_object(struct json_parser *parser)
+{
+    VALUE hash = rb_hash_new();
+
+    parser->ptr++;
+    skip_whitespace(parser);
+    if (*parser->ptr == '}') {
+	parser->ptr++;
+	return parser->opts->freeze ? rb_hash_freeze(hash) : hash;
+    }
+    for (;;) {
+	VALUE key;
+
+	skip_whitespace(parser);
+	key = parse_key(parser);
+	skip_whitespace(parser);
+	if (*parser->ptr++ != ':') {
+	    parser->ptr--;
+	    parse_error(parser);
+	}
+	rb_hash_aset(hash, key, parse_value(parser));
+	skip_whitespace(parser);
+	switch (*parser->ptr++) {
+	    case ',':
+		continue;
+	    case '}':
+		return parser->opts->freeze ? rb_hash_freeze(hash) : hash;
+	    default:
+		parser->ptr--;
+		parse_error(parser);
+	}
+    }
+}
+
+static VALUE
+parse_value(struct json_parser *parser)
+{
+    VALUE value;
+
+    skip_whitespace(parser);
+    switch (*parser->ptr) {
+	case '{':
+	case '[':
+	    if (++parser->depth > RUBYJSONNET_PARSE_MAX_NESTING) {
+		rb_raise(rb_eArgError, "nesting of %d is too deep", parser->depth);
+	    }
+	    value = *parser->ptr == '{' ? parse_object(parser) : parse_array(parser);
+	    parser->depth--;
+	    return value;
+	case '"':
+	    return parse_string(parser);
+	case 't':
+	    expect_literal(parser, "true");
+	    return Qtrue;
+	case 'f':
+	    expect_literal(parser, "false");
+	    return Qfalse;
+	case 'n':
+	    expect_literal(parser, "null");
+	    return Qnil;
+	default:
+	    return parse_number(parser);
+    }
+}
+
+/**
+ * Returns a frozen UTF-8 String from the table of interned strings.
+ * Ruby older than 2.5 returns a new frozen String instead.
+ */
+VALUE
+rubyjsonnet_fstring_new(const char *ptr, long len)
+{
+#ifdef HAVE_RB_ENC_INTERNED_STR
+    return rb_enc_interned_str(ptr, len, rb_utf8_encoding());
+#else
+    static ID id_uminus;
+
+    if (!id_uminus) {
+	id_uminus = rb_intern("-@");
+    }
+    /* String#-@ interns the String since Ruby 2.5 */
+    return rb_funcall(rb_utf8_str_new(ptr, len), id_uminus, 0);
+#endif
+}
+
+/**
+ * Converts a JSON document into Ruby objects.
+ *
+ * @param[in] json a NUL-terminated JSON document returned by libjsonnet.
+ * @param[in] opts options of the conversion.
+ * @return the converted object
+ * @throw ArgumentError if \c json is not a valid JSON document.
+ */
+VALUE
+rubyjsonnet_parse_json(const char *json, const struct rubyjsonnet_parse_options *opts)
+{
+    struct json_parser parser;
+    VALUE value;
+
+    parser.ptr = parser.head = json;
+    parser.opts = opts;
+    parser.depth = 0;
+
+    value = parse_value(&parser);
+    skip_whitespace(&parser);
+    if (*parser.ptr) {
+	parse_error(&parser);
+    }
+    return value;
+}
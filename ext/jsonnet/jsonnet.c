@@ -8,7 +8,7 @@
  * call-seq:
  *  Jsonnet.version -> String
  *
- * Returns the version of the underlying C++ implementation of Jsonnet.
+ * Returns the version of the underlying implementation of Jsonnet.
  */
 static VALUE
 jw_s_version(VALUE mod)
@@ -16,12 +16,32 @@ jw_s_version(VALUE mod)
     return rb_usascii_str_new_cstr(jsonnet_version());
 }
 
+/*
+ * call-seq:
+ *  Jsonnet.backend -> Symbol
+ *
+ * Returns the implementation of Jsonnet which this library is linked with,
+ * +:cpp+ for the C++ implementation or +:go+ for go-jsonnet.
+ */
+static VALUE
+jw_s_backend(VALUE mod)
+{
+#ifdef RUBYJSONNET_GO_JSONNET
+    return ID2SYM(rb_intern("go"));
+#else
+    return ID2SYM(rb_intern("cpp"));
+#endif
+}
+
 void
 Init_jsonnet_wrap(void)
 {
     VALUE mJsonnet = rb_define_module("Jsonnet");
     rb_define_singleton_method(mJsonnet, "libversion", jw_s_version, 0);
+    rb_define_singleton_method(mJsonnet, "backend", jw_s_backend, 0);
 
     rubyjsonnet_init_helpers(mJsonnet);
     rubyjsonnet_init_vm(mJsonnet);
+    rubyjsonnet_init_import_cache(mJsonnet);
+    rubyjsonnet_init_watcher(mJsonnet);
 }
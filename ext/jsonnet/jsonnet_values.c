@@ -4,9 +4,6 @@
 
 #include "ruby_jsonnet.h"
 
-static struct JsonnetJsonValue *protect_obj_to_json(struct JsonnetVm *vm, VALUE obj,
-						    struct JsonnetJsonValue *parent);
-
 /**
  * Converts a Jsonnet JSON value into a Ruby object.
  *
@@ -47,139 +44,300 @@ rubyjsonnet_json_to_obj(struct JsonnetVm *vm, const struct JsonnetJsonValue *val
     rb_raise(rb_eArgError, "unsupported type of JSON value");
 }
 
-static struct JsonnetJsonValue *
-string_to_json(struct JsonnetVm *vm, VALUE str)
-{
-    rubyjsonnet_assert_asciicompat(str);
-    return jsonnet_json_make_string(vm, RSTRING_PTR(str));
-}
-
-static struct JsonnetJsonValue *
-num_to_json(struct JsonnetVm *vm, VALUE n)
-{
-    return jsonnet_json_make_number(vm, NUM2DBL(n));
-}
+/* Deeper objects are rejected. They are likely to be recursive. */
+#define RUBYJSONNET_OBJ_TO_JSON_MAX_NESTING 10000
 
-static struct JsonnetJsonValue *
-ary_to_json(struct JsonnetVm *vm, VALUE ary)
-{
-    struct JsonnetJsonValue *const json_array = jsonnet_json_make_array(vm);
+/*
+ * A compound value whose elements are not converted yet.
+ */
+struct obj_to_json_frame {
+    void *value;
+    int depth;
+};
 
-    int i;
-    for (i = 0; i < RARRAY_LEN(ary); ++i) {
-	struct JsonnetJsonValue *const v = protect_obj_to_json(vm, RARRAY_AREF(ary, i), json_array);
-	jsonnet_json_array_append(vm, json_array, v);
-    }
-    return json_array;
-}
+/*
+ * State of rubyjsonnet_obj_convert().
+ *
+ * Compound values are converted with an explicit work stack instead of
+ * recursion. A compound value is attached to its parent as soon as it is
+ * created, and its elements are filled later. So every intermediate value
+ * is reachable from \c root, and destroying \c root releases all of them
+ * at once when an exception interrupts the conversion.
+ */
+struct obj_to_json_state {
+    const struct rubyjsonnet_value_ops *ops;
+    void *ctx;
+    VALUE obj;
+    void *root;
 
-struct hash_to_json_params {
-    struct JsonnetVm *vm;
-    struct JsonnetJsonValue *obj;
+    /* Ruby objects of the pending frames. A Ruby array keeps them from GC
+     * because some of them are created by implicit conversions. */
+    VALUE pending;
+    struct obj_to_json_frame *frames;
+    long len;
+    long capa;
 };
 
-static int
-hash_item_to_json(VALUE key, VALUE value, VALUE paramsval)
+static void *
+string_to_value(struct obj_to_json_state *state, VALUE str)
 {
-    const struct hash_to_json_params *const params = (const struct hash_to_json_params *)paramsval;
-
-    StringValue(key);
-    rubyjsonnet_assert_asciicompat(key);
-
-    jsonnet_json_object_append(params->vm, params->obj, StringValueCStr(key),
-			       protect_obj_to_json(params->vm, value, params->obj));
+    rubyjsonnet_assert_asciicompat(str);
+    return state->ops->make_string(state->ctx, RSTRING_PTR(str));
+}
 
-    return ST_CONTINUE;
+/*
+ * Makes room for a frame. Must be called before creating the compound value
+ * so that the value never leaks on failure.
+ */
+static void
+obj_to_json_reserve(struct obj_to_json_state *state, int depth)
+{
+    if (depth > RUBYJSONNET_OBJ_TO_JSON_MAX_NESTING) {
+	rb_raise(rb_eArgError, "nesting of %d is too deep", depth);
+    }
+    if (state->len == state->capa) {
+	state->capa = state->capa ? state->capa * 2 : 16;
+	REALLOC_N(state->frames, struct obj_to_json_frame, state->capa);
+    }
 }
 
-static struct JsonnetJsonValue *
-hash_to_json(struct JsonnetVm *vm, VALUE hash)
+static void
+obj_to_json_push(struct obj_to_json_state *state, void *value, VALUE obj, int depth)
 {
-    struct JsonnetJsonValue *const json_obj = jsonnet_json_make_object(vm);
-    const struct hash_to_json_params args = {vm, json_obj};
-    rb_hash_foreach(hash, hash_item_to_json, (VALUE)&args);
-    return json_obj;
+    state->frames[state->len].value = value;
+    state->frames[state->len].depth = depth;
+    state->len++;
+    rb_ary_push(state->pending, obj);
 }
 
-/**
- * Converts a Ruby object into a Jsonnet JSON value
+/*
+ * Converts \c obj into a value.
+ * An array or an object is returned empty, and queued to be filled later.
  *
- * TODO(yugui): Safely destorys an intermediate object on exception.
+ * Core classes are dispatched by their type tags. Other objects are
+ * converted by implicit conversion methods in the order of String, Float,
+ * Array and Hash, or by their default string representation.
  */
-static struct JsonnetJsonValue *
-obj_to_json(struct JsonnetVm *vm, VALUE obj)
+static void *
+obj_to_json_shallow(struct obj_to_json_state *state, VALUE obj, int depth)
 {
+    const struct rubyjsonnet_value_ops *const ops = state->ops;
+    void *value;
     VALUE converted;
 
-    switch (obj) {
-	case Qnil:
-	    return jsonnet_json_make_null(vm);
-	case Qtrue:
-	    return jsonnet_json_make_bool(vm, 1);
-	case Qfalse:
-	    return jsonnet_json_make_bool(vm, 0);
+    switch (rb_type(obj)) {
+	case T_NIL:
+	    return ops->make_null(state->ctx);
+	case T_TRUE:
+	    return ops->make_bool(state->ctx, 1);
+	case T_FALSE:
+	    return ops->make_bool(state->ctx, 0);
+	case T_FIXNUM:
+	    return ops->make_number(state->ctx, (double)FIX2LONG(obj));
+	case T_FLOAT:
+	    return ops->make_number(state->ctx, RFLOAT_VALUE(obj));
+	case T_BIGNUM:
+	    return ops->make_number(state->ctx, rb_big2dbl(obj));
+	case T_STRING:
+	    return string_to_value(state, obj);
+	case T_ARRAY:
+	    obj_to_json_reserve(state, depth + 1);
+	    value = ops->make_array(state->ctx);
+	    obj_to_json_push(state, value, obj, depth + 1);
+	    return value;
+	case T_HASH:
+	    obj_to_json_reserve(state, depth + 1);
+	    value = ops->make_object(state->ctx);
+	    obj_to_json_push(state, value, obj, depth + 1);
+	    return value;
+	default:
+	    break;
     }
 
     converted = rb_check_string_type(obj);
     if (converted != Qnil) {
-	return string_to_json(vm, converted);
+	return string_to_value(state, converted);
     }
 
     converted = rb_check_to_float(obj);
     if (converted != Qnil) {
-	return num_to_json(vm, converted);
+	return ops->make_number(state->ctx, NUM2DBL(converted));
     }
 
     converted = rb_check_array_type(obj);
     if (converted != Qnil) {
-	return ary_to_json(vm, converted);
+	return obj_to_json_shallow(state, converted, depth);
     }
 
     converted = rb_check_hash_type(obj);
     if (converted != Qnil) {
-	return hash_to_json(vm, converted);
+	return obj_to_json_shallow(state, converted, depth);
     }
 
-    converted = rb_any_to_s(obj);
-    return string_to_json(vm, converted);
+    return string_to_value(state, rb_any_to_s(obj));
 }
 
-struct protect_args {
-    struct JsonnetVm *vm;
-    VALUE obj;
+struct hash_item_to_json_args {
+    struct obj_to_json_state *state;
+    const struct obj_to_json_frame *frame;
 };
 
+static int
+hash_item_to_json(VALUE key, VALUE value, VALUE ptr)
+{
+    const struct hash_item_to_json_args *const args = (const struct hash_item_to_json_args *)ptr;
+    struct obj_to_json_state *const state = args->state;
+    const char *name;
+
+    StringValue(key);
+    rubyjsonnet_assert_asciicompat(key);
+    name = StringValueCStr(key);
+    /* appended right after creation, so that nothing can leak the value */
+    state->ops->object_append(state->ctx, args->frame->value, name,
+			      obj_to_json_shallow(state, value, args->frame->depth));
+    RB_GC_GUARD(key);
+    return ST_CONTINUE;
+}
+
 static VALUE
-protect_obj_to_json_block(VALUE paramsval)
+obj_to_json_run(VALUE ptr)
 {
-    const struct protect_args *const params = (const struct protect_args *)paramsval;
-    return (VALUE)obj_to_json(params->vm, params->obj);
+    struct obj_to_json_state *const state = (struct obj_to_json_state *)ptr;
+
+    state->root = obj_to_json_shallow(state, state->obj, 0);
+    while (state->len > 0) {
+	const struct obj_to_json_frame frame = state->frames[--state->len];
+	const VALUE obj = rb_ary_pop(state->pending);
+
+	if (RB_TYPE_P(obj, T_ARRAY)) {
+	    long i;
+	    for (i = 0; i < RARRAY_LEN(obj); ++i) {
+		state->ops->array_append(state->ctx, frame.value,
+					 obj_to_json_shallow(state, RARRAY_AREF(obj, i),
+							     frame.depth));
+	    }
+	} else {
+	    struct hash_item_to_json_args args;
+	    args.state = state;
+	    args.frame = &frame;
+	    rb_hash_foreach(obj, hash_item_to_json, (VALUE)&args);
+	}
+    }
+    return Qnil;
 }
 
 /**
- * Safely converts a Ruby object into a JSON value.
+ * Converts a Ruby object into a tree of values built by \c ops.
  *
- * It automatically destroys \a parent on exception.
- * @param[in] vm  a Jsonnet VM
- * @param[in] obj a Ruby object to be converted
- * @param[in] parent destroys this value on failure
- * @throws can throw \c TypeError or other exceptions
+ * This is the only conversion from Ruby objects into JSON values, so that
+ * every consumer, e.g. the results of native functions and their memos,
+ * accepts the same objects with the same nesting limit.
+ *
+ * @param[in] ops  constructors of the values. They may raise; a value they
+ *   fail to attach to its parent must be destroyed by themselves.
+ * @param[in] ctx  passed to \c ops
+ * @param[in] obj  a Ruby object to be converted
+ * @param[out] error  set to the error message on failure
+ * @returns the converted value on success, or NULL on failure.
  */
-static struct JsonnetJsonValue *
-protect_obj_to_json(struct JsonnetVm *vm, VALUE obj, struct JsonnetJsonValue *parent)
+void *
+rubyjsonnet_obj_convert(const struct rubyjsonnet_value_ops *ops, void *ctx, VALUE obj,
+			VALUE *error)
 {
-    const struct protect_args args = {vm, obj};
-    int state = 0;
+    struct obj_to_json_state state;
+    int tag = 0;
+
+    state.ops = ops;
+    state.ctx = ctx;
+    state.obj = obj;
+    state.root = NULL;
+    state.pending = rb_ary_tmp_new(0);
+    state.frames = NULL;
+    state.len = 0;
+    state.capa = 0;
+
+    rb_protect(obj_to_json_run, (VALUE)&state, &tag);
+    xfree(state.frames);
+    rb_ary_free(state.pending);
+    RB_GC_GUARD(state.pending);
 
-    VALUE result = rb_protect(protect_obj_to_json_block, (VALUE)&args, &state);
-    if (!state) {
-	return (struct JsonnetJsonValue *)result;
+    if (tag) {
+	*error = rubyjsonnet_format_exception(rb_errinfo());
+	rb_set_errinfo(Qnil);
+	if (state.root) {
+	    ops->destroy(ctx, state.root);
+	}
+	return NULL;
     }
+    return state.root;
+}
 
-    jsonnet_json_destroy(vm, parent);
-    rb_jump_tag(state);
+static void *
+json_make_null(void *vm)
+{
+    return jsonnet_json_make_null(vm);
+}
+
+static void *
+json_make_bool(void *vm, int v)
+{
+    return jsonnet_json_make_bool(vm, v);
+}
+
+static void *
+json_make_number(void *vm, double v)
+{
+    return jsonnet_json_make_number(vm, v);
+}
+
+static void *
+json_make_string(void *vm, const char *v)
+{
+    return jsonnet_json_make_string(vm, v);
 }
 
+static void *
+json_make_array(void *vm)
+{
+    return jsonnet_json_make_array(vm);
+}
+
+static void *
+json_make_object(void *vm)
+{
+    return jsonnet_json_make_object(vm);
+}
+
+static void
+json_array_append(void *vm, void *arr, void *v)
+{
+    jsonnet_json_array_append(vm, arr, v);
+}
+
+static void
+json_object_append(void *vm, void *obj, const char *name, void *v)
+{
+    jsonnet_json_object_append(vm, obj, name, v);
+}
+
+static void
+json_destroy(void *vm, void *v)
+{
+    jsonnet_json_destroy(vm, v);
+}
+
+static const struct rubyjsonnet_value_ops json_value_ops = {
+    json_make_null,
+    json_make_bool,
+    json_make_number,
+    json_make_string,
+    json_make_array,
+    json_make_object,
+    json_array_append,
+    json_object_append,
+    json_destroy,
+};
+
 /**
  * Converts a Ruby object into a JSON value.
  * Returns an error message on failure.
@@ -192,15 +350,14 @@ protect_obj_to_json(struct JsonnetVm *vm, VALUE obj, struct JsonnetJsonValue *pa
 struct JsonnetJsonValue *
 rubyjsonnet_obj_to_json(struct JsonnetVm *vm, VALUE obj, int *success)
 {
-    int state = 0;
-    const struct protect_args args = {vm, obj};
-    VALUE result = rb_protect(protect_obj_to_json_block, (VALUE)&args, &state);
-    if (state) {
-	const VALUE msg = rubyjsonnet_format_exception(rb_errinfo());
-	rb_set_errinfo(Qnil);
+    VALUE error = Qnil;
+    struct JsonnetJsonValue *const json = rubyjsonnet_obj_convert(&json_value_ops, vm, obj, &error);
+
+    if (!json) {
 	*success = 0;
-	return string_to_json(vm, msg);
+	rubyjsonnet_assert_asciicompat(error);
+	return jsonnet_json_make_string(vm, RSTRING_PTR(error));
     }
     *success = 1;
-    return (struct JsonnetJsonValue *)result;
+    return json;
 }
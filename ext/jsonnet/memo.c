@@ -0,0 +1,661 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjsonnet.h>
+#include <ruby/ruby.h>
+#include <ruby/st.h>
+#include <ruby/thread_native.h>
+
+#include "ruby_jsonnet.h"
+
+/*
+ * Memoization of native functions.
+ *
+ * A memo maps the arguments of a native function to its result. The result
+ * is kept as a tree of plain C data, so that a cache hit can build a copy of
+ * the result with the JSON API of libjsonnet without the GVL.
+ * Lookups may run on worker threads. So everything here is allocated with
+ * malloc(3), and the memo is guarded by a native lock.
+ */
+
+enum memo_value_type {
+    MEMO_NULL,
+    MEMO_TRUE,
+    MEMO_FALSE,
+    MEMO_NUMBER,
+    MEMO_STRING,
+    MEMO_ARRAY,
+    MEMO_OBJECT,
+};
+
+struct memo_value {
+    enum memo_value_type type;
+    /* links the values to be visited by memo_value_free() or memo_value_to_json() */
+    struct memo_value *next;
+    union {
+	double num;
+	char *str;
+	struct {
+	    long len;
+	    long capa;
+	    struct memo_value **elts;
+	    /* names of the fields if MEMO_OBJECT */
+	    char **keys;
+	    /* the copy being filled by memo_value_to_json() */
+	    struct JsonnetJsonValue *json;
+	} compound;
+    } as;
+};
+
+/* type-tagged serialization of the arguments */
+struct memo_key {
+    size_t len;
+    char data[1];
+};
+
+struct memo_entry {
+    /* in the order of recent use, the most recent first */
+    struct memo_entry *prev, *next;
+    struct memo_key *key;
+    struct memo_value *value;
+    /* bytes allocated for the entry */
+    size_t size;
+};
+
+struct rubyjsonnet_memo {
+    rb_nativethread_lock_t lock;
+    st_table *entries;
+    /* sentinel of the list of entries */
+    struct memo_entry lru;
+    /* unlimited if zero */
+    long max_size;
+    int per_evaluation;
+    /* bytes allocated for the entries */
+    size_t bytes;
+};
+
+static int
+memo_key_cmp(st_data_t a, st_data_t b)
+{
+    const struct memo_key *const x = (const struct memo_key *)a;
+    const struct memo_key *const y = (const struct memo_key *)b;
+    return x->len != y->len || memcmp(x->data, y->data, x->len);
+}
+
+static st_index_t
+memo_key_hash(st_data_t a)
+{
+    const struct memo_key *const key = (const struct memo_key *)a;
+    return st_hash(key->data, key->len, 0);
+}
+
+static const struct st_hash_type memo_key_type = {
+    memo_key_cmp,
+    memo_key_hash,
+};
+
+/*
+ * Frees a tree of values. Can be called without the GVL.
+ * The pending values are linked through their \c next so that deep trees
+ * need neither recursion nor allocation.
+ */
+static void
+memo_value_free(struct memo_value *value)
+{
+    value->next = NULL;
+    while (value) {
+	struct memo_value *next = value->next;
+	long i;
+
+	switch (value->type) {
+	    case MEMO_STRING:
+		free(value->as.str);
+		break;
+	    case MEMO_ARRAY:
+	    case MEMO_OBJECT:
+		for (i = 0; i < value->as.compound.len; ++i) {
+		    value->as.compound.elts[i]->next = next;
+		    next = value->as.compound.elts[i];
+		    if (value->as.compound.keys) {
+			free(value->as.compound.keys[i]);
+		    }
+		}
+		free(value->as.compound.elts);
+		free(value->as.compound.keys);
+		break;
+	    default:
+		break;
+	}
+	free(value);
+	value = next;
+    }
+}
+
+/*
+ * Constructors of values for rubyjsonnet_obj_convert(). They raise on
+ * allocation failure, and count the allocated bytes.
+ */
+struct memo_builder {
+    size_t bytes;
+};
+
+static struct memo_value *
+memo_value_new(struct memo_builder *builder, enum memo_value_type type)
+{
+    struct memo_value *const value = malloc(sizeof(*value));
+    if (!value) {
+	rb_memerror();
+    }
+    value->type = type;
+    value->next = NULL;
+    builder->bytes += sizeof(*value);
+    return value;
+}
+
+static void *
+memo_make_null(void *builder)
+{
+    return memo_value_new(builder, MEMO_NULL);
+}
+
+static void *
+memo_make_bool(void *builder, int v)
+{
+    return memo_value_new(builder, v ? MEMO_TRUE : MEMO_FALSE);
+}
+
+static void *
+memo_make_number(void *builder, double v)
+{
+    struct memo_value *const value = memo_value_new(builder, MEMO_NUMBER);
+    value->as.num = v;
+    return value;
+}
+
+static void *
+memo_make_string(void *ptr, const char *v)
+{
+    struct memo_builder *const builder = ptr;
+    const size_t len = strlen(v);
+    char *const str = malloc(len + 1);
+    struct memo_value *value;
+
+    if (!str) {
+	rb_memerror();
+    }
+    memcpy(str, v, len + 1);
+    value = malloc(sizeof(*value));
+    if (!value) {
+	free(str);
+	rb_memerror();
+    }
+    value->type = MEMO_STRING;
+    value->next = NULL;
+    value->as.str = str;
+    builder->bytes += sizeof(*value) + len + 1;
+    return value;
+}
+
+static struct memo_value *
+memo_compound_new(struct memo_builder *builder, enum memo_value_type type)
+{
+    struct memo_value *const value = memo_value_new(builder, type);
+    value->as.compound.len = 0;
+    value->as.compound.capa = 0;
+    value->as.compound.elts = NULL;
+    value->as.compound.keys = NULL;
+    value->as.compound.json = NULL;
+    return value;
+}
+
+static void *
+memo_make_array(void *builder)
+{
+    return memo_compound_new(builder, MEMO_ARRAY);
+}
+
+static void *
+memo_make_object(void *builder)
+{
+    return memo_compound_new(builder, MEMO_OBJECT);
+}
+
+/*
+ * Makes room for the next element of a compound value.
+ * @return 0 on allocation failure.
+ */
+static int
+memo_compound_reserve(struct memo_builder *builder, struct memo_value *parent)
+{
+    const long capa = parent->as.compound.capa ? parent->as.compound.capa * 2 : 4;
+    struct memo_value **elts;
+
+    if (parent->as.compound.len < parent->as.compound.capa) {
+	return 1;
+    }
+    elts = realloc(parent->as.compound.elts, sizeof(*elts) * capa);
+    if (!elts) {
+	return 0;
+    }
+    parent->as.compound.elts = elts;
+    if (parent->type == MEMO_OBJECT) {
+	char **const keys = realloc(parent->as.compound.keys, sizeof(*keys) * capa);
+	if (!keys) {
+	    return 0;
+	}
+	parent->as.compound.keys = keys;
+    }
+    builder->bytes += (sizeof(*elts) + (parent->type == MEMO_OBJECT ? sizeof(char *) : 0)) *
+		      (capa - parent->as.compound.capa);
+    parent->as.compound.capa = capa;
+    return 1;
+}
+
+static void
+memo_array_append(void *builder, void *parent, void *elt)
+{
+    struct memo_value *const arr = parent;
+
+    if (!memo_compound_reserve(builder, arr)) {
+	memo_value_free(elt);
+	rb_memerror();
+    }
+    arr->as.compound.elts[arr->as.compound.len++] = elt;
+}
+
+static void
+memo_object_append(void *ptr, void *parent, const char *name, void *elt)
+{
+    struct memo_builder *const builder = ptr;
+    struct memo_value *const obj = parent;
+    const size_t len = strlen(name);
+    char *key;
+
+    if (!memo_compound_reserve(builder, obj) || !(key = malloc(len + 1))) {
+	memo_value_free(elt);
+	rb_memerror();
+    }
+    memcpy(key, name, len + 1);
+    builder->bytes += len + 1;
+    obj->as.compound.keys[obj->as.compound.len] = key;
+    obj->as.compound.elts[obj->as.compound.len++] = elt;
+}
+
+static void
+memo_destroy(void *builder, void *value)
+{
+    memo_value_free(value);
+}
+
+static const struct rubyjsonnet_value_ops memo_value_ops = {
+    memo_make_null,
+    memo_make_bool,
+    memo_make_number,
+    memo_make_string,
+    memo_make_array,
+    memo_make_object,
+    memo_array_append,
+    memo_object_append,
+    memo_destroy,
+};
+
+/*
+ * Builds a copy of \c value with the JSON API of libjsonnet, or an empty
+ * array or object to be filled later, which is pushed to \c pending.
+ */
+static struct JsonnetJsonValue *
+memo_value_to_json_shallow(struct JsonnetVm *vm, struct memo_value *value,
+			   struct memo_value **pending)
+{
+    switch (value->type) {
+	case MEMO_NULL:
+	    return jsonnet_json_make_null(vm);
+	case MEMO_TRUE:
+	    return jsonnet_json_make_bool(vm, 1);
+	case MEMO_FALSE:
+	    return jsonnet_json_make_bool(vm, 0);
+	case MEMO_NUMBER:
+	    return jsonnet_json_make_number(vm, value->as.num);
+	case MEMO_STRING:
+	    return jsonnet_json_make_string(vm, value->as.str);
+	case MEMO_ARRAY:
+	case MEMO_OBJECT:
+	    value->as.compound.json = value->type == MEMO_ARRAY ? jsonnet_json_make_array(vm)
+								 : jsonnet_json_make_object(vm);
+	    value->next = *pending;
+	    *pending = value;
+	    return value->as.compound.json;
+    }
+    /* never happens */
+    return jsonnet_json_make_null(vm);
+}
+
+/*
+ * Builds a copy of \c value with the JSON API of libjsonnet.
+ * Can be called without the GVL, but not concurrently on the same value
+ * because the traversal uses the links in the values.
+ */
+static struct JsonnetJsonValue *
+memo_value_to_json(struct JsonnetVm *vm, struct memo_value *value)
+{
+    struct memo_value *pending = NULL;
+    struct JsonnetJsonValue *const json = memo_value_to_json_shallow(vm, value, &pending);
+
+    while (pending) {
+	struct memo_value *const compound = pending;
+	long i;
+
+	pending = compound->next;
+	for (i = 0; i < compound->as.compound.len; ++i) {
+	    struct JsonnetJsonValue *const elt =
+		memo_value_to_json_shallow(vm, compound->as.compound.elts[i], &pending);
+	    if (compound->type == MEMO_OBJECT) {
+		jsonnet_json_object_append(vm, compound->as.compound.json,
+					   compound->as.compound.keys[i], elt);
+	    } else {
+		jsonnet_json_array_append(vm, compound->as.compound.json, elt);
+	    }
+	}
+	compound->as.compound.json = NULL;
+    }
+    return json;
+}
+
+struct key_buffer {
+    char *ptr;
+    size_t len;
+    size_t capa;
+};
+
+static int
+key_buffer_cat(struct key_buffer *buf, const void *ptr, size_t len)
+{
+    if (buf->len + len > buf->capa) {
+	size_t capa = buf->capa;
+	char *grown;
+	while (capa < buf->len + len) {
+	    capa *= 2;
+	}
+	grown = realloc(buf->ptr, capa);
+	if (!grown) {
+	    return 0;
+	}
+	buf->ptr = grown;
+	buf->capa = capa;
+    }
+    memcpy(buf->ptr + buf->len, ptr, len);
+    buf->len += len;
+    return 1;
+}
+
+/*
+ * Serializes the arguments of a native function.
+ * Can be called without the GVL.
+ * @return the key, or NULL if an argument cannot be a key.
+ */
+static struct memo_key *
+memo_key_new(struct JsonnetVm *vm, const struct JsonnetJsonValue *const *argv, long argc)
+{
+    struct key_buffer buf;
+    struct memo_key *key;
+    long i;
+    int ok = 1;
+
+    buf.len = offsetof(struct memo_key, data);
+    buf.capa = 64;
+    buf.ptr = malloc(buf.capa);
+    if (!buf.ptr) {
+	return NULL;
+    }
+
+    for (i = 0; ok && i < argc; ++i) {
+	const char *str;
+	double num;
+	int b;
+
+	if ((str = jsonnet_json_extract_string(vm, argv[i]))) {
+	    const size_t len = strlen(str);
+	    ok = key_buffer_cat(&buf, "s", 1) && key_buffer_cat(&buf, &len, sizeof(len)) &&
+		 key_buffer_cat(&buf, str, len);
+	} else if (jsonnet_json_extract_number(vm, argv[i], &num)) {
+	    ok = key_buffer_cat(&buf, "d", 1) && key_buffer_cat(&buf, &num, sizeof(num));
+	} else if ((b = jsonnet_json_extract_bool(vm, argv[i])) != 2) {
+	    ok = key_buffer_cat(&buf, b ? "t" : "f", 1);
+	} else if (jsonnet_json_extract_null(vm, argv[i])) {
+	    ok = key_buffer_cat(&buf, "n", 1);
+	} else {
+	    ok = 0;
+	}
+    }
+    if (!ok) {
+	free(buf.ptr);
+	return NULL;
+    }
+
+    key = (struct memo_key *)buf.ptr;
+    key->len = buf.len - offsetof(struct memo_key, data);
+    return key;
+}
+
+static void
+memo_entry_unlink(struct memo_entry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static void
+memo_entry_link_first(struct rubyjsonnet_memo *memo, struct memo_entry *entry)
+{
+    entry->prev = &memo->lru;
+    entry->next = memo->lru.next;
+    memo->lru.next->prev = entry;
+    memo->lru.next = entry;
+}
+
+static void
+memo_entry_free(struct memo_entry *entry)
+{
+    if (entry->value) {
+	memo_value_free(entry->value);
+    }
+    free(entry->key);
+    free(entry);
+}
+
+/*
+ * Removes an entry. The caller must hold the lock.
+ * @return the number of the freed bytes, to be reported to the GC by the caller.
+ */
+static size_t
+memo_evict(struct rubyjsonnet_memo *memo, struct memo_entry *entry)
+{
+    st_data_t key = (st_data_t)entry->key;
+    const size_t size = entry->size;
+
+    st_delete(memo->entries, &key, NULL);
+    memo_entry_unlink(entry);
+    memo_entry_free(entry);
+    memo->bytes -= size;
+    return size;
+}
+
+/**
+ * Creates a new memo.
+ *
+ * @param[in] max_size       the maximum number of entries, or zero for unlimited.
+ * @param[in] per_evaluation non-zero if rubyjsonnet_memo_reset() should
+ *                           clear the memo.
+ */
+struct rubyjsonnet_memo *
+rubyjsonnet_memo_new(long max_size, int per_evaluation)
+{
+    struct rubyjsonnet_memo *const memo = ALLOC(struct rubyjsonnet_memo);
+
+    rb_nativethread_lock_initialize(&memo->lock);
+    memo->entries = st_init_table(&memo_key_type);
+    memo->lru.prev = memo->lru.next = &memo->lru;
+    memo->max_size = max_size;
+    memo->per_evaluation = per_evaluation;
+    memo->bytes = 0;
+    return memo;
+}
+
+/**
+ * Creates a new empty memo with the same options as \c memo.
+ */
+struct rubyjsonnet_memo *
+rubyjsonnet_memo_new_like(const struct rubyjsonnet_memo *memo)
+{
+    return rubyjsonnet_memo_new(memo->max_size, memo->per_evaluation);
+}
+
+/* @return the number of the freed bytes */
+static size_t
+memo_clear(struct rubyjsonnet_memo *memo)
+{
+    size_t freed = 0;
+    while (memo->lru.next != &memo->lru) {
+	freed += memo_evict(memo, memo->lru.next);
+    }
+    return freed;
+}
+
+/**
+ * Clears the memo at the end of an evaluation if it is per-evaluation.
+ */
+void
+rubyjsonnet_memo_reset(struct rubyjsonnet_memo *memo)
+{
+    if (memo->per_evaluation) {
+	size_t freed;
+
+	rb_nativethread_lock_lock(&memo->lock);
+	freed = memo_clear(memo);
+	rb_nativethread_lock_unlock(&memo->lock);
+	rb_gc_adjust_memory_usage(-(ssize_t)freed);
+    }
+}
+
+void
+rubyjsonnet_memo_free(struct rubyjsonnet_memo *memo)
+{
+    rb_gc_adjust_memory_usage(-(ssize_t)memo_clear(memo));
+    st_free_table(memo->entries);
+    rb_nativethread_lock_destroy(&memo->lock);
+    xfree(memo);
+}
+
+/**
+ * Looks up the result of a native function call.
+ * Can be called without the GVL.
+ *
+ * @param[in] vm   a JsonnetVm which allocates the result
+ * @param[in] argv arguments of the call
+ * @param[in] argc the number of the arguments
+ * @return a copy of the memoized result, or NULL if not found.
+ */
+struct JsonnetJsonValue *
+rubyjsonnet_memo_lookup(struct rubyjsonnet_memo *memo, struct JsonnetVm *vm,
+			const struct JsonnetJsonValue *const *argv, long argc)
+{
+    struct memo_key *const key = memo_key_new(vm, argv, argc);
+    struct JsonnetJsonValue *result = NULL;
+    st_data_t value;
+
+    if (!key) {
+	return NULL;
+    }
+    rb_nativethread_lock_lock(&memo->lock);
+    if (st_lookup(memo->entries, (st_data_t)key, &value)) {
+	struct memo_entry *const entry = (struct memo_entry *)value;
+	memo_entry_unlink(entry);
+	memo_entry_link_first(memo, entry);
+	result = memo_value_to_json(vm, entry->value);
+    }
+    rb_nativethread_lock_unlock(&memo->lock);
+    free(key);
+    return result;
+}
+
+/**
+ * Memoizes the result of a native function call, and returns a copy of it
+ * for the VM. Must be called with the GVL.
+ *
+ * @param[in] vm      a JsonnetVm which allocates the result
+ * @param[in] argv    arguments of the call
+ * @param[in] argc    the number of the arguments
+ * @param[in] result  the result of the call in Ruby
+ * @param[out] success set to 1 on success, or 0 if \c result cannot be converted.
+ * @return the converted result on success, or an error message.
+ */
+struct JsonnetJsonValue *
+rubyjsonnet_memo_store(struct rubyjsonnet_memo *memo, struct JsonnetVm *vm,
+		       const struct JsonnetJsonValue *const *argv, long argc, VALUE result,
+		       int *success)
+{
+    struct memo_builder builder;
+    struct memo_value *value;
+    struct memo_entry *entry;
+    struct JsonnetJsonValue *json;
+    VALUE error = Qnil;
+    st_data_t old;
+    size_t size, freed;
+
+    builder.bytes = 0;
+    value = rubyjsonnet_obj_convert(&memo_value_ops, &builder, result, &error);
+    if (!value) {
+	*success = 0;
+	rubyjsonnet_assert_asciicompat(error);
+	return jsonnet_json_make_string(vm, RSTRING_PTR(error));
+    }
+    json = memo_value_to_json(vm, value);
+    *success = 1;
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+	memo_value_free(value);
+	return json;
+    }
+    entry->value = value;
+    entry->key = memo_key_new(vm, argv, argc);
+    if (!entry->key) {
+	memo_entry_free(entry);
+	return json;
+    }
+
+    size = entry->size = sizeof(*entry) + offsetof(struct memo_key, data) + entry->key->len +
+			 builder.bytes;
+    freed = 0;
+
+    rb_nativethread_lock_lock(&memo->lock);
+    if (st_lookup(memo->entries, (st_data_t)entry->key, &old)) {
+	/* memoized by another thread in the meantime */
+	freed += memo_evict(memo, (struct memo_entry *)old);
+    }
+    st_insert(memo->entries, (st_data_t)entry->key, (st_data_t)entry);
+    memo_entry_link_first(memo, entry);
+    memo->bytes += entry->size;
+    if (memo->max_size > 0 && (long)memo->entries->num_entries > memo->max_size) {
+	freed += memo_evict(memo, memo->lru.prev);
+    }
+    rb_nativethread_lock_unlock(&memo->lock);
+    /* the entries are allocated outside of the Ruby heap */
+    rb_gc_adjust_memory_usage((ssize_t)size - (ssize_t)freed);
+    return json;
+}
+
+/**
+ * Returns the number of bytes used by the memo.
+ */
+size_t
+rubyjsonnet_memo_memsize(struct rubyjsonnet_memo *memo)
+{
+    size_t size;
+
+    rb_nativethread_lock_lock(&memo->lock);
+    size = sizeof(*memo) + st_memsize(memo->entries) + memo->bytes;
+    rb_nativethread_lock_unlock(&memo->lock);
+    return size;
+}
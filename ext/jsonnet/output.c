@@ -0,0 +1,536 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libjsonnet.h>
+#include <ruby/ruby.h>
+#include <ruby/encoding.h>
+#include <ruby/io.h>
+#include <ruby/thread.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "ruby_jsonnet.h"
+
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+/*
+ * Consumes the results of evaluation straight from the buffers returned by
+ * libjsonnet, without building Ruby objects of all of them.
+ */
+
+struct fileset_write_args {
+    const char *buf;
+    const char *dir;
+    int fsync;
+
+    /* names of the files written, pointing into buf */
+    const char **written;
+    long nwritten;
+
+    /* errno and the path on failure */
+    int err;
+    char *failed;
+};
+
+static char *
+output_path(const char *dir, const char *name)
+{
+    const size_t dir_len = strlen(dir), name_len = strlen(name);
+    const int slash = dir_len && dir[dir_len - 1] != '/';
+    char *const path = malloc(dir_len + slash + name_len + 1);
+
+    if (path) {
+	memcpy(path, dir, dir_len);
+	if (slash) {
+	    path[dir_len] = '/';
+	}
+	memcpy(path + dir_len + slash, name, name_len + 1);
+    }
+    return path;
+}
+
+/* Creates the missing parent directories of path, as "jsonnet -c" does. */
+static int
+make_parents(char *path)
+{
+    char *p;
+    for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+	*p = '\0';
+	if (mkdir(path, 0777) && errno != EEXIST) {
+	    *p = '/';
+	    return -1;
+	}
+	*p = '/';
+    }
+    return 0;
+}
+
+/*
+ * Returns non-zero if the file at path has exactly the given content.
+ */
+static int
+same_content_p(const char *path, const char *content, size_t len)
+{
+    char chunk[8192];
+    struct stat st;
+    size_t offset = 0;
+    int fd = open(path, O_RDONLY | O_BINARY | O_CLOEXEC), same = 0;
+
+    if (fd < 0) {
+	return 0;
+    }
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && (size_t)st.st_size == len) {
+	ssize_t n;
+	same = 1;
+	while (same && (n = read(fd, chunk, sizeof(chunk))) > 0) {
+	    same = offset + n <= len && !memcmp(content + offset, chunk, n);
+	    offset += n;
+	}
+	same = same && offset == len;
+    }
+    close(fd);
+    return same;
+}
+
+/**
+ * Replaces the file at \c path with \c content.
+ * Writes \c content into a temporary file next to \c path and renames it over
+ * \c path, so that readers never see a partially written file, and a failure
+ * leaves the old file intact. Keeps the permissions of the old file.
+ * Can be called without the GVL.
+ *
+ * @return 0 on success, or -1 with errno on failure
+ */
+int
+rubyjsonnet_replace_file(const char *path, const char *content, size_t len)
+{
+    /* room for ".<pid>.<attempt>.tmp" */
+    const size_t tmp_len = strlen(path) + 48;
+    char *const tmp = malloc(tmp_len);
+    struct stat st;
+    const int exists = !stat(path, &st) && S_ISREG(st.st_mode);
+    const int mode = exists ? (int)(st.st_mode & 07777) : 0666;
+    int fd = -1, attempt, err;
+
+    if (!tmp) {
+	errno = ENOMEM;
+	return -1;
+    }
+    for (attempt = 0; fd < 0 && attempt < 100; ++attempt) {
+	snprintf(tmp, tmp_len, "%s.%ld.%d.tmp", path, (long)getpid(), attempt);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_BINARY | O_CLOEXEC, mode);
+	if (fd < 0 && errno != EEXIST) {
+	    break;
+	}
+    }
+    if (fd < 0) {
+	err = errno;
+	free(tmp);
+	errno = err;
+	return -1;
+    }
+#ifdef HAVE_FCHMOD
+    /* open(2) applies umask, which the old file did not go through again */
+    if (exists && fchmod(fd, mode)) {
+	goto fail;
+    }
+#endif
+    while (len > 0) {
+	const ssize_t n = write(fd, content, len);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    goto fail;
+	}
+	content += n;
+	len -= n;
+    }
+    err = close(fd);
+    fd = -1;
+    if (err || rename(tmp, path)) {
+	goto fail;
+    }
+    free(tmp);
+    return 0;
+
+  fail:
+    err = errno;
+    if (fd >= 0) {
+	close(fd);
+    }
+    unlink(tmp);
+    free(tmp);
+    errno = err;
+    return -1;
+}
+
+static int
+sync_file(const char *path)
+{
+#ifdef HAVE_FSYNC
+    int fd = open(path, O_RDONLY | O_BINARY | O_CLOEXEC), ret;
+
+    if (fd < 0) {
+	return -1;
+    }
+    ret = fsync(fd);
+    close(fd);
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+static void
+fileset_write_fail(struct fileset_write_args *args, char *path)
+{
+    args->err = errno;
+    args->failed = path;
+}
+
+/*
+ * Writes the files without the GVL. Unchanged files are not touched.
+ * If requested, the written files are synced at once after all of them
+ * have been written, so that the writes are not serialized by each sync.
+ */
+static void *
+fileset_write_without_gvl(void *ptr)
+{
+    struct fileset_write_args *const args = (struct fileset_write_args *)ptr;
+    const char *name, *json;
+    long i;
+
+    for (name = args->buf; *name; name = json + strlen(json) + 1) {
+	const size_t len = strlen(json = name + strlen(name) + 1);
+	char *const path = output_path(args->dir, name);
+
+	if (!path) {
+	    errno = ENOMEM;
+	    fileset_write_fail(args, NULL);
+	    return NULL;
+	}
+	if (same_content_p(path, json, len)) {
+	    free(path);
+	    continue;
+	}
+	if (make_parents(path) || rubyjsonnet_replace_file(path, json, len)) {
+	    fileset_write_fail(args, path);
+	    return NULL;
+	}
+	free(path);
+	args->written[args->nwritten++] = name;
+    }
+
+    for (i = 0; args->fsync && i < args->nwritten; ++i) {
+	char *const path = output_path(args->dir, args->written[i]);
+	if (!path || sync_file(path)) {
+	    fileset_write_fail(args, path);
+	    return NULL;
+	}
+	free(path);
+    }
+    if (args->fsync && args->nwritten > 0 && sync_file(args->dir)) {
+	fileset_write_fail(args, NULL);
+    }
+    return NULL;
+}
+
+struct fileset_write_protect_args {
+    struct JsonnetVm *vm;
+    char *buf;
+    rb_encoding *enc;
+    VALUE dir;
+    int fsync;
+    struct fileset_write_args write;
+};
+
+static VALUE
+fileset_write_body(VALUE ptr)
+{
+    struct fileset_write_protect_args *const args = (struct fileset_write_protect_args *)ptr;
+    const char *name, *json;
+    long count = 0, i;
+    VALUE written;
+
+    for (name = args->buf; *name; name = json + strlen(json) + 1) {
+	json = name + strlen(name) + 1;
+	if (!*json) {
+	    rubyjsonnet_raise_missing_body(name, args->enc);
+	}
+	count++;
+    }
+
+    args->write.buf = args->buf;
+    args->write.dir = StringValueCStr(args->dir);
+    args->write.fsync = args->fsync;
+    args->write.written = ALLOC_N(const char *, count);
+    args->write.nwritten = 0;
+    args->write.err = 0;
+    args->write.failed = NULL;
+    rb_thread_call_without_gvl(fileset_write_without_gvl, &args->write, NULL, NULL);
+
+    if (args->write.err) {
+	VALUE path = args->write.failed ? rb_str_new_cstr(args->write.failed) : args->dir;
+	free(args->write.failed);
+	args->write.failed = NULL;
+	rb_syserr_fail_str(args->write.err, path);
+    }
+
+    written = rb_ary_new_capa(args->write.nwritten);
+    for (i = 0; i < args->write.nwritten; ++i) {
+	char *const path = output_path(args->write.dir, args->write.written[i]);
+	if (!path) {
+	    rb_memerror();
+	}
+	rb_ary_push(written, rb_external_str_new_with_enc(path, strlen(path),
+							  rb_filesystem_encoding()));
+	free(path);
+    }
+    return written;
+}
+
+static VALUE
+fileset_write_ensure(VALUE ptr)
+{
+    struct fileset_write_protect_args *const args = (struct fileset_write_protect_args *)ptr;
+    xfree(args->write.written);
+    jsonnet_realloc(args->vm, args->buf, 0);
+    return Qnil;
+}
+
+/**
+ * Writes the result of multi-mode evaluation into files in \c dir.
+ * Files whose contents are unchanged are not rewritten.
+ * It automatically frees \c buf.
+ *
+ * @param[in] vm    a JsonnetVM
+ * @param[in] buf   NUL-separated and double-NUL-terminated sequence of strings returned by \c vm.
+ * @param[in] enc   encoding of the file names in error messages
+ * @param[in] dir   the output directory
+ * @param[in] fsync syncs the written files before returning if non-zero
+ * @return Array of the paths of the written files
+ * @throw SystemCallError on I/O errors
+ */
+VALUE
+rubyjsonnet_fileset_write(struct JsonnetVm *vm, char *buf, rb_encoding *enc, VALUE dir,
+			  int fsync)
+{
+    struct fileset_write_protect_args args;
+
+    args.vm = vm;
+    args.buf = buf;
+    args.enc = enc;
+    args.dir = dir;
+    args.fsync = fsync;
+    args.write.written = NULL;
+    return rb_ensure(fileset_write_body, (VALUE)&args, fileset_write_ensure, (VALUE)&args);
+}
+
+struct fileset_each_args {
+    struct JsonnetVm *vm;
+    char *buf;
+    rb_encoding *enc;
+    const struct rubyjsonnet_parse_options *parse;
+};
+
+static VALUE
+fileset_each_body(VALUE ptr)
+{
+    const struct fileset_each_args *const args = (const struct fileset_each_args *)ptr;
+    const char *name, *json;
+    long count = 0;
+
+    for (name = args->buf; *name; name = json + strlen(json) + 1) {
+	VALUE value;
+
+	json = name + strlen(name) + 1;
+	if (!*json) {
+	    rubyjsonnet_raise_missing_body(name, args->enc);
+	}
+	value = args->parse ? rubyjsonnet_parse_json(json, args->parse)
+			    : rb_enc_str_new_cstr(json, args->enc);
+	rb_yield_values(2, rb_enc_str_new_cstr(name, args->enc), value);
+	count++;
+    }
+    return LONG2NUM(count);
+}
+
+static VALUE
+fileset_each_ensure(VALUE ptr)
+{
+    const struct fileset_each_args *const args = (const struct fileset_each_args *)ptr;
+    jsonnet_realloc(args->vm, args->buf, 0);
+    return Qnil;
+}
+
+/**
+ * Yields each file name and its JSON value in the result of multi-mode
+ * evaluation to the block, one at a time.
+ * It automatically frees \c buf.
+ *
+ * @return the number of the files
+ */
+VALUE
+rubyjsonnet_fileset_each(struct JsonnetVm *vm, char *buf, rb_encoding *enc,
+			 const struct rubyjsonnet_parse_options *parse)
+{
+    struct fileset_each_args args;
+
+    args.vm = vm;
+    args.buf = buf;
+    args.enc = enc;
+    args.parse = parse;
+    return rb_ensure(fileset_each_body, (VALUE)&args, fileset_each_ensure, (VALUE)&args);
+}
+
+static VALUE
+stream_each_body(VALUE ptr)
+{
+    const struct fileset_each_args *const args = (const struct fileset_each_args *)ptr;
+    const int yield = rb_block_given_p();
+    VALUE docs = yield ? Qnil : rb_ary_new();
+    const char *json;
+    long count = 0;
+
+    for (json = args->buf; *json; json += strlen(json) + 1) {
+	VALUE value = args->parse ? rubyjsonnet_parse_json(json, args->parse)
+				  : rb_enc_str_new_cstr(json, args->enc);
+	if (yield) {
+	    rb_yield(value);
+	} else {
+	    rb_ary_push(docs, value);
+	}
+	count++;
+    }
+    return yield ? LONG2NUM(count) : docs;
+}
+
+/**
+ * Yields each JSON document in the result of stream-mode evaluation to the
+ * block, one at a time. Returns an Array of the documents if no block is given.
+ * It automatically frees \c buf.
+ *
+ * @param[in] buf   NUL-separated and double-NUL-terminated sequence of
+ *                  documents returned by \c vm.
+ * @return the number of the documents, or Array of them
+ */
+VALUE
+rubyjsonnet_stream_each(struct JsonnetVm *vm, char *buf, rb_encoding *enc,
+			const struct rubyjsonnet_parse_options *parse)
+{
+    struct fileset_each_args args;
+
+    args.vm = vm;
+    args.buf = buf;
+    args.enc = enc;
+    args.parse = parse;
+    return rb_ensure(stream_each_body, (VALUE)&args, fileset_each_ensure, (VALUE)&args);
+}
+
+struct str_write_args {
+    struct JsonnetVm *vm;
+    char *buf;
+    rb_encoding *enc;
+    VALUE out;
+};
+
+/*
+ * Returns non-zero if \c io converts the encoding or the newlines of what is
+ * written into it. rb_io_bufwrite() would bypass the conversion.
+ */
+static int
+io_writeconv_p(VALUE io, rb_encoding *enc)
+{
+    static ID id_external_encoding, id_internal_encoding;
+    VALUE ext;
+    int mode;
+
+    if (!id_external_encoding) {
+	id_external_encoding = rb_intern("external_encoding");
+	id_internal_encoding = rb_intern("internal_encoding");
+    }
+#ifdef HAVE_RB_IO_MODE
+    mode = rb_io_mode(io);
+#else
+    {
+	rb_io_t *fptr;
+	GetOpenFile(io, fptr);
+	mode = fptr->mode;
+    }
+#endif
+    if (mode & FMODE_TEXTMODE) {
+	return 1;
+    }
+    if (!NIL_P(rb_funcall(io, id_internal_encoding, 0))) {
+	return 1;
+    }
+    ext = rb_funcall(io, id_external_encoding, 0);
+    if (NIL_P(ext)) {
+	return 0;
+    }
+    return rb_to_encoding(ext) != rb_ascii8bit_encoding() && rb_to_encoding(ext) != enc;
+}
+
+static VALUE
+str_write_body(VALUE ptr)
+{
+    const struct str_write_args *const args = (const struct str_write_args *)ptr;
+    const size_t len = strlen(args->buf);
+    VALUE io = rb_io_check_io(args->out);
+
+    if (!NIL_P(io)) {
+	io = rb_io_get_write_io(io);
+    }
+    if (NIL_P(io) || io_writeconv_p(io, args->enc)) {
+	return rb_io_write(args->out, rb_enc_str_new(args->buf, len, args->enc));
+    }
+    if (rb_io_bufwrite(io, args->buf, len) < 0) {
+	rb_sys_fail(0);
+    }
+    return SIZET2NUM(len);
+}
+
+static VALUE
+str_write_ensure(VALUE ptr)
+{
+    const struct str_write_args *const args = (const struct str_write_args *)ptr;
+    jsonnet_realloc(args->vm, args->buf, 0);
+    return Qnil;
+}
+
+/**
+ * Writes \c buf into \c out.
+ * If \c out is an IO, \c buf is written through the IO without a String
+ * unless the IO converts the encoding or the newlines of what is written.
+ * Otherwise \c out must respond to \c write, which receives a String.
+ * It automatically frees \c buf.
+ *
+ * @param[in] vm    a JsonnetVM
+ * @param[in] buf   a NUL-terminated string returned by \c vm
+ * @param[in] enc   encoding of the String passed to \c out.write
+ * @param[in] out   IO or an object which responds to \c write
+ * @return the number of the written bytes
+ */
+VALUE
+rubyjsonnet_str_write(struct JsonnetVm *vm, char *buf, rb_encoding *enc, VALUE out)
+{
+    struct str_write_args args;
+
+    args.vm = vm;
+    args.buf = buf;
+    args.enc = enc;
+    args.out = out;
+    return rb_ensure(str_write_body, (VALUE)&args, str_write_ensure, (VALUE)&args);
+}
@@ -6,31 +6,214 @@
 
 extern const rb_data_type_t jsonnet_vm_type;
 
+struct jsonnet_vm_wrap;
+struct jsonnet_vm_setting;
+struct rubyjsonnet_dispatcher;
+struct rubyjsonnet_import_cache;
+struct rubyjsonnet_memo;
+
 struct native_callback_ctx {
     VALUE callback;
     long arity;
-    VALUE vm;
+    struct jsonnet_vm_wrap *vm;
+    const char *name;
+    /* NULL-terminated names of the parameters */
+    const char **params;
+    /* memoized results, or NULL */
+    struct rubyjsonnet_memo *memo;
+    /* flags of the parameters which receive JSON documents, or NULL */
+    char *json_params;
+    /* non-zero if memo and json_params belong to the context of another VM */
+    int shared;
+    /* number of the calls and seconds spent in the current or last evaluation */
+    long calls;
+    double time;
+};
+
+/* statistics of the current or last evaluation of a VM */
+struct rubyjsonnet_stats {
+    double wall_time;
+    /* calls to the import callback, including ones served by the cache */
+    long imports;
+    long import_cache_hits;
+    double import_time;
+    /* bytes of the result, summed over the files or documents */
+    size_t output_bytes;
+};
+
+/* a file imported by an evaluation */
+struct rubyjsonnet_dependency {
+    /* the resolved path, allocated with malloc(3) */
+    char *path;
+    size_t size;
+    /* 64-bit FNV-1a of the content */
+    uint64_t hash;
+    /* non-zero if the path was looked up but not found */
+    int missing;
+};
+
+/* reasons to abort an evaluation at the next callback */
+enum rubyjsonnet_cancel {
+    RUBYJSONNET_CANCEL_NONE,
+    /* the Ruby thread was interrupted, e.g. by Thread#raise or Thread#kill */
+    RUBYJSONNET_CANCEL_INTERRUPT,
+    RUBYJSONNET_CANCEL_TIMEOUT
 };
 
 struct jsonnet_vm_wrap {
     struct JsonnetVm *vm;
+    /* non-zero while the VM is evaluating without the GVL */
+    int evaluating;
+    /* time limit of each evaluation in seconds, or 0 for no limit */
+    double timeout;
+    /* monotonic time when the current evaluation times out, or 0 */
+    double deadline;
+    /* set from other threads to abort the current evaluation */
+    volatile enum rubyjsonnet_cancel cancel;
+    struct rubyjsonnet_stats stats;
+    /* forwards callbacks to a Ruby thread if the VM runs on a worker thread */
+    struct rubyjsonnet_dispatcher *dispatcher;
 
     VALUE import_callback;
+    /* object_id of import_callback, or 0 without the callback. Identifies the
+     * callback in the keys of import_cache without the GVL. */
+    unsigned long import_callback_id;
+    /* Jsonnet::ImportCache in front of import_callback, or nil */
+    VALUE import_cache;
+    /* non-zero to route imports through the import callback entrypoint, so
+     * that they are recorded in dependencies, even without the callback or
+     * the cache */
+    int track_dependencies;
+    /* files imported by the current or last evaluation if track_dependencies.
+     * Recorded without the GVL, so allocated with malloc(3). */
+    struct {
+	long len;
+	long capa;
+	struct rubyjsonnet_dependency *items;
+    } dependencies;
+    /* prefixes or fnmatch(3) patterns of the paths to be imported by
+     * import_callback. The others are resolved natively if any. */
+    struct {
+	long len;
+	char **patterns;
+    } import_patterns;
     struct {
 	long len;
 	struct native_callback_ctx **contexts;
     } native_callbacks;
+    /* configuration calls to the VM, recorded to be replayed on other VMs */
+    struct {
+	long len;
+	struct jsonnet_vm_setting *settings;
+    } config;
+};
+
+/* options to build Ruby objects from JSON */
+struct rubyjsonnet_parse_options {
+    int symbolize_names;
+    int freeze;
+};
+
+/* kinds of the output of an evaluation */
+enum rubyjsonnet_eval_mode {
+    RUBYJSONNET_EVAL_SINGLE,
+    /* an object whose fields are output files */
+    RUBYJSONNET_EVAL_MULTI,
+    /* an array whose elements are output documents */
+    RUBYJSONNET_EVAL_STREAM
 };
 
 void rubyjsonnet_init_vm(VALUE mod);
 void rubyjsonnet_init_callbacks(VALUE cVM);
 void rubyjsonnet_init_helpers(VALUE mod);
+void rubyjsonnet_init_batch(VALUE cVM);
+void rubyjsonnet_init_import_cache(VALUE mod);
+void rubyjsonnet_init_watcher(VALUE mod);
 
 struct jsonnet_vm_wrap *rubyjsonnet_obj_to_vm(VALUE vm);
+void rubyjsonnet_vm_configure(struct JsonnetVm *dst, const struct jsonnet_vm_wrap *src);
+const char *rubyjsonnet_vm_jpath(const struct jsonnet_vm_wrap *vm, long n);
+void rubyjsonnet_vm_copy_callbacks(struct jsonnet_vm_wrap *dst, const struct jsonnet_vm_wrap *src,
+				   int shared);
+void rubyjsonnet_vm_register_callbacks(struct jsonnet_vm_wrap *vm);
+size_t rubyjsonnet_vm_callbacks_memsize(const struct jsonnet_vm_wrap *vm);
+void rubyjsonnet_vm_free_callbacks(struct jsonnet_vm_wrap *vm);
+void rubyjsonnet_vm_reset_memos(struct jsonnet_vm_wrap *vm);
+void rubyjsonnet_vm_reset_stats(struct jsonnet_vm_wrap *vm);
+void rubyjsonnet_vm_clear_dependencies(struct jsonnet_vm_wrap *vm);
+int rubyjsonnet_vm_add_dependency(struct jsonnet_vm_wrap *vm, const char *path, size_t size,
+				   uint64_t hash, int missing);
+void rubyjsonnet_vm_callbacks_key(const struct jsonnet_vm_wrap *vm, VALUE key);
+int rubyjsonnet_vm_cancelled_p(struct jsonnet_vm_wrap *vm);
+double rubyjsonnet_monotonic_now(void);
+char *rubyjsonnet_evaluate(struct JsonnetVm *vm, const char *fname, const char *snippet,
+			   enum rubyjsonnet_eval_mode mode, int *error);
+void *rubyjsonnet_call_with_gvl(struct jsonnet_vm_wrap *vm, void *(*func)(void *), void *data);
+void rubyjsonnet_dispatcher_cancel(struct rubyjsonnet_dispatcher *dispatcher);
+VALUE rubyjsonnet_eval_error_new(struct JsonnetVm *vm, char *msg, rb_encoding *enc);
+VALUE rubyjsonnet_format_error_new(struct JsonnetVm *vm, char *msg, rb_encoding *enc);
+VALUE rubyjsonnet_timeout_error_new(double timeout);
+VALUE rubyjsonnet_str_new_json(struct JsonnetVm *vm, char *json, rb_encoding *enc);
+VALUE rubyjsonnet_value_new(struct JsonnetVm *vm, char *json, rb_encoding *enc,
+			    const struct rubyjsonnet_parse_options *parse);
+VALUE rubyjsonnet_fileset_new(struct JsonnetVm *vm, char *buf, rb_encoding *enc,
+			      const struct rubyjsonnet_parse_options *parse);
+NORETURN(void rubyjsonnet_raise_missing_body(const char *name, rb_encoding *enc));
+VALUE rubyjsonnet_fileset_each(struct JsonnetVm *vm, char *buf, rb_encoding *enc,
+			       const struct rubyjsonnet_parse_options *parse);
+VALUE rubyjsonnet_str_write(struct JsonnetVm *vm, char *buf, rb_encoding *enc, VALUE out);
+VALUE rubyjsonnet_stream_each(struct JsonnetVm *vm, char *buf, rb_encoding *enc,
+			      const struct rubyjsonnet_parse_options *parse);
+VALUE rubyjsonnet_fileset_write(struct JsonnetVm *vm, char *buf, rb_encoding *enc, VALUE dir,
+				int fsync);
+int rubyjsonnet_replace_file(const char *path, const char *content, size_t len);
+
+struct rubyjsonnet_import_cache *rubyjsonnet_obj_to_import_cache(VALUE obj);
+int rubyjsonnet_import_cache_lookup(struct rubyjsonnet_import_cache *cache, struct JsonnetVm *vm,
+				    const char *scope, const char *base, const char *rel,
+				    char **found_here, char **buf, size_t *buflen);
+int rubyjsonnet_import_cache_read(struct rubyjsonnet_import_cache *cache, struct JsonnetVm *vm,
+				  const char *path, char **buf, size_t *buflen);
+void rubyjsonnet_import_cache_store(struct rubyjsonnet_import_cache *cache, const char *scope,
+				    const char *base, const char *rel, const char *found_here,
+				    const char *content, size_t len);
+
+struct rubyjsonnet_memo *rubyjsonnet_memo_new(long max_size, int per_evaluation);
+struct rubyjsonnet_memo *rubyjsonnet_memo_new_like(const struct rubyjsonnet_memo *memo);
+void rubyjsonnet_memo_reset(struct rubyjsonnet_memo *memo);
+void rubyjsonnet_memo_free(struct rubyjsonnet_memo *memo);
+size_t rubyjsonnet_memo_memsize(struct rubyjsonnet_memo *memo);
+struct JsonnetJsonValue *rubyjsonnet_memo_lookup(struct rubyjsonnet_memo *memo,
+						 struct JsonnetVm *vm,
+						 const struct JsonnetJsonValue *const *argv,
+						 long argc);
+struct JsonnetJsonValue *rubyjsonnet_memo_store(struct rubyjsonnet_memo *memo,
+						struct JsonnetVm *vm,
+						const struct JsonnetJsonValue *const *argv,
+						long argc, VALUE result, int *success);
+
+VALUE rubyjsonnet_parse_json(const char *json, const struct rubyjsonnet_parse_options *opts);
+VALUE rubyjsonnet_fstring_new(const char *ptr, long len);
 
 VALUE rubyjsonnet_json_to_obj(struct JsonnetVm *vm, const struct JsonnetJsonValue *value);
+
+/* Constructors of the values built by rubyjsonnet_obj_convert() */
+struct rubyjsonnet_value_ops {
+    void *(*make_null)(void *ctx);
+    void *(*make_bool)(void *ctx, int v);
+    void *(*make_number)(void *ctx, double v);
+    void *(*make_string)(void *ctx, const char *v);
+    void *(*make_array)(void *ctx);
+    void *(*make_object)(void *ctx);
+    void (*array_append)(void *ctx, void *arr, void *v);
+    void (*object_append)(void *ctx, void *obj, const char *name, void *v);
+    void (*destroy)(void *ctx, void *v);
+};
+void *rubyjsonnet_obj_convert(const struct rubyjsonnet_value_ops *ops, void *ctx, VALUE obj,
+			      VALUE *error);
 struct JsonnetJsonValue *rubyjsonnet_obj_to_json(struct JsonnetVm *vm, VALUE obj, int *success);
 
+uint64_t rubyjsonnet_fnv1a(const char *ptr, size_t len);
 rb_encoding *rubyjsonnet_assert_asciicompat(VALUE str);
 char *rubyjsonnet_str_to_cstr(struct JsonnetVm *vm, VALUE str);
 char *rubyjsonnet_str_to_ptr(struct JsonnetVm *vm, VALUE str, size_t *buflen);
@@ -1,9 +1,12 @@
+#include <time.h>
+
 #include <libjsonnet.h>
 #ifdef HAVE_LIBJSONNET_FMT_H
 # include <libjsonnet_fmt.h>
 #endif
 #include <ruby/ruby.h>
 #include <ruby/intern.h>
+#include <ruby/thread.h>
 
 #include "ruby_jsonnet.h"
 
@@ -27,33 +30,85 @@ static VALUE cVM;
  * Raised on evaluation errors in a Jsonnet VM.
  */
 static VALUE eEvaluationError;
+/*
+ * Raised when an evaluation in a Jsonnet VM exceeds its timeout.
+ */
+static VALUE eTimeoutError;
 static VALUE eFormatError;
 
 static void raise_eval_error(struct JsonnetVm *vm, char *msg, rb_encoding *enc);
+#ifdef HAVE_JSONNET_FMT_SNIPPET
 static void raise_format_error(struct JsonnetVm *vm, char *msg, rb_encoding *enc);
-static VALUE str_new_json(struct JsonnetVm *vm, char *json, rb_encoding *enc);
-static VALUE fileset_new(struct JsonnetVm *vm, char *buf, rb_encoding *enc);
+#endif
 
 static void vm_free(void *ptr);
 static void vm_mark(void *ptr);
+static size_t vm_memsize(const void *ptr);
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void vm_compact(void *ptr);
+#endif
+
+enum jsonnet_vm_setting_type {
+    SETTING_JPATH,
+    SETTING_EXT_VAR,
+    SETTING_EXT_CODE,
+    SETTING_TLA_VAR,
+    SETTING_TLA_CODE,
+    SETTING_MAX_STACK,
+    SETTING_GC_MIN_OBJECTS,
+    SETTING_GC_GROWTH_TRIGGER,
+    SETTING_STRING_OUTPUT,
+    SETTING_MAX_TRACE,
+    SETTING_FMT_INDENT,
+    SETTING_FMT_MAX_BLANK_LINES,
+    SETTING_FMT_STRING,
+    SETTING_FMT_COMMENT,
+    SETTING_FMT_PAD_ARRAYS,
+    SETTING_FMT_PAD_OBJECTS,
+    SETTING_FMT_PRETTY_FIELD_NAMES,
+    SETTING_FMT_SORT_IMPORTS
+};
+
+/*
+ * A call to a configuration function of libjsonnet.
+ */
+struct jsonnet_vm_setting {
+    enum jsonnet_vm_setting_type type;
+    /* key of the variable, or the library path for SETTING_JPATH */
+    char *key;
+    char *val;
+    double num;
+};
 
 const rb_data_type_t jsonnet_vm_type = {
     "JsonnetVm",
     {
 	/* dmark = */ vm_mark,
 	/* dfree = */ vm_free,
-	/* dsize = */ 0,
+	/* dsize = */ vm_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+	/* dcompact = */ vm_compact,
+#endif
     },
     /* parent = */ 0,
     /* data = */ 0,
     /* flags = */ RUBY_TYPED_FREE_IMMEDIATELY,
 };
 
+/**
+ * Returns the VM wrapped by \c wrap.
+ *
+ * @throw RuntimeError if the VM is evaluating Jsonnet in another thread or
+ *   in an outer frame. A JsonnetVm is not reentrant.
+ */
 struct jsonnet_vm_wrap *
 rubyjsonnet_obj_to_vm(VALUE wrap)
 {
     struct jsonnet_vm_wrap *vm;
     TypedData_Get_Struct(wrap, struct jsonnet_vm_wrap, &jsonnet_vm_type, vm);
+    if (vm->evaluating) {
+	rb_raise(rb_eRuntimeError, "Jsonnet::VM is being used by another evaluation");
+    }
 
     return vm;
 }
@@ -64,9 +119,25 @@ vm_s_allocate(VALUE klass)
     struct jsonnet_vm_wrap *vm;
     VALUE self = TypedData_Make_Struct(klass, struct jsonnet_vm_wrap, &jsonnet_vm_type, vm);
     vm->vm = jsonnet_make();
+    vm->evaluating = 0;
+    vm->timeout = 0;
+    vm->deadline = 0;
+    vm->cancel = RUBYJSONNET_CANCEL_NONE;
+    MEMZERO(&vm->stats, struct rubyjsonnet_stats, 1);
+    vm->dispatcher = NULL;
     vm->import_callback = Qnil;
+    vm->import_callback_id = 0;
+    vm->import_cache = Qnil;
+    vm->import_patterns.len = 0;
+    vm->import_patterns.patterns = NULL;
+    vm->track_dependencies = 0;
+    vm->dependencies.len = 0;
+    vm->dependencies.capa = 0;
+    vm->dependencies.items = NULL;
     vm->native_callbacks.len = 0;
     vm->native_callbacks.contexts = NULL;
+    vm->config.len = 0;
+    vm->config.settings = NULL;
 
     return self;
 }
@@ -74,72 +145,619 @@ vm_s_allocate(VALUE klass)
 static void
 vm_free(void *ptr)
 {
-    int i;
+    long i;
     struct jsonnet_vm_wrap *vm = (struct jsonnet_vm_wrap *)ptr;
     jsonnet_destroy(vm->vm);
+    rubyjsonnet_vm_free_callbacks(vm);
 
-    for (i = 0; i < vm->native_callbacks.len; ++i) {
-	struct native_callback_ctx *ctx = vm->native_callbacks.contexts[i];
-	xfree(ctx);
+    for (i = 0; i < vm->config.len; ++i) {
+	xfree(vm->config.settings[i].key);
+	xfree(vm->config.settings[i].val);
     }
-    xfree(vm->native_callbacks.contexts);
+    xfree(vm->config.settings);
     xfree(vm);
 }
 
+/*
+ * Marks the callbacks. They are pinned during an evaluation because worker
+ * VMs in batch.c and the stacks of native threads hold copies of them, which
+ * compaction cannot update.
+ */
 static void
 vm_mark(void *ptr)
 {
-    int i;
+    long i;
+    struct jsonnet_vm_wrap *vm = (struct jsonnet_vm_wrap *)ptr;
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    void (*const mark)(VALUE) = vm->evaluating ? rb_gc_mark : rb_gc_mark_movable;
+#else
+    void (*const mark)(VALUE) = rb_gc_mark;
+#endif
+
+    mark(vm->import_callback);
+    mark(vm->import_cache);
+    for (i = 0; i < vm->native_callbacks.len; ++i) {
+	mark(vm->native_callbacks.contexts[i]->callback);
+    }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+vm_compact(void *ptr)
+{
+    long i;
     struct jsonnet_vm_wrap *vm = (struct jsonnet_vm_wrap *)ptr;
 
-    rb_gc_mark(vm->import_callback);
+    vm->import_callback = rb_gc_location(vm->import_callback);
+    vm->import_cache = rb_gc_location(vm->import_cache);
     for (i = 0; i < vm->native_callbacks.len; ++i) {
-	rb_gc_mark(vm->native_callbacks.contexts[i]->callback);
+	struct native_callback_ctx *const ctx = vm->native_callbacks.contexts[i];
+	ctx->callback = rb_gc_location(ctx->callback);
+    }
+}
+#endif
+
+/*
+ * Returns the memory owned by the VM. libjsonnet allocates the heap of an
+ * evaluation only while it runs, so it is not included.
+ */
+static size_t
+vm_memsize(const void *ptr)
+{
+    long i;
+    const struct jsonnet_vm_wrap *vm = (const struct jsonnet_vm_wrap *)ptr;
+    size_t size = sizeof(*vm) + rubyjsonnet_vm_callbacks_memsize(vm);
+
+    size += sizeof(struct jsonnet_vm_setting) * vm->config.len;
+    for (i = 0; i < vm->config.len; ++i) {
+	const struct jsonnet_vm_setting *const setting = &vm->config.settings[i];
+	if (setting->key) {
+	    size += strlen(setting->key) + 1;
+	}
+	if (setting->val) {
+	    size += strlen(setting->val) + 1;
+	}
+    }
+    return size;
+}
+
+static char *
+setting_strdup(const char *str)
+{
+    char *const dup = ALLOC_N(char, strlen(str) + 1);
+    strcpy(dup, str);
+    return dup;
+}
+
+static int
+setting_overrides(const struct jsonnet_vm_setting *setting, enum jsonnet_vm_setting_type type,
+		  const char *key)
+{
+    switch (type) {
+	case SETTING_JPATH:
+	    return 0;
+	case SETTING_EXT_VAR:
+	case SETTING_EXT_CODE:
+	    return (setting->type == SETTING_EXT_VAR || setting->type == SETTING_EXT_CODE) &&
+		   !strcmp(setting->key, key);
+	case SETTING_TLA_VAR:
+	case SETTING_TLA_CODE:
+	    return (setting->type == SETTING_TLA_VAR || setting->type == SETTING_TLA_CODE) &&
+		   !strcmp(setting->key, key);
+	default:
+	    return setting->type == type;
     }
 }
 
+/**
+ * Records a configuration call so that rubyjsonnet_vm_configure() can replay it.
+ * A setting replaces the previous one of the same variable or parameter as
+ * libjsonnet does.
+ * @return the recorded setting
+ */
+static const struct jsonnet_vm_setting *
+vm_record(struct jsonnet_vm_wrap *vm, enum jsonnet_vm_setting_type type, const char *key,
+	  const char *val, double num)
+{
+    long i;
+    struct jsonnet_vm_setting *setting = NULL;
+
+    for (i = 0; i < vm->config.len; ++i) {
+	if (setting_overrides(&vm->config.settings[i], type, key)) {
+	    setting = &vm->config.settings[i];
+	    xfree(setting->key);
+	    xfree(setting->val);
+	    break;
+	}
+    }
+    if (!setting) {
+	RB_REALLOC_N(vm->config.settings, struct jsonnet_vm_setting, vm->config.len + 1);
+	setting = &vm->config.settings[vm->config.len++];
+    }
+
+    setting->type = type;
+    setting->key = key ? setting_strdup(key) : NULL;
+    setting->val = val ? setting_strdup(val) : NULL;
+    setting->num = num;
+    return setting;
+}
+
+static void
+vm_apply_setting(struct JsonnetVm *vm, const struct jsonnet_vm_setting *setting)
+{
+    switch (setting->type) {
+	case SETTING_JPATH:
+	    jsonnet_jpath_add(vm, setting->key);
+	    break;
+	case SETTING_EXT_VAR:
+	    jsonnet_ext_var(vm, setting->key, setting->val);
+	    break;
+	case SETTING_EXT_CODE:
+	    jsonnet_ext_code(vm, setting->key, setting->val);
+	    break;
+	case SETTING_TLA_VAR:
+	    jsonnet_tla_var(vm, setting->key, setting->val);
+	    break;
+	case SETTING_TLA_CODE:
+	    jsonnet_tla_code(vm, setting->key, setting->val);
+	    break;
+	case SETTING_MAX_STACK:
+	    jsonnet_max_stack(vm, (unsigned)setting->num);
+	    break;
+	case SETTING_GC_MIN_OBJECTS:
+	    jsonnet_gc_min_objects(vm, (unsigned)setting->num);
+	    break;
+	case SETTING_GC_GROWTH_TRIGGER:
+	    jsonnet_gc_growth_trigger(vm, setting->num);
+	    break;
+	case SETTING_STRING_OUTPUT:
+	    jsonnet_string_output(vm, (int)setting->num);
+	    break;
+	case SETTING_MAX_TRACE:
+	    jsonnet_max_trace(vm, (unsigned)setting->num);
+	    break;
+#ifdef HAVE_JSONNET_FMT_SNIPPET
+	case SETTING_FMT_INDENT:
+	    jsonnet_fmt_indent(vm, (int)setting->num);
+	    break;
+	case SETTING_FMT_MAX_BLANK_LINES:
+	    jsonnet_fmt_max_blank_lines(vm, (int)setting->num);
+	    break;
+	case SETTING_FMT_STRING:
+	    jsonnet_fmt_string(vm, (int)setting->num);
+	    break;
+	case SETTING_FMT_COMMENT:
+	    jsonnet_fmt_comment(vm, (int)setting->num);
+	    break;
+	case SETTING_FMT_PAD_ARRAYS:
+	    jsonnet_fmt_pad_arrays(vm, (int)setting->num);
+	    break;
+	case SETTING_FMT_PAD_OBJECTS:
+	    jsonnet_fmt_pad_objects(vm, (int)setting->num);
+	    break;
+	case SETTING_FMT_PRETTY_FIELD_NAMES:
+	    jsonnet_fmt_pretty_field_names(vm, (int)setting->num);
+	    break;
+	case SETTING_FMT_SORT_IMPORTS:
+	    jsonnet_fmt_sort_imports(vm, (int)setting->num);
+	    break;
+#else
+	default:
+	    /* recorded but has no effect without the formatter */
+	    break;
+#endif
+    }
+}
+
+/**
+ * Applies the configuration of \c src to \c dst.
+ * Callbacks are not copied. See rubyjsonnet_vm_copy_callbacks() for them.
+ *
+ * @param[in] dst a JsonnetVM to be configured
+ * @param[in] src a VM whose configuration has been recorded
+ */
+void
+rubyjsonnet_vm_configure(struct JsonnetVm *dst, const struct jsonnet_vm_wrap *src)
+{
+    long i;
+    for (i = 0; i < src->config.len; ++i) {
+	vm_apply_setting(dst, &src->config.settings[i]);
+    }
+}
+
+/**
+ * Returns the library search path which was added to \c vm \c n-th last,
+ * or NULL if there is no such path.
+ * libjsonnet searches the paths in this order.
+ */
+const char *
+rubyjsonnet_vm_jpath(const struct jsonnet_vm_wrap *vm, long n)
+{
+    long i;
+    for (i = vm->config.len - 1; i >= 0; --i) {
+	if (vm->config.settings[i].type == SETTING_JPATH && n-- == 0) {
+	    return vm->config.settings[i].key;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Configures the VM and records the setting.
+ */
+static void
+vm_set(struct jsonnet_vm_wrap *vm, enum jsonnet_vm_setting_type type, const char *key,
+       const char *val, double num)
+{
+    vm_apply_setting(vm->vm, vm_record(vm, type, key, val, num));
+}
+
+/*
+ * Initializes a copy of a VM.
+ *
+ * The copy gets the configuration, the import callback and cache, and the
+ * native functions of the original in native code, without validating them
+ * again. Memoized results are not copied.
+ */
 static VALUE
-vm_evaluate_file(VALUE self, VALUE fname, VALUE encoding, VALUE multi_p)
+vm_initialize_copy(VALUE self, VALUE orig)
 {
+    long i;
+    struct jsonnet_vm_wrap *vm, *src;
+
+    if (self == orig) {
+	return self;
+    }
+    rb_check_frozen(self);
+    TypedData_Get_Struct(self, struct jsonnet_vm_wrap, &jsonnet_vm_type, vm);
+    src = rubyjsonnet_obj_to_vm(orig);
+    if (vm->config.len || vm->native_callbacks.len || !NIL_P(vm->import_callback) ||
+	!NIL_P(vm->import_cache)) {
+	rb_raise(rb_eTypeError, "already initialized VM");
+    }
+
+    vm->config.settings = ALLOC_N(struct jsonnet_vm_setting, src->config.len);
+    for (i = 0; i < src->config.len; ++i) {
+	const struct jsonnet_vm_setting *const setting = &src->config.settings[i];
+	struct jsonnet_vm_setting *const copy = &vm->config.settings[i];
+
+	copy->type = setting->type;
+	copy->key = setting->key ? setting_strdup(setting->key) : NULL;
+	copy->val = setting->val ? setting_strdup(setting->val) : NULL;
+	copy->num = setting->num;
+	vm->config.len++;
+    }
+    rubyjsonnet_vm_configure(vm->vm, vm);
+    vm->timeout = src->timeout;
+    rubyjsonnet_vm_copy_callbacks(vm, src, 0);
+    return self;
+}
+
+struct eval_args {
+    struct jsonnet_vm_wrap *vm;
+    const char *fname;
+    /* NULL when evaluating the file \c fname */
+    const char *snippet;
+    enum rubyjsonnet_eval_mode mode;
     int error;
     char *result;
+};
+
+/**
+ * Evaluates a snippet or a file with \c vm.
+ * Can be called without the GVL.
+ *
+ * @param[in] vm       a JsonnetVM
+ * @param[in] fname    name of the file to evaluate, or filename of the snippet
+ * @param[in] snippet  Jsonnet source, or NULL to evaluate the file \c fname
+ * @param[in] mode     single, multi or stream mode
+ * @param[out] error   set to non-zero on error
+ * @return the result of the evaluation or an error message. The caller must free it.
+ */
+char *
+rubyjsonnet_evaluate(struct JsonnetVm *vm, const char *fname, const char *snippet,
+		     enum rubyjsonnet_eval_mode mode, int *error)
+{
+    switch (mode) {
+	case RUBYJSONNET_EVAL_MULTI:
+	    return snippet ? jsonnet_evaluate_snippet_multi(vm, fname, snippet, error)
+			   : jsonnet_evaluate_file_multi(vm, fname, error);
+	case RUBYJSONNET_EVAL_STREAM:
+	    return snippet ? jsonnet_evaluate_snippet_stream(vm, fname, snippet, error)
+			   : jsonnet_evaluate_file_stream(vm, fname, error);
+	default:
+	    return snippet ? jsonnet_evaluate_snippet(vm, fname, snippet, error)
+			   : jsonnet_evaluate_file(vm, fname, error);
+    }
+}
+
+/*
+ * Returns the size of a result of rubyjsonnet_evaluate(), excluding the
+ * separators in multi-mode and stream mode.
+ */
+static size_t
+result_size(const char *result, enum rubyjsonnet_eval_mode mode)
+{
+    size_t size = 0;
+
+    if (mode == RUBYJSONNET_EVAL_SINGLE) {
+	return strlen(result);
+    }
+    while (*result) {
+	const size_t len = strlen(result);
+	size += len;
+	result += len + 1;
+    }
+    return size;
+}
+
+static void *
+eval_without_gvl(void *ptr)
+{
+    struct eval_args *const args = (struct eval_args *)ptr;
+    args->result =
+	rubyjsonnet_evaluate(args->vm->vm, args->fname, args->snippet, args->mode, &args->error);
+    if (!args->error) {
+	args->vm->stats.output_bytes = result_size(args->result, args->mode);
+    }
+    return NULL;
+}
+
+/**
+ * Returns the current time in seconds for measuring durations.
+ */
+double
+rubyjsonnet_monotonic_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Returns a new TimeoutError for an evaluation which exceeded \c timeout seconds.
+ */
+VALUE
+rubyjsonnet_timeout_error_new(double timeout)
+{
+    return rb_exc_new_str(eTimeoutError,
+			  rb_sprintf("evaluation timed out after %g seconds", timeout));
+}
+
+/**
+ * Returns non-zero if the current evaluation of \c vm should be aborted.
+ * Callbacks call this without the GVL before doing anything, and fail if
+ * so. libjsonnet then unwinds the evaluation and frees its heap as it does
+ * on other errors.
+ */
+int
+rubyjsonnet_vm_cancelled_p(struct jsonnet_vm_wrap *vm)
+{
+    if (vm->cancel != RUBYJSONNET_CANCEL_NONE) {
+	return 1;
+    }
+    if (vm->deadline > 0 && rubyjsonnet_monotonic_now() >= vm->deadline) {
+	vm->cancel = RUBYJSONNET_CANCEL_TIMEOUT;
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Unblocking function of evaluations, called on interrupts to the thread.
+ * The evaluation stops at the next callback.
+ */
+static void
+eval_cancel(void *ptr)
+{
+    struct jsonnet_vm_wrap *const vm = (struct jsonnet_vm_wrap *)ptr;
+    if (vm->cancel == RUBYJSONNET_CANCEL_NONE) {
+	vm->cancel = RUBYJSONNET_CANCEL_INTERRUPT;
+    }
+}
+
+/**
+ * Runs the evaluation described by \c args without the GVL so that other
+ * threads can run in the meantime.
+ *
+ * Callbacks reacquire the GVL by themselves when they need to call into Ruby.
+ * Pending interrupts are handled before the evaluation starts so that the
+ * result buffer never leaks on Thread#raise.
+ *
+ * Interrupts and the timeout of the VM abort the evaluation at the next
+ * callback. The evaluation is retried if the interrupt turns out not to
+ * raise, e.g. a signal handler.
+ *
+ * @throw TimeoutError if the evaluation exceeds the timeout of the VM
+ */
+static void
+eval_with_gvl_released(struct eval_args *args)
+{
+    struct jsonnet_vm_wrap *const vm = args->vm;
+    const double started = rubyjsonnet_monotonic_now();
+
+    args->result = NULL;
+    rubyjsonnet_vm_reset_memos(vm);
+    rubyjsonnet_vm_reset_stats(vm);
+    rubyjsonnet_vm_clear_dependencies(vm);
+    vm->deadline = vm->timeout > 0 ? started + vm->timeout : 0;
+    for (;;) {
+	vm->cancel = RUBYJSONNET_CANCEL_NONE;
+	vm->evaluating = 1;
+	rb_thread_call_without_gvl2(eval_without_gvl, args, eval_cancel, vm);
+	vm->evaluating = 0;
+	vm->stats.wall_time = rubyjsonnet_monotonic_now() - started;
+	if (args->result && args->error && vm->cancel != RUBYJSONNET_CANCEL_NONE) {
+	    jsonnet_realloc(vm->vm, args->result, 0);
+	    args->result = NULL;
+	    if (vm->cancel == RUBYJSONNET_CANCEL_TIMEOUT) {
+		rb_exc_raise(rubyjsonnet_timeout_error_new(vm->timeout));
+	    }
+	}
+	if (args->result) {
+	    return;
+	}
+	rb_thread_check_ints();
+    }
+}
+
+/*
+ * Returns non-zero if string_output is enabled on \c vm.
+ */
+static int
+vm_string_output_p(const struct jsonnet_vm_wrap *vm)
+{
+    long i;
+    for (i = 0; i < vm->config.len; ++i) {
+	if (vm->config.settings[i].type == SETTING_STRING_OUTPUT) {
+	    return vm->config.settings[i].num != 0;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Converts the "parse" argument of eval_file and eval_snippet into \c opts.
+ * Returns NULL if the result should be a JSON string.
+ */
+static const struct rubyjsonnet_parse_options *
+vm_parse_options(const struct jsonnet_vm_wrap *vm, VALUE parse,
+		 struct rubyjsonnet_parse_options *opts)
+{
+    if (!RTEST(parse)) {
+	return NULL;
+    }
+    if (vm_string_output_p(vm)) {
+	rb_raise(rb_eArgError, "cannot parse the result with string_output enabled");
+    }
+
+    opts->symbolize_names = 0;
+    opts->freeze = 0;
+    if (parse != Qtrue) {
+	Check_Type(parse, T_HASH);
+	opts->symbolize_names = RTEST(rb_hash_lookup(parse, ID2SYM(rb_intern("symbolize_names"))));
+	opts->freeze = RTEST(rb_hash_lookup(parse, ID2SYM(rb_intern("freeze"))));
+    }
+    return opts;
+}
+
+/*
+ * Converts the result of a successful evaluation into the return value of
+ * eval_file and eval_snippet.
+ * In multi-mode the files are written into \c output_dir unless it is nil,
+ * or yielded one by one if a block is given.
+ * In stream mode the documents are yielded one by one.
+ * In single mode the result is written into \c out unless it is nil.
+ */
+static VALUE
+vm_eval_result(struct jsonnet_vm_wrap *vm, struct eval_args *args, rb_encoding *enc,
+	       const struct rubyjsonnet_parse_options *parse_opts, VALUE output_dir, VALUE fsync,
+	       VALUE out)
+{
+    switch (args->mode) {
+	case RUBYJSONNET_EVAL_SINGLE:
+	    if (!NIL_P(out)) {
+		return rubyjsonnet_str_write(vm->vm, args->result, enc, out);
+	    }
+	    return rubyjsonnet_value_new(vm->vm, args->result, enc, parse_opts);
+	case RUBYJSONNET_EVAL_STREAM:
+	    return rubyjsonnet_stream_each(vm->vm, args->result, enc, parse_opts);
+	default:
+	    break;
+    }
+    if (!NIL_P(output_dir)) {
+	return rubyjsonnet_fileset_write(vm->vm, args->result, enc, output_dir, RTEST(fsync));
+    }
+    if (rb_block_given_p()) {
+	return rubyjsonnet_fileset_each(vm->vm, args->result, enc, parse_opts);
+    }
+    return rubyjsonnet_fileset_new(vm->vm, args->result, enc, parse_opts);
+}
+
+/*
+ * Converts the "mode" argument of eval_file and eval_snippet, which is
+ * :stream or whether multi-mode is enabled.
+ */
+static enum rubyjsonnet_eval_mode
+vm_eval_mode(VALUE mode)
+{
+    if (SYMBOL_P(mode) && SYM2ID(mode) == rb_intern("stream")) {
+	return RUBYJSONNET_EVAL_STREAM;
+    }
+    return RTEST(mode) ? RUBYJSONNET_EVAL_MULTI : RUBYJSONNET_EVAL_SINGLE;
+}
+
+/*
+ * Validates the "output_dir" argument before evaluation so that the result
+ * buffer is never leaked by the validation.
+ */
+static VALUE
+vm_output_dir(VALUE output_dir)
+{
+    if (NIL_P(output_dir)) {
+	return Qnil;
+    }
+    FilePathValue(output_dir);
+    output_dir = rb_str_new_frozen(output_dir);
+    StringValueCStr(output_dir);
+    return output_dir;
+}
+
+static VALUE
+vm_evaluate_file(VALUE self, VALUE fname, VALUE encoding, VALUE mode, VALUE parse,
+		 VALUE output_dir, VALUE fsync, VALUE out)
+{
+    struct eval_args args;
+    struct rubyjsonnet_parse_options popts;
+    const struct rubyjsonnet_parse_options *parse_opts;
     rb_encoding *const enc = rb_to_encoding(encoding);
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
 
+    parse_opts = vm_parse_options(vm, parse, &popts);
+    output_dir = vm_output_dir(output_dir);
+    /* frozen copies keep the buffers stable while other threads run */
     FilePathValue(fname);
-    if (RTEST(multi_p)) {
-	result = jsonnet_evaluate_file_multi(vm->vm, StringValueCStr(fname), &error);
-    } else {
-	result = jsonnet_evaluate_file(vm->vm, StringValueCStr(fname), &error);
-    }
+    fname = rb_str_new_frozen(fname);
+    args.vm = vm;
+    args.fname = StringValueCStr(fname);
+    args.snippet = NULL;
+    args.mode = vm_eval_mode(mode);
+    eval_with_gvl_released(&args);
+    RB_GC_GUARD(fname);
 
-    if (error) {
-	raise_eval_error(vm->vm, result, rb_enc_get(fname));
+    if (args.error) {
+	raise_eval_error(vm->vm, args.result, rb_enc_get(fname));
     }
-    return RTEST(multi_p) ? fileset_new(vm->vm, result, enc) : str_new_json(vm->vm, result, enc);
+    return vm_eval_result(vm, &args, enc, parse_opts, output_dir, fsync, out);
 }
 
 static VALUE
-vm_evaluate(VALUE self, VALUE snippet, VALUE fname, VALUE multi_p)
+vm_evaluate(VALUE self, VALUE snippet, VALUE fname, VALUE mode, VALUE parse,
+	    VALUE output_dir, VALUE fsync, VALUE out)
 {
-    int error;
-    char *result;
+    struct eval_args args;
+    struct rubyjsonnet_parse_options popts;
+    const struct rubyjsonnet_parse_options *parse_opts;
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
 
     rb_encoding *enc = rubyjsonnet_assert_asciicompat(StringValue(snippet));
+    parse_opts = vm_parse_options(vm, parse, &popts);
+    output_dir = vm_output_dir(output_dir);
     FilePathValue(fname);
-    if (RTEST(multi_p)) {
-	result = jsonnet_evaluate_snippet_multi(vm->vm, StringValueCStr(fname),
-						StringValueCStr(snippet), &error);
-    } else {
-	result = jsonnet_evaluate_snippet(vm->vm, StringValueCStr(fname), StringValueCStr(snippet),
-					  &error);
-    }
+    snippet = rb_str_new_frozen(snippet);
+    fname = rb_str_new_frozen(fname);
+    args.vm = vm;
+    args.fname = StringValueCStr(fname);
+    args.snippet = StringValueCStr(snippet);
+    args.mode = vm_eval_mode(mode);
+    eval_with_gvl_released(&args);
+    RB_GC_GUARD(snippet);
+    RB_GC_GUARD(fname);
 
-    if (error) {
-	raise_eval_error(vm->vm, result, rb_enc_get(fname));
+    if (args.error) {
+	raise_eval_error(vm->vm, args.result, rb_enc_get(fname));
     }
-    return RTEST(multi_p) ? fileset_new(vm->vm, result, enc) : str_new_json(vm->vm, result, enc);
+    return vm_eval_result(vm, &args, enc, parse_opts, output_dir, fsync, out);
 }
 
 #define vm_bind_variable(type, self, key, val)                                    \
@@ -148,8 +766,8 @@ vm_evaluate(VALUE self, VALUE snippet, VALUE fname, VALUE multi_p)
                                                                                   \
 	rubyjsonnet_assert_asciicompat(StringValue(key));                         \
 	rubyjsonnet_assert_asciicompat(StringValue(val));                         \
-	TypedData_Get_Struct(self, struct jsonnet_vm_wrap, &jsonnet_vm_type, vm); \
-	jsonnet_##type(vm->vm, StringValueCStr(key), StringValueCStr(val));       \
+	vm = rubyjsonnet_obj_to_vm(self);                                         \
+	vm_set(vm, type, StringValueCStr(key), StringValueCStr(val), 0);          \
     } while (0)
 
 /*
@@ -160,7 +778,7 @@ vm_evaluate(VALUE self, VALUE snippet, VALUE fname, VALUE multi_p)
 static VALUE
 vm_ext_var(VALUE self, VALUE key, VALUE val)
 {
-    vm_bind_variable(ext_var, self, key, val);
+    vm_bind_variable(SETTING_EXT_VAR, self, key, val);
     return Qnil;
 }
 
@@ -172,7 +790,7 @@ vm_ext_var(VALUE self, VALUE key, VALUE val)
 static VALUE
 vm_ext_code(VALUE self, VALUE key, VALUE code)
 {
-    vm_bind_variable(ext_code, self, key, code);
+    vm_bind_variable(SETTING_EXT_CODE, self, key, code);
     return Qnil;
 }
 
@@ -184,7 +802,7 @@ vm_ext_code(VALUE self, VALUE key, VALUE code)
 static VALUE
 vm_tla_var(VALUE self, VALUE key, VALUE val)
 {
-    vm_bind_variable(tla_var, self, key, val);
+    vm_bind_variable(SETTING_TLA_VAR, self, key, val);
     return Qnil;
 }
 
@@ -196,10 +814,115 @@ vm_tla_var(VALUE self, VALUE key, VALUE val)
 static VALUE
 vm_tla_code(VALUE self, VALUE key, VALUE code)
 {
-    vm_bind_variable(tla_code, self, key, code);
+    vm_bind_variable(SETTING_TLA_CODE, self, key, code);
     return Qnil;
 }
 
+/*
+ * Returns non-zero if \c key is one of the Strings in \c argv.
+ */
+static int
+tla_rebound_p(const char *key, int argc, const VALUE *argv)
+{
+    int i;
+    for (i = 0; i < argc; ++i) {
+	if (!strcmp(key, RSTRING_PTR(argv[i]))) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Unbinds all the top-level arguments.
+ *
+ * libjsonnet cannot unbind them. So this replaces the underlying JsonnetVm
+ * with a new one which has the same configuration and callbacks except them,
+ * unless all of them are to be bound again by the caller, which overwrites
+ * them without the cost of a new JsonnetVm.
+ *
+ * @param [Array<String>] rebound  names of the arguments which the caller
+ *   binds right after this call
+ * @return [Boolean] true if the JsonnetVm was replaced
+ */
+static VALUE
+vm_clear_tla(int argc, VALUE *argv, VALUE self)
+{
+    long i, len = 0;
+    int rebound = 1;
+    struct JsonnetVm *old;
+    struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
+
+    for (i = 0; i < argc; ++i) {
+	StringValueCStr(argv[i]);
+    }
+    for (i = 0; i < vm->config.len && rebound; ++i) {
+	const struct jsonnet_vm_setting *const setting = &vm->config.settings[i];
+	if (setting->type == SETTING_TLA_VAR || setting->type == SETTING_TLA_CODE) {
+	    rebound = tla_rebound_p(setting->key, argc, argv);
+	}
+    }
+    if (rebound) {
+	return Qfalse;
+    }
+
+    for (i = 0; i < vm->config.len; ++i) {
+	struct jsonnet_vm_setting *const setting = &vm->config.settings[i];
+	if (setting->type == SETTING_TLA_VAR || setting->type == SETTING_TLA_CODE) {
+	    xfree(setting->key);
+	    xfree(setting->val);
+	} else {
+	    vm->config.settings[len++] = *setting;
+	}
+    }
+    vm->config.len = len;
+
+    old = vm->vm;
+    vm->vm = jsonnet_make();
+    jsonnet_destroy(old);
+    rubyjsonnet_vm_configure(vm->vm, vm);
+    rubyjsonnet_vm_register_callbacks(vm);
+    return Qtrue;
+}
+
+static void
+config_key_cat(VALUE key, const char *str)
+{
+    if (str) {
+	rb_str_cat_cstr(key, str);
+    }
+    rb_str_cat(key, "", 1);
+}
+
+/*
+ * Serializes everything configured on the VM which can change the result of
+ * an evaluation: the settings in the order they were made, the names and the
+ * parameters of the native functions, the import patterns and whether the
+ * import callback is set.
+ *
+ * @return [String] a binary string, equal between VMs configured in the same
+ *   way, also across processes.
+ */
+static VALUE
+vm_config_key(VALUE self)
+{
+    long i;
+    struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
+    VALUE key = rb_str_buf_new(0);
+
+    for (i = 0; i < vm->config.len; ++i) {
+	const struct jsonnet_vm_setting *const setting = &vm->config.settings[i];
+
+	rb_str_catf(key, "%d %.17g", (int)setting->type, setting->num);
+	rb_str_cat(key, "", 1);
+	config_key_cat(key, setting->key);
+	config_key_cat(key, setting->val);
+    }
+    rb_str_cat(key, "", 1);
+    rubyjsonnet_vm_callbacks_key(vm, key);
+    return key;
+}
+
 /*
  * Adds library search paths
  */
@@ -212,7 +935,7 @@ vm_jpath_add_m(int argc, const VALUE *argv, VALUE self)
     for (i = 0; i < argc; ++i) {
 	VALUE jpath = argv[i];
 	FilePathValue(jpath);
-	jsonnet_jpath_add(vm->vm, StringValueCStr(jpath));
+	vm_set(vm, SETTING_JPATH, StringValueCStr(jpath), NULL, 0);
     }
     return Qnil;
 }
@@ -221,7 +944,7 @@ static VALUE
 vm_set_max_stack(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_max_stack(vm->vm, NUM2UINT(val));
+    vm_set(vm, SETTING_MAX_STACK, NULL, NULL, NUM2UINT(val));
     return Qnil;
 }
 
@@ -229,7 +952,7 @@ static VALUE
 vm_set_gc_min_objects(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_gc_min_objects(vm->vm, NUM2UINT(val));
+    vm_set(vm, SETTING_GC_MIN_OBJECTS, NULL, NULL, NUM2UINT(val));
     return Qnil;
 }
 
@@ -237,10 +960,151 @@ static VALUE
 vm_set_gc_growth_trigger(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_gc_growth_trigger(vm->vm, NUM2DBL(val));
+    vm_set(vm, SETTING_GC_GROWTH_TRIGGER, NULL, NULL, NUM2DBL(val));
     return Qnil;
 }
 
+/*
+ * Returns statistics of the last evaluation by #evaluate or #evaluate_file.
+ *
+ * Imports are counted and timed only by the resolver of this library, which
+ * the VM uses once it has been given an import callback, an import cache or
+ * #track_dependencies=. Otherwise the Jsonnet implementation resolves them,
+ * and +:imports+ and +:import_time+ stay zero.
+ *
+ * @return [Hash] +:wall_time+ and +:import_time+ in seconds, the number of
+ *   +:imports+ and +:import_cache_hits+ among them, +:output_bytes+, and
+ *   +:native_calls+, which maps the names of the native functions to their
+ *   +:calls+ and +:time+.
+ */
+static VALUE
+vm_last_stats(VALUE self)
+{
+    struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
+    VALUE stats = rb_hash_new(), natives = rb_hash_new();
+    const VALUE calls = ID2SYM(rb_intern("calls")), time = ID2SYM(rb_intern("time"));
+    long i;
+
+    for (i = 0; i < vm->native_callbacks.len; ++i) {
+	const struct native_callback_ctx *const ctx = vm->native_callbacks.contexts[i];
+	const VALUE name = rb_str_new_cstr(ctx->name);
+	VALUE entry = rb_hash_lookup(natives, name);
+
+	/* a function defined twice is counted as one */
+	if (NIL_P(entry)) {
+	    entry = rb_hash_new();
+	    rb_hash_aset(entry, calls, LONG2NUM(0));
+	    rb_hash_aset(entry, time, DBL2NUM(0));
+	    rb_hash_aset(natives, name, entry);
+	}
+	rb_hash_aset(entry, calls,
+		     LONG2NUM(NUM2LONG(rb_hash_aref(entry, calls)) + ctx->calls));
+	rb_hash_aset(entry, time, DBL2NUM(NUM2DBL(rb_hash_aref(entry, time)) + ctx->time));
+    }
+
+    rb_hash_aset(stats, ID2SYM(rb_intern("wall_time")), DBL2NUM(vm->stats.wall_time));
+    rb_hash_aset(stats, ID2SYM(rb_intern("imports")), LONG2NUM(vm->stats.imports));
+    rb_hash_aset(stats, ID2SYM(rb_intern("import_cache_hits")),
+		 LONG2NUM(vm->stats.import_cache_hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("import_time")), DBL2NUM(vm->stats.import_time));
+    rb_hash_aset(stats, ID2SYM(rb_intern("native_calls")), natives);
+    rb_hash_aset(stats, ID2SYM(rb_intern("output_bytes")), SIZET2NUM(vm->stats.output_bytes));
+    return stats;
+}
+
+static VALUE
+stats_fetch(VALUE stats, const char *name)
+{
+    return rb_hash_lookup2(stats, ID2SYM(rb_intern(name)), INT2FIX(0));
+}
+
+/*
+ * Restores what #last_dependencies and #last_stats report to those of an
+ * earlier evaluation. Used by Jsonnet::ResultCache for the evaluations it
+ * serves.
+ *
+ * @param [Array] deps  the imported files in the form of #last_dependencies
+ * @param [Array<String>] missing  the paths not found, as #last_missing_files
+ * @param [Hash] stats  the statistics in the form of #last_stats
+ */
+static VALUE
+vm_restore_last_evaluation(VALUE self, VALUE deps, VALUE missing, VALUE stats)
+{
+    struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
+    VALUE natives;
+    long i;
+
+    deps = rb_Array(deps);
+    missing = rb_Array(missing);
+    Check_Type(stats, T_HASH);
+    natives = rb_hash_lookup(stats, ID2SYM(rb_intern("native_calls")));
+    natives = NIL_P(natives) ? rb_hash_new() : rb_hash_dup(rb_Hash(natives));
+
+    rubyjsonnet_vm_clear_dependencies(vm);
+    for (i = 0; i < RARRAY_LEN(deps); ++i) {
+	const VALUE dep = rb_Array(RARRAY_AREF(deps, i));
+	VALUE path = rb_ary_entry(dep, 0);
+
+	rubyjsonnet_vm_add_dependency(vm, StringValueCStr(path), NUM2SIZET(rb_ary_entry(dep, 2)),
+				      NUM2ULL(rb_ary_entry(dep, 1)), 0);
+    }
+    for (i = 0; i < RARRAY_LEN(missing); ++i) {
+	VALUE path = RARRAY_AREF(missing, i);
+	rubyjsonnet_vm_add_dependency(vm, StringValueCStr(path), 0, 0, 1);
+    }
+
+    rubyjsonnet_vm_reset_stats(vm);
+    vm->stats.wall_time = NUM2DBL(stats_fetch(stats, "wall_time"));
+    vm->stats.imports = NUM2LONG(stats_fetch(stats, "imports"));
+    vm->stats.import_cache_hits = NUM2LONG(stats_fetch(stats, "import_cache_hits"));
+    vm->stats.import_time = NUM2DBL(stats_fetch(stats, "import_time"));
+    vm->stats.output_bytes = NUM2SIZET(stats_fetch(stats, "output_bytes"));
+    for (i = 0; i < vm->native_callbacks.len; ++i) {
+	struct native_callback_ctx *const ctx = vm->native_callbacks.contexts[i];
+	/* deleted so that a function defined twice is counted once, as #last_stats does */
+	const VALUE entry = rb_hash_delete(natives, rb_str_new_cstr(ctx->name));
+
+	if (RB_TYPE_P(entry, T_HASH)) {
+	    ctx->calls = NUM2LONG(stats_fetch(entry, "calls"));
+	    ctx->time = NUM2DBL(stats_fetch(entry, "time"));
+	}
+    }
+    return Qnil;
+}
+
+/*
+ * Sets the time limit of each evaluation.
+ *
+ * The limit is checked when the evaluation calls back into Ruby or imports a
+ * file. An evaluation which does neither runs to the end.
+ * @param [Numeric, nil] val seconds, or nil for no limit
+ */
+static VALUE
+vm_set_timeout(VALUE self, VALUE val)
+{
+    struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
+    double timeout = 0;
+
+    if (!NIL_P(val)) {
+	timeout = NUM2DBL(val);
+	if (!(timeout > 0)) {
+	    rb_raise(rb_eArgError, "timeout must be positive");
+	}
+    }
+    vm->timeout = timeout;
+    return val;
+}
+
+/*
+ * @return [Float, nil] the time limit of each evaluation in seconds
+ */
+static VALUE
+vm_timeout(VALUE self)
+{
+    struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
+    return vm->timeout > 0 ? DBL2NUM(vm->timeout) : Qnil;
+}
+
 /*
  * Let #evaluate and #evaluate_file return a raw String instead of JSON-encoded string if val is
  * true
@@ -250,7 +1114,7 @@ static VALUE
 vm_set_string_output(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_string_output(vm->vm, RTEST(val));
+    vm_set(vm, SETTING_STRING_OUTPUT, NULL, NULL, RTEST(val));
     return Qnil;
 }
 
@@ -258,7 +1122,7 @@ static VALUE
 vm_set_max_trace(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_max_trace(vm->vm, NUM2UINT(val));
+    vm_set(vm, SETTING_MAX_TRACE, NULL, NULL, NUM2UINT(val));
     return Qnil;
 }
 
@@ -266,7 +1130,7 @@ static VALUE
 vm_set_fmt_indent(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_fmt_indent(vm->vm, NUM2INT(val));
+    vm_set(vm, SETTING_FMT_INDENT, NULL, NULL, NUM2INT(val));
     return val;
 }
 
@@ -274,7 +1138,7 @@ static VALUE
 vm_set_fmt_max_blank_lines(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_fmt_max_blank_lines(vm->vm, NUM2INT(val));
+    vm_set(vm, SETTING_FMT_MAX_BLANK_LINES, NULL, NULL, NUM2INT(val));
     return val;
 }
 
@@ -292,7 +1156,7 @@ vm_set_fmt_string(VALUE self, VALUE str)
 	case 'd':
 	case 's':
 	case 'l':
-	    jsonnet_fmt_string(vm->vm, *ptr);
+	    vm_set(vm, SETTING_FMT_STRING, NULL, NULL, *ptr);
 	    return str;
 	default:
 	    rb_raise(rb_eArgError, "fmt_string only accepts 'd', 's', or 'l'");
@@ -313,7 +1177,7 @@ vm_set_fmt_comment(VALUE self, VALUE str)
 	case 'h':
 	case 's':
 	case 'l':
-	    jsonnet_fmt_comment(vm->vm, *ptr);
+	    vm_set(vm, SETTING_FMT_COMMENT, NULL, NULL, *ptr);
 	    return str;
 	default:
 	    rb_raise(rb_eArgError, "fmt_comment only accepts 'h', 's', or 'l'");
@@ -324,7 +1188,7 @@ static VALUE
 vm_set_fmt_pad_arrays(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_fmt_pad_objects(vm->vm, RTEST(val) ? 1 : 0);
+    vm_set(vm, SETTING_FMT_PAD_ARRAYS, NULL, NULL, RTEST(val) ? 1 : 0);
     return val;
 }
 
@@ -332,7 +1196,7 @@ static VALUE
 vm_set_fmt_pad_objects(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_fmt_pad_objects(vm->vm, RTEST(val) ? 1 : 0);
+    vm_set(vm, SETTING_FMT_PAD_OBJECTS, NULL, NULL, RTEST(val) ? 1 : 0);
     return val;
 }
 
@@ -340,7 +1204,7 @@ static VALUE
 vm_set_fmt_pretty_field_names(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_fmt_pretty_field_names(vm->vm, RTEST(val) ? 1 : 0);
+    vm_set(vm, SETTING_FMT_PRETTY_FIELD_NAMES, NULL, NULL, RTEST(val) ? 1 : 0);
     return val;
 }
 
@@ -348,12 +1212,13 @@ static VALUE
 vm_set_fmt_sort_imports(VALUE self, VALUE val)
 {
     struct jsonnet_vm_wrap *vm = rubyjsonnet_obj_to_vm(self);
-    jsonnet_fmt_sort_imports(vm->vm, RTEST(val) ? 1 : 0);
+    vm_set(vm, SETTING_FMT_SORT_IMPORTS, NULL, NULL, RTEST(val) ? 1 : 0);
     return val;
 }
 
+#ifdef HAVE_JSONNET_FMT_SNIPPET
 static VALUE
-vm_fmt_file(VALUE self, VALUE fname, VALUE encoding)
+vm_fmt_file(VALUE self, VALUE fname, VALUE encoding, VALUE out)
 {
     int error;
     char *result;
@@ -365,11 +1230,14 @@ vm_fmt_file(VALUE self, VALUE fname, VALUE encoding)
     if (error) {
 	raise_format_error(vm->vm, result, rb_enc_get(fname));
     }
-    return str_new_json(vm->vm, result, enc);
+    if (!NIL_P(out)) {
+	return rubyjsonnet_str_write(vm->vm, result, enc, out);
+    }
+    return rubyjsonnet_str_new_json(vm->vm, result, enc);
 }
 
 static VALUE
-vm_fmt_snippet(VALUE self, VALUE snippet, VALUE fname)
+vm_fmt_snippet(VALUE self, VALUE snippet, VALUE fname, VALUE out)
 {
     int error;
     char *result;
@@ -381,28 +1249,45 @@ vm_fmt_snippet(VALUE self, VALUE snippet, VALUE fname)
     if (error) {
 	raise_format_error(vm->vm, result, rb_enc_get(fname));
     }
-    return str_new_json(vm->vm, result, enc);
+    if (!NIL_P(out)) {
+	return rubyjsonnet_str_write(vm->vm, result, enc, out);
+    }
+    return rubyjsonnet_str_new_json(vm->vm, result, enc);
 }
+#endif /* HAVE_JSONNET_FMT_SNIPPET */
 
 void
 rubyjsonnet_init_vm(VALUE mJsonnet)
 {
     cVM = rb_define_class_under(mJsonnet, "VM", rb_cObject);
     rb_define_alloc_func(cVM, vm_s_allocate);
-    rb_define_private_method(cVM, "eval_file", vm_evaluate_file, 3);
-    rb_define_private_method(cVM, "eval_snippet", vm_evaluate, 3);
-    rb_define_private_method(cVM, "fmt_file", vm_fmt_file, 2);
-    rb_define_private_method(cVM, "fmt_snippet", vm_fmt_snippet, 2);
+    rb_define_method(cVM, "initialize_copy", vm_initialize_copy, 1);
+    rb_define_private_method(cVM, "eval_file", vm_evaluate_file, 7);
+    rb_define_private_method(cVM, "eval_snippet", vm_evaluate, 7);
+#ifdef HAVE_JSONNET_FMT_SNIPPET
+    rb_define_private_method(cVM, "fmt_file", vm_fmt_file, 3);
+    rb_define_private_method(cVM, "fmt_snippet", vm_fmt_snippet, 3);
+#else
+    /* go-jsonnet may not have the formatter */
+    rb_define_private_method(cVM, "fmt_file", rb_f_notimplement, -1);
+    rb_define_private_method(cVM, "fmt_snippet", rb_f_notimplement, -1);
+#endif
     rb_define_method(cVM, "ext_var", vm_ext_var, 2);
     rb_define_method(cVM, "ext_code", vm_ext_code, 2);
     rb_define_method(cVM, "tla_var", vm_tla_var, 2);
     rb_define_method(cVM, "tla_code", vm_tla_code, 2);
+    rb_define_private_method(cVM, "clear_tla", vm_clear_tla, -1);
+    rb_define_private_method(cVM, "config_key", vm_config_key, 0);
     rb_define_method(cVM, "jpath_add", vm_jpath_add_m, -1);
     rb_define_method(cVM, "max_stack=", vm_set_max_stack, 1);
     rb_define_method(cVM, "gc_min_objects=", vm_set_gc_min_objects, 1);
     rb_define_method(cVM, "gc_growth_trigger=", vm_set_gc_growth_trigger, 1);
     rb_define_method(cVM, "string_output=", vm_set_string_output, 1);
     rb_define_method(cVM, "max_trace=", vm_set_max_trace, 1);
+    rb_define_method(cVM, "timeout=", vm_set_timeout, 1);
+    rb_define_method(cVM, "timeout", vm_timeout, 0);
+    rb_define_method(cVM, "last_stats", vm_last_stats, 0);
+    rb_define_private_method(cVM, "restore_last_evaluation", vm_restore_last_evaluation, 3);
     rb_define_method(cVM, "fmt_indent=", vm_set_fmt_indent, 1);
     rb_define_method(cVM, "fmt_max_blank_lines=", vm_set_fmt_max_blank_lines, 1);
     rb_define_method(cVM, "fmt_string=", vm_set_fmt_string, 1);
@@ -420,15 +1305,51 @@ rubyjsonnet_init_vm(VALUE mJsonnet)
     rb_define_const(mJsonnet, "COMMENT_STYLE_LEAVE", rb_str_new_cstr("l"));
 
     rubyjsonnet_init_callbacks(cVM);
+    rubyjsonnet_init_batch(cVM);
 
     eEvaluationError = rb_define_class_under(mJsonnet, "EvaluationError", rb_eRuntimeError);
+    eTimeoutError = rb_define_class_under(mJsonnet, "TimeoutError", eEvaluationError);
     eFormatError = rb_define_class_under(mJsonnet, "FormatError", rb_eRuntimeError);
 }
 
+static VALUE
+error_new(VALUE exception_class, struct JsonnetVm *vm, char *msg, rb_encoding *enc)
+{
+    VALUE ex = rb_exc_new3(exception_class, rb_enc_str_new_cstr(msg, enc));
+    jsonnet_realloc(vm, msg, 0);
+    return ex;
+}
+
+/**
+ * Returns an EvaluationError whose message is \c msg without raising it.
+ * It automatically frees \c msg.
+ *
+ * @param[in] vm  a JsonnetVM
+ * @param[in] msg must be a NUL-terminated string returned by \c vm.
+ *   It must not be a global escape. See rubyjsonnet_jump_tag().
+ */
+VALUE
+rubyjsonnet_eval_error_new(struct JsonnetVm *vm, char *msg, rb_encoding *enc)
+{
+    return error_new(eEvaluationError, vm, msg, enc);
+}
+
+/**
+ * Returns a FormatError whose message is \c msg without raising it.
+ * It automatically frees \c msg.
+ *
+ * @param[in] vm  a JsonnetVM
+ * @param[in] msg must be a NUL-terminated string returned by \c vm.
+ */
+VALUE
+rubyjsonnet_format_error_new(struct JsonnetVm *vm, char *msg, rb_encoding *enc)
+{
+    return error_new(eFormatError, vm, msg, enc);
+}
+
 static void
 NORETURN(raise_error)(VALUE exception_class, struct JsonnetVm *vm, char *msg, rb_encoding *enc)
 {
-    VALUE ex;
     const int state = rubyjsonnet_jump_tag(msg);
     if (state) {
 	/*
@@ -439,9 +1360,7 @@ NORETURN(raise_error)(VALUE exception_class, struct JsonnetVm *vm, char *msg, rb
 	rb_jump_tag(state);
     }
 
-    ex = rb_exc_new3(exception_class, rb_enc_str_new_cstr(msg, enc));
-    jsonnet_realloc(vm, msg, 0);
-    rb_exc_raise(ex);
+    rb_exc_raise(error_new(exception_class, vm, msg, enc));
 }
 
 /**
@@ -458,11 +1377,13 @@ NORETURN(raise_eval_error)(struct JsonnetVm *vm, char *msg, rb_encoding *enc)
     raise_error(eEvaluationError, vm, msg, enc);
 }
 
+#ifdef HAVE_JSONNET_FMT_SNIPPET
 static void
 NORETURN(raise_format_error)(struct JsonnetVm *vm, char *msg, rb_encoding *enc)
 {
     raise_error(eFormatError, vm, msg, enc);
 }
+#endif
 
 /**
  * Returns a String whose contents is equal to \c json.
@@ -472,39 +1393,120 @@ NORETURN(raise_format_error)(struct JsonnetVm *vm, char *msg, rb_encoding *enc)
  * @param[in] json must be a NUL-terminated string returned by \c vm.
  * @return Ruby string equal to \c json.
  */
-static VALUE
-str_new_json(struct JsonnetVm *vm, char *json, rb_encoding *enc)
+VALUE
+rubyjsonnet_str_new_json(struct JsonnetVm *vm, char *json, rb_encoding *enc)
 {
     VALUE str = rb_enc_str_new_cstr(json, enc);
     jsonnet_realloc(vm, json, 0);
     return str;
 }
 
+struct json_value_args {
+    const char *json;
+    const struct rubyjsonnet_parse_options *parse;
+};
+
+static VALUE
+json_value_parse(VALUE ptr)
+{
+    const struct json_value_args *const args = (const struct json_value_args *)ptr;
+    return rubyjsonnet_parse_json(args->json, args->parse);
+}
+
 /**
- * Returns a Hash, whose keys are file names in the multi-mode of Jsonnet,
- * and whose values are corresponding JSON values.
+ * Returns Ruby objects converted from \c json, or a String equal to \c json
+ * if \c parse is NULL.
  * It automatically frees \c json just after constructing the return value.
  *
- * @param[in] vm   a JsonnetVM
- * @param[in] buf  NUL-separated and double-NUL-terminated sequence of strings returned by \c vm.
- * @return Hash
+ * @param[in] vm    a JsonnetVM
+ * @param[in] json  must be a NUL-terminated string returned by \c vm.
+ * @param[in] parse options to convert \c json, or NULL
  */
+VALUE
+rubyjsonnet_value_new(struct JsonnetVm *vm, char *json, rb_encoding *enc,
+		      const struct rubyjsonnet_parse_options *parse)
+{
+    struct json_value_args args;
+    int state = 0;
+    VALUE result;
+
+    if (!parse) {
+	return rubyjsonnet_str_new_json(vm, json, enc);
+    }
+    args.json = json;
+    args.parse = parse;
+    result = rb_protect(json_value_parse, (VALUE)&args, &state);
+    jsonnet_realloc(vm, json, 0);
+    if (state) {
+	rb_jump_tag(state);
+    }
+    return result;
+}
+
+/**
+ * Raises an EvaluationError for the output file \c name in multi-mode which
+ * has no body.
+ */
+void
+NORETURN(rubyjsonnet_raise_missing_body)(const char *name, rb_encoding *enc)
+{
+    rb_exc_raise(rb_exc_new3(eEvaluationError,
+			     rb_enc_sprintf(enc, "output file %s without body", name)));
+}
+
+struct fileset_args {
+    const char *buf;
+    rb_encoding *enc;
+    const struct rubyjsonnet_parse_options *parse;
+};
+
 static VALUE
-fileset_new(struct JsonnetVm *vm, char *buf, rb_encoding *enc)
+fileset_build(VALUE ptr)
 {
+    const struct fileset_args *const args = (const struct fileset_args *)ptr;
     VALUE fileset = rb_hash_new();
-    char *ptr, *json;
-    for (ptr = buf; *ptr; ptr = json + strlen(json) + 1) {
-	json = ptr + strlen(ptr) + 1;
+    const char *name, *json;
+
+    for (name = args->buf; *name; name = json + strlen(json) + 1) {
+	VALUE value;
+
+	json = name + strlen(name) + 1;
 	if (!*json) {
-	    VALUE ex = rb_exc_new3(eEvaluationError,
-				   rb_enc_sprintf(enc, "output file %s without body", ptr));
-	    jsonnet_realloc(vm, buf, 0);
-	    rb_exc_raise(ex);
+	    rubyjsonnet_raise_missing_body(name, args->enc);
 	}
-
-	rb_hash_aset(fileset, rb_enc_str_new_cstr(ptr, enc), rb_enc_str_new_cstr(json, enc));
+	value = args->parse ? rubyjsonnet_parse_json(json, args->parse)
+			    : rb_enc_str_new_cstr(json, args->enc);
+	rb_hash_aset(fileset, rb_enc_str_new_cstr(name, args->enc), value);
     }
+    return fileset;
+}
+
+/**
+ * Returns a Hash, whose keys are file names in the multi-mode of Jsonnet,
+ * and whose values are corresponding JSON values.
+ * It automatically frees \c json just after constructing the return value.
+ *
+ * @param[in] vm    a JsonnetVM
+ * @param[in] buf   NUL-separated and double-NUL-terminated sequence of strings returned by \c vm.
+ * @param[in] parse options to convert the JSON values into Ruby objects, or
+ *                  NULL to keep them as strings.
+ * @return Hash
+ */
+VALUE
+rubyjsonnet_fileset_new(struct JsonnetVm *vm, char *buf, rb_encoding *enc,
+			const struct rubyjsonnet_parse_options *parse)
+{
+    struct fileset_args args;
+    int state = 0;
+    VALUE fileset;
+
+    args.buf = buf;
+    args.enc = enc;
+    args.parse = parse;
+    fileset = rb_protect(fileset_build, (VALUE)&args, &state);
     jsonnet_realloc(vm, buf, 0);
+    if (state) {
+	rb_jump_tag(state);
+    }
     return fileset;
 }
@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+#include <ruby/ruby.h>
+
+#include "ruby_jsonnet.h"
+
+/*
+ * Minimal binding of Linux inotify for Jsonnet::Watcher.
+ *
+ * Directories are watched instead of files because editors often save a file
+ * by renaming a new file over it, which a watch on the file would not see.
+ */
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* events which can change the content of a file in a watched directory, or
+ * end the watch of the directory */
+#define WATCHER_MASK \
+    (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+     IN_MOVE_SELF | IN_ONLYDIR)
+
+/*
+ * Opens a new inotify instance.
+ *
+ * @return [Integer] the file descriptor, which is non-blocking and
+ *   close-on-exec.
+ */
+static VALUE
+watcher_inotify_open(VALUE self)
+{
+    const int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+	rb_sys_fail("inotify_init1");
+    }
+    return INT2NUM(fd);
+}
+
+/*
+ * Starts watching the files in a directory.
+ *
+ * @param [Integer] fd  an inotify instance
+ * @param [String] dir  the directory
+ * @return [Integer] the watch descriptor
+ */
+static VALUE
+watcher_inotify_add_watch(VALUE self, VALUE fd, VALUE dir)
+{
+    int wd;
+
+    FilePathValue(dir);
+    wd = inotify_add_watch(NUM2INT(fd), StringValueCStr(dir), WATCHER_MASK);
+    if (wd < 0) {
+	rb_sys_fail_str(dir);
+    }
+    return INT2NUM(wd);
+}
+
+/*
+ * Reads the pending events without blocking.
+ *
+ * @param [Integer] fd  an inotify instance
+ * @return [Array<Array(Integer, String)>] the watch descriptor and the name of
+ *   the file in the directory of each event. The watch descriptor is -1 if
+ *   the kernel dropped events. The name is nil if the directory itself was
+ *   removed or moved, after which the watch no longer follows its path.
+ */
+static VALUE
+watcher_inotify_read(VALUE self, VALUE fd)
+{
+    /* aligned as the events in it are accessed in place */
+    union {
+	struct inotify_event event;
+	char bytes[16384];
+    } buf;
+    VALUE events = rb_ary_new();
+
+    for (;;) {
+	const ssize_t len = read(NUM2INT(fd), buf.bytes, sizeof(buf.bytes));
+	ssize_t off = 0;
+
+	if (len < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		break;
+	    }
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    rb_sys_fail("read");
+	}
+	if (len == 0) {
+	    break;
+	}
+	while (off < len) {
+	    const struct inotify_event *const event =
+		(const struct inotify_event *)(buf.bytes + off);
+
+	    if (event->mask & IN_Q_OVERFLOW) {
+		rb_ary_push(events, rb_assoc_new(INT2NUM(-1), rb_str_new(0, 0)));
+	    } else if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		rb_ary_push(events, rb_assoc_new(INT2NUM(event->wd), Qnil));
+	    } else if (event->len) {
+		rb_ary_push(events, rb_assoc_new(INT2NUM(event->wd),
+						 rb_str_new_cstr(event->name)));
+	    }
+	    off += sizeof(struct inotify_event) + event->len;
+	}
+    }
+    return events;
+}
+#endif
+
+void
+rubyjsonnet_init_watcher(VALUE mJsonnet)
+{
+    VALUE cWatcher = rb_define_class_under(mJsonnet, "Watcher", rb_cObject);
+
+#ifdef HAVE_SYS_INOTIFY_H
+    rb_define_private_method(cWatcher, "inotify_open", watcher_inotify_open, 0);
+    rb_define_private_method(cWatcher, "inotify_add_watch", watcher_inotify_add_watch, 2);
+    rb_define_private_method(cWatcher, "inotify_read", watcher_inotify_read, 1);
+#else
+    rb_define_private_method(cWatcher, "inotify_open", rb_f_notimplement, -1);
+    rb_define_private_method(cWatcher, "inotify_add_watch", rb_f_notimplement, -1);
+    rb_define_private_method(cWatcher, "inotify_read", rb_f_notimplement, -1);
+#endif
+}
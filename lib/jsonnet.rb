@@ -1,5 +1,10 @@
 require "jsonnet/version"
 require "jsonnet/vm"
+require "jsonnet/import_cache"
+require "jsonnet/result_cache"
+require "jsonnet/vm_pool"
+require "jsonnet/snippet"
+require "jsonnet/watcher"
 require "json"
 
 module Jsonnet
@@ -19,8 +24,14 @@ module Jsonnet
   #
   # @note This method runs Jsonnet::VM#evaluate and runs the string
   #       output through {JSON.parse}[http://www.rubydoc.info/github/flori/json/JSON#parse-class_method]
-  #       so those should be looked at for furhter details
+  #       so those should be looked at for furhter details.
+  #       The result is built without an intermediate string if json_options
+  #       has no options other than symbolize_names and freeze.
   def evaluate(jsonnet, jsonnet_options: {}, json_options: {})
+    if native_parse?(json_options, jsonnet_options)
+      return VM.evaluate(jsonnet, jsonnet_options.merge(parse: json_options))
+    end
+
     output = VM.evaluate(jsonnet, jsonnet_options)
     JSON.parse(output, json_options)
   end
@@ -39,9 +50,75 @@ module Jsonnet
   #
   # @note This method runs Jsonnet::VM#evaluate_file and runs the string
   #       output through {JSON.parse}[http://www.rubydoc.info/github/flori/json/JSON#parse-class_method]
-  #       so those should be looked at for furhter details
+  #       so those should be looked at for furhter details.
+  #       The result is built without an intermediate string if json_options
+  #       has no options other than symbolize_names and freeze.
   def load(path, jsonnet_options: {}, json_options: {})
+    if native_parse?(json_options, jsonnet_options)
+      return VM.evaluate_file(path, jsonnet_options.merge(parse: json_options))
+    end
+
     output = VM.evaluate_file(path, jsonnet_options)
     JSON.parse(output, json_options)
   end
+
+  ##
+  # Evaluates many Jsonnet files or snippets in parallel and returns hashes
+  # of the resulting JSONs
+  #
+  # @param [Array]   items    Jsonnet files or snippets. See Jsonnet::VM#evaluate_many
+  # @param [Integer] threads  the maximum number of native worker threads
+  # @param [Hash]    jsonnet_options A hash of options to for Jsonnet::VM.
+  # @param [Hash]    json_options Options supported by {JSON.parse}[http://www.rubydoc.info/github/flori/json/JSON#parse-class_method]
+  # @return [Array] The JSON representation as a hash for each item, or
+  #                 Jsonnet::EvaluationError for each item which failed.
+  def evaluate_many(items, threads: Etc.nprocessors, jsonnet_options: {}, json_options: {})
+    VM.evaluate_many(items, jsonnet_options.merge(threads: threads)).map do |output|
+      case output
+      when EvaluationError
+        output
+      when Hash
+        output.transform_values {|json| JSON.parse(json, json_options) }
+      else
+        JSON.parse(output, json_options)
+      end
+    end
+  end
+
+  ##
+  # Reads Jsonnet files into an {ImportCache} before the process forks, e.g.
+  # in the master process of a preforking server. Forked processes share the
+  # read files under copy-on-write instead of reading them again.
+  #
+  # The cache serves only the VMs which use it: pass it as the +import_cache+
+  # option, or opt in with +shared: true+ to make it {ImportCache.shared},
+  # which VMs created later use by default.
+  #
+  # @param [Array<String>] jpaths   library directories. The files matching
+  #                                 +pattern+ under them are read.
+  # @param [Array<String>] files    other files to read
+  # @param [String]        pattern  File.fnmatch pattern of the files in +jpaths+
+  # @param [ImportCache]   cache    the cache to fill
+  # @param [Boolean]       shared   sets the cache to {ImportCache.shared}
+  # @return [ImportCache] the filled cache
+  def preload(jpaths: [], files: [], pattern: "**/*.{jsonnet,libsonnet,json}",
+              cache: ImportCache.new, shared: false)
+    paths = files + jpaths.flat_map do |dir|
+      Dir.glob(pattern, base: dir).map {|file| File.join(dir, file) }
+    end
+    cache.preload(*paths.select {|path| File.file?(path) })
+    ImportCache.shared = cache if shared
+    cache
+  end
+
+  NATIVE_PARSE_OPTIONS = %i[symbolize_names freeze].freeze
+  private_constant :NATIVE_PARSE_OPTIONS
+
+  # Returns true if the options can be handled by VM#evaluate(parse:).
+  # string_output makes the result a plain string, which is left to JSON.parse.
+  def native_parse?(json_options, jsonnet_options)
+    (json_options.keys.map(&:to_sym) - NATIVE_PARSE_OPTIONS).empty? &&
+      jsonnet_options.none? {|key, value| key.to_s == "string_output" && value }
+  end
+  private_class_method :native_parse?
 end
@@ -0,0 +1,52 @@
+require "jsonnet/jsonnet_wrap"
+
+module Jsonnet
+  ##
+  # A cache of files imported through {VM#handle_import} or
+  # {VM#import_callback=}.
+  #
+  # A VM with a cache calls the import callback only once for each pair of
+  # a base directory and an imported path. The following imports are served
+  # from the cache without entering Ruby. A cache can be shared by VMs, also
+  # across threads. The entries are also keyed by how the VM resolves imports,
+  # i.e. the import callback object, its patterns and the library paths, so a
+  # VM is served only the imports which it would resolve in the same way.
+  # The files read by {#preload} are keyed by their paths and serve all VMs.
+  #
+  # @example
+  #   cache = Jsonnet::ImportCache.new
+  #   vm = Jsonnet::VM.new(import_cache: cache)
+  #   vm.handle_import {|base, rel| ... }
+  class ImportCache
+    ##
+    # @param check_mtime [Boolean] compares the modification time and the
+    #   size of the imported file on each lookup, and calls the import
+    #   callback again if the file has changed. Entries whose resolved paths
+    #   are not files stay until {#purge}.
+    def initialize(check_mtime: true)
+      self.check_mtime = check_mtime
+    end
+
+    class << self
+      ##
+      # The process-wide cache, or nil by default. VMs and snippets created
+      # without the +import_cache+ option use it. See {Jsonnet.preload}.
+      # @return [ImportCache, nil]
+      attr_accessor :shared
+    end
+
+    ##
+    # Reads files into the cache, so that VMs with this cache import them
+    # from memory. The files are served to the imports which libjsonnet
+    # resolves by itself, whichever directory they are imported from.
+    #
+    # @param paths [Array<String>] paths to the files
+    # @return [Integer] the number of the files read
+    def preload(*paths)
+      paths.each do |path|
+        add_file(File.realpath(path), File.binread(path))
+      end
+      paths.size
+    end
+  end
+end
@@ -0,0 +1,233 @@
+require "jsonnet/jsonnet_wrap"
+require "jsonnet/version"
+require "digest"
+require "fileutils"
+require "json"
+
+module Jsonnet
+  ##
+  # A cache of evaluation results for {VM#result_cache=}.
+  #
+  # An evaluation is looked up by the source, or the content of the source
+  # file, and everything configured on the VM which can change the result:
+  # variables, top-level arguments, library paths, native function names and
+  # the output settings such as +string_output+. A hit is valid only while
+  # every file imported by the cached evaluation has the same content, which
+  # is checked by their sizes and modification times, and by their content
+  # hashes if the times changed, and while no file has appeared at the paths
+  # where the evaluation looked for imports in vain, e.g. in library paths
+  # searched before the one which had the file.
+  #
+  # A hit restores {VM#last_dependencies} and {VM#last_stats} of the cached
+  # evaluation, and notifies the subscribers of {VM.subscribe} as an
+  # evaluation does.
+  #
+  # Entries are kept in memory up to +max_size+, least recently used first
+  # out, and optionally in a directory, which survives the process and can be
+  # shared by processes.
+  #
+  # @note Native functions are assumed to be pure. Evaluations which import
+  #   anything but files, e.g. through {VM#handle_import}, are not cached.
+  #
+  # @example
+  #   cache = Jsonnet::ResultCache.new(max_size: 1000, dir: "tmp/jsonnet")
+  #   vm = Jsonnet::VM.new(result_cache: cache)
+  #   vm.evaluate_file("main.jsonnet")  # evaluates
+  #   vm.evaluate_file("main.jsonnet")  # served from the cache
+  class ResultCache
+    # An evaluation result with the files it depends on, the paths it did not
+    # find, and its statistics.
+    Entry = Struct.new(:result, :encoding, :dependencies, :missing, :stats)
+    private_constant :Entry
+
+    # @return [Integer] the maximum number of entries in memory
+    attr_reader :max_size
+    # @return [String, nil] the directory of the persistent entries
+    attr_reader :dir
+
+    ##
+    # @param max_size [Integer] the maximum number of entries in memory.
+    # @param dir [String, nil] a directory to persist entries into, or nil to
+    #   keep them only in memory. Created if missing.
+    def initialize(max_size: 1000, dir: nil)
+      raise ArgumentError, "max_size must be positive: #{max_size}" unless max_size > 0
+
+      @max_size = max_size
+      @dir = dir
+      FileUtils.mkdir_p(dir) if dir
+      @entries = {}
+      @mutex = Mutex.new
+      @hits = @misses = 0
+    end
+
+    ##
+    # Returns the cached result of an evaluation by +vm+, or evaluates it with
+    # the block and caches the result.
+    #
+    # @param vm [VM] the VM to evaluate with
+    # @param source [Array] what is evaluated, e.g. the snippet and its
+    #   filename.
+    # @yieldreturn [String, Hash<String, String>] the result of the evaluation
+    # @return [String, Hash<String, String>] a copy of the result
+    # @private
+    def fetch(vm, *source)
+      key = Digest::SHA256.hexdigest(
+        [VERSION, Jsonnet.libversion, vm.__send__(:config_key), *source].map(&:to_s).join("\0")
+      )
+      entry = lookup(key)
+      if entry
+        deps = entry.dependencies.map {|path, hash, size, _| [path, hash, size] }
+        vm.__send__(:restore_last_evaluation, deps, entry.missing, entry.stats)
+        return copy(entry.result, entry.encoding)
+      end
+
+      result = yield
+      dependencies = vm.last_dependencies.map do |path, hash, size|
+        stat = File.stat(path) rescue nil
+        break nil unless stat&.file?
+
+        [path, hash, size, stat.mtime.to_r]
+      end
+      if dependencies
+        entry = Entry.new(copy(result), encoding_of(result), dependencies,
+                          vm.__send__(:last_missing_files), vm.last_stats)
+        store(key, entry)
+      end
+      result
+    end
+
+    ##
+    # Discards all the entries, also in the directory.
+    def clear
+      @mutex.synchronize { @entries.clear }
+      FileUtils.rm_rf(Dir.glob(File.join(@dir, "*"))) if @dir
+      nil
+    end
+
+    # @return [Integer] the number of the entries in memory
+    def size
+      @mutex.synchronize { @entries.size }
+    end
+
+    # @return [Hash] +:size+ of the memory tier, and the numbers of +:hits+
+    #   and +:misses+.
+    def stats
+      @mutex.synchronize { { size: @entries.size, hits: @hits, misses: @misses } }
+    end
+
+    private
+    def lookup(key)
+      entry = @mutex.synchronize do
+        if (found = @entries.delete(key))
+          @entries[key] = found
+        end
+      end
+      entry ||= read_entry(key)
+      if entry && fresh?(entry)
+        @mutex.synchronize do
+          @hits += 1
+          @entries[key] = entry
+          @entries.shift while @entries.size > @max_size
+        end
+        return entry
+      end
+
+      @mutex.synchronize do
+        @misses += 1
+        @entries.delete(key)
+      end
+      nil
+    end
+
+    def store(key, entry)
+      @mutex.synchronize do
+        @entries[key] = entry
+        @entries.shift while @entries.size > @max_size
+      end
+      write_entry(key, entry) if @dir
+    end
+
+    # Returns true if the imported files have not changed since the entry was
+    # stored, and the missing files are still missing. Times which changed
+    # with the same content are updated so that the files are not hashed
+    # again.
+    def fresh?(entry)
+      return false if entry.missing.any? {|path| File.exist?(path) }
+
+      entry.dependencies.all? do |dep|
+        path, hash, size, mtime = dep
+        stat = File.stat(path) rescue nil
+        next false unless stat&.file? && stat.size == size
+        next true if stat.mtime.to_r == mtime
+        next false unless Jsonnet.content_hash(File.binread(path)) == hash
+
+        dep[3] = stat.mtime.to_r
+        true
+      end
+    end
+
+    def entry_path(key)
+      File.join(@dir, key[0, 2], "#{key}.json")
+    end
+
+    def read_entry(key)
+      return nil unless @dir
+
+      data = JSON.parse(File.read(entry_path(key), encoding: Encoding::UTF_8))
+      deps = data.fetch("dependencies").map do |path, hash, size, mtime|
+        [path, hash, size, Rational(mtime)]
+      end
+      Entry.new(data.fetch("result"), Encoding.find(data.fetch("encoding")), deps,
+                data.fetch("missing"), stats_from_json(data.fetch("stats")))
+    rescue Errno::ENOENT, JSON::ParserError, KeyError, ArgumentError
+      nil
+    end
+
+    # Writes the entry into a temporary file and renames it, so that readers
+    # in other processes never see a partial entry. Results which are not
+    # valid in UTF-8 stay only in memory.
+    def write_entry(key, entry)
+      values = entry.result.is_a?(Hash) ? entry.result.values : [entry.result]
+      return unless values.all? {|value| value.dup.force_encoding(Encoding::UTF_8).valid_encoding? }
+
+      path = entry_path(key)
+      FileUtils.mkdir_p(File.dirname(path))
+      deps = entry.dependencies.map {|dep_path, hash, size, mtime| [dep_path, hash, size, mtime.to_s] }
+      json = JSON.generate(
+        "result" => utf8(entry.result), "encoding" => entry.encoding.name, "dependencies" => deps,
+        "missing" => entry.missing, "stats" => entry.stats
+      )
+      tmp = "#{path}.#{Process.pid}.#{Thread.current.object_id}.tmp"
+      File.binwrite(tmp, json)
+      File.rename(tmp, path)
+    rescue SystemCallError, JSON::GeneratorError
+      File.unlink(tmp) rescue nil if tmp
+    end
+
+    def stats_from_json(stats)
+      stats = stats.transform_keys(&:to_sym)
+      stats[:native_calls] = stats.fetch(:native_calls).transform_values do |calls|
+        calls.transform_keys(&:to_sym)
+      end
+      stats
+    end
+
+    def encoding_of(result)
+      (result.is_a?(Hash) ? result.each_value.first : result)&.encoding || Encoding::UTF_8
+    end
+
+    def utf8(result)
+      return result.transform_values {|value| utf8(value) } if result.is_a?(Hash)
+
+      result.dup.force_encoding(Encoding::UTF_8)
+    end
+
+    # Returns an unfrozen copy of the result so that callers can modify it.
+    def copy(result, encoding = nil)
+      return result.to_h {|name, value| [name.dup, copy(value, encoding)] } if result.is_a?(Hash)
+
+      copied = result.dup
+      encoding ? copied.force_encoding(encoding) : copied
+    end
+  end
+end
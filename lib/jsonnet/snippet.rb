@@ -0,0 +1,98 @@
+require "jsonnet/vm"
+require "jsonnet/import_cache"
+
+module Jsonnet
+  ##
+  # A convenience wrapper of a Jsonnet source and a configured VM, for
+  # evaluating the source many times with different top-level arguments.
+  #
+  # A snippet keeps the source, a configured VM and an {ImportCache} shared
+  # by its evaluations, so that each evaluation neither configures a VM nor
+  # reads the source or the imported files again. The top-level arguments are
+  # bound only for each call. A snippet can be shared by threads; its
+  # evaluations are serialized.
+  #
+  # The source is not compiled ahead: each evaluation still lexes, parses and
+  # analyses it, because the C API of Jsonnet cannot keep a parsed program.
+  #
+  # @example
+  #   snippet = Jsonnet::Snippet.load("main.jsonnet", max_stack: 1000) do |vm|
+  #     vm.jpath_add("/path/to/lib")
+  #   end
+  #   snippet.evaluate(tla_vars: {"env" => "prod"})
+  class Snippet
+    ##
+    # Reads a snippet from a file.
+    #
+    # @param path [String] path to the Jsonnet source file.
+    # @param encoding [Encoding] encoding of the file.
+    # @see #initialize
+    def self.load(path, encoding: Encoding.default_external, **options, &setup)
+      new(File.read(path, encoding: encoding), filename: path, **options, &setup)
+    end
+
+    # @return [String] the source of the snippet.
+    attr_reader :source
+    # @return [String] the filename of the source. Imports are resolved
+    #   relative to its directory.
+    attr_reader :filename
+
+    ##
+    # @param source [String] Jsonnet source.
+    # @param filename [String] filename of the source.
+    # @param import_cache [ImportCache, nil] the cache of the imported files.
+    #   Defaults to {ImportCache.shared} if any, or a new cache. nil disables
+    #   caching.
+    # @param options [Hash] options to {VM#initialize}
+    # @yieldparam [VM] vm the VM of the snippet to be configured, e.g. with
+    #   {VM#jpath_add}, {VM#ext_var} or {VM#define_function}.
+    def initialize(source, filename: "(jsonnet)",
+                   import_cache: ImportCache.shared || ImportCache.new, **options, &setup)
+      @source = source.dup.freeze
+      @filename = filename
+      @vm = VM.new(options.merge(import_cache: import_cache))
+      setup.call(@vm) if setup
+      @mutex = Mutex.new
+    end
+
+    ##
+    # Evaluates the source.
+    #
+    # The block of multi-mode or stream mode is called after the evaluation
+    # has finished, without blocking the other evaluations, so it can also
+    # evaluate this snippet.
+    #
+    # @param tla_vars [Hash] top-level arguments bound to string values for this call.
+    # @param tla_codes [Hash] top-level arguments bound to code fragments for this call.
+    # @param options [Hash] other options of {VM#evaluate} but +filename+.
+    # @yield (see VM#evaluate)
+    # @return (see VM#evaluate)
+    # @raise (see VM#evaluate)
+    def evaluate(tla_vars: {}, tla_codes: {}, **options, &block)
+      if options[:stream] && !block
+        return enum_for(:evaluate, tla_vars: tla_vars, tla_codes: tla_codes, **options)
+      end
+
+      yielded = []
+      collect = block && proc {|*args| yielded << args }
+      result = @mutex.synchronize do
+        @vm.__send__(:clear_tla, *tla_vars.keys.map(&:to_s), *tla_codes.keys.map(&:to_s))
+        tla_vars.each {|key, val| @vm.tla_var(key.to_s, val) }
+        tla_codes.each {|key, code| @vm.tla_code(key.to_s, code) }
+        @vm.evaluate(@source, filename: @filename, **options, &collect)
+      end
+      yielded.each {|args| block.call(*args) }
+      result
+    end
+
+    # @return [Hash] statistics of the last evaluation. See {VM#last_stats}.
+    def last_stats
+      @mutex.synchronize { @vm.last_stats }
+    end
+
+    # @return [Array] files imported by the last evaluation. See {VM#last_dependencies}.
+    def last_dependencies
+      @mutex.synchronize { @vm.last_dependencies }
+    end
+  end
+end
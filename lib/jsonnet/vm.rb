@@ -1,7 +1,13 @@
 require "jsonnet/jsonnet_wrap"
+require "jsonnet/import_cache"
+require "jsonnet/result_cache"
+require "etc"
 
 module Jsonnet
   class VM
+    SUBSCRIBERS_LOCK = Mutex.new
+    private_constant :SUBSCRIBERS_LOCK
+
     class << self
       ##
       # Convenient method to evaluate a Jsonnet snippet.
@@ -12,11 +18,13 @@ module Jsonnet
       # @param options [Hash]  options to {.new} or options to {#evaluate}
       # @return [String]
       # @see #evaluate
-      def evaluate(snippet, options = {})
-        snippet_check = ->(key, value) { key.to_s.match(/^filename|multi$/) }
+      def evaluate(snippet, options = {}, &block)
+        snippet_check = ->(key, value) {
+          key.to_s.match(/\A(?:filename|multi|stream|parse|output_dir|fsync|out|timeout)\z/)
+        }
         snippet_options = options.select(&snippet_check)
         vm_options = options.reject(&snippet_check)
-        new(vm_options).evaluate(snippet, **snippet_options)
+        new(vm_options).evaluate(snippet, **snippet_options, &block)
       end
 
       ##
@@ -28,11 +36,87 @@ module Jsonnet
       # @param options [Hash]  options to {.new} or options to {#evaluate_file}
       # @return [String]
       # @see #evaluate_file
-      def evaluate_file(filename, options = {})
-        file_check = ->(key, value) { key.to_s.match(/^encoding|multi$/) }
+      def evaluate_file(filename, options = {}, &block)
+        file_check = ->(key, value) {
+          key.to_s.match(/\A(?:encoding|multi|stream|parse|output_dir|fsync|out|timeout)\z/)
+        }
         file_options = options.select(&file_check)
         vm_options = options.reject(&file_check)
-        new(vm_options).evaluate_file(filename, **file_options)
+        new(vm_options).evaluate_file(filename, **file_options, &block)
+      end
+
+      ##
+      # Convenient method to evaluate many Jsonnet files or snippets in parallel.
+      #
+      # It implicitly instantiates a VM and then evaluates items with the VM.
+      #
+      # @param items [Array<String, Hash>]  items to {#evaluate_many}
+      # @param options [Hash]  options to {.new} or options to {#evaluate_many}
+      # @return [Array<String, Hash, EvaluationError>]
+      # @see #evaluate_many
+      def evaluate_many(items, options = {})
+        many_check = ->(key, value) { key.to_s.match(/\A(?:threads|encoding|multi)\z/) }
+        many_options = options.select(&many_check)
+        vm_options = options.reject(&many_check)
+        new(vm_options).evaluate_many(items, **many_options)
+      end
+
+      ##
+      # Convenient method to format many Jsonnet files in parallel.
+      #
+      # It implicitly instantiates a VM and then formats the files with the VM.
+      #
+      # @param paths [Array<String>]  files to {#format_files}
+      # @param options [Hash]  options to {.new}, e.g. +fmt_indent+, or options
+      #   to {#format_files}
+      # @return [Array<String, FormatError>]
+      # @see #format_files
+      def format_files(paths, options = {})
+        format_check = ->(key, value) { key.to_s.match(/\A(?:threads|check)\z/) }
+        format_options = options.select(&format_check)
+        vm_options = options.reject(&format_check)
+        new(vm_options).format_files(paths, **format_options)
+      end
+
+      ##
+      # Returns a new VM with the configuration and the callbacks of +template+.
+      #
+      # This is cheaper than configuring a new VM with the same calls because
+      # the configuration is copied in native code without being validated
+      # again. The VM can be configured further without affecting +template+.
+      #
+      # @param template [VM]  a configured VM
+      # @return [VM]
+      def from_template(template)
+        raise TypeError, "#{template.class} is not a #{self}" unless template.is_a?(VM)
+
+        template.dup
+      end
+
+      ##
+      # Registers a block called with statistics after each evaluation by
+      # {#evaluate} or {#evaluate_file} of any VM, including failed ones.
+      #
+      # @yieldparam [VM] vm  the VM which evaluated
+      # @yieldparam [Hash] stats  the statistics. See {#last_stats}.
+      # @return [Proc] the block, which can be passed to {.unsubscribe}
+      def subscribe(&block)
+        raise ArgumentError, "no block given" unless block
+
+        SUBSCRIBERS_LOCK.synchronize { @subscribers = subscribers + [block] }
+        block
+      end
+
+      ##
+      # Unregisters a block registered by {.subscribe}.
+      def unsubscribe(block)
+        SUBSCRIBERS_LOCK.synchronize { @subscribers = subscribers - [block] }
+        nil
+      end
+
+      # @private
+      def subscribers
+        @subscribers ||= []
       end
     end
 
@@ -41,8 +125,13 @@ module Jsonnet
     #
     # @param [Hash] options  a mapping from option names to their values.
     #    It can have names of writable attributes in VM class as keys.
+    #    +import_cache+ defaults to {ImportCache.shared}.
     # @return [VM] the VM.
     def initialize(options = {})
+      shared_cache = ImportCache.shared
+      if shared_cache && options.none? {|key, _| key.to_s == "import_cache" }
+        self.import_cache = shared_cache
+      end
       options.each do |key, value|
         method = "#{key}="
         if respond_to?(method)
@@ -54,6 +143,27 @@ module Jsonnet
       self
     end
 
+    # @return [ResultCache, nil] the cache of the evaluation results.
+    attr_reader :result_cache
+
+    ##
+    # Caches the results of {#evaluate} and {#evaluate_file} in the given
+    # cache, and reuses them while the configuration of the VM, the source
+    # and the imported files are unchanged.
+    #
+    # Evaluations in stream mode or with +output_dir+, +out+ or a block are
+    # not cached.
+    # The VM tracks its dependencies with {#track_dependencies=} to validate
+    # the cached results.
+    # @param cache [ResultCache, nil] the cache. It can be shared by VMs.
+    #   nil disables caching.
+    def result_cache=(cache)
+      raise TypeError, "#{cache.class} is not a ResultCache" unless cache.nil? || cache.is_a?(ResultCache)
+
+      self.track_dependencies = true if cache
+      @result_cache = cache
+    end
+
     ##
     # Evaluates Jsonnet source.
     #
@@ -61,16 +171,64 @@ module Jsonnet
     #                  Must be encoded in an ASCII-compatible encoding.
     # @param [String]  filename filename of the source. Used in stacktrace.
     # @param [Boolean] multi    enables multi-mode
+    # @param [Boolean] stream   enables stream mode, in which the result must
+    #                  be an array and each element is a document
+    # @param [Boolean, Hash] parse  returns Ruby objects instead of a JSON
+    #                  string if true. A Hash enables it with options
+    #                  +:symbolize_names+ and +:freeze+, which behave like
+    #                  those of JSON.parse. Results nested deeper than 100
+    #                  levels raise ArgumentError, as JSON.parse rejects them
+    #                  by default.
+    # @param [String]  output_dir  writes the files of multi-mode into this
+    #                  directory instead of returning them, like "jsonnet -m".
+    #                  Files whose contents are unchanged are not rewritten.
+    # @param [Boolean] fsync    syncs the files written into +output_dir+
+    #                  to the disk before returning
+    # @param [IO]      out      writes the result into this IO, or an object
+    #                  which responds to +write+, instead of returning it.
+    #                  An IO receives the result without an intermediate
+    #                  String unless it converts the encoding or the
+    #                  newlines of what is written into it.
+    # @param [Numeric] timeout  overrides {#timeout=} for this evaluation
+    # @yieldparam [String] name  a file name in multi-mode
+    # @yieldparam [String, Object] json  the JSON of the file or the
+    #                  document, or the parsed object if +parse+ is enabled.
+    #                  Only this parameter is yielded in stream mode.
     # @return [String] a JSON representation of the evaluation result
+    # @return [Object] the evaluation result if +parse+ is enabled
+    # @return [Array<String>] the paths of the written files if +output_dir+
+    #                  is given
+    # @return [Integer] the number of the files if a block is given in
+    #                  multi-mode, or the number of the documents in stream
+    #                  mode
+    # @return [Enumerator] the documents if no block is given in stream mode.
+    #                  The source is evaluated each time the Enumerator is
+    #                  iterated.
+    # @return [Integer] the number of the written bytes if +out+ is given
     # @raise [EvaluationError] raised when the evaluation results an error.
+    # @raise [TimeoutError] raised when the evaluation exceeds the timeout.
     # @raise [UnsupportedEncodingError] raised when the encoding of jsonnet
     #        is not ASCII-compatible.
     # @note It is recommended to encode the source string in UTF-8 because
     #       Jsonnet expects it is ASCII-compatible, the result JSON string
     #       shall be UTF-{8,16,32} according to RFC 7159 thus the only
     #       intersection between the requirements is UTF-8.
-    def evaluate(jsonnet, filename: "(jsonnet)", multi: false)
-      eval_snippet(jsonnet, filename, multi)
+    def evaluate(jsonnet, filename: "(jsonnet)", multi: false, stream: false, parse: false,
+                 output_dir: nil, fsync: false, out: nil, timeout: nil, &block)
+      check_output_options(multi, stream, parse, output_dir, out)
+      if stream && !block
+        return enum_for(:evaluate, jsonnet, filename: filename, stream: true, parse: parse,
+                        timeout: timeout)
+      end
+      if cached?(stream, output_dir, out, block)
+        return cached(parse, :snippet, filename, multi, jsonnet.encoding, jsonnet) do
+          evaluating(timeout) { eval_snippet(jsonnet, filename, multi, false, nil, false, nil) }
+        end
+      end
+      evaluating(timeout) do
+        eval_snippet(jsonnet, filename, stream ? :stream : multi, parse, output_dir, fsync, out,
+                     &block)
+      end
     end
 
     ##
@@ -78,24 +236,109 @@ module Jsonnet
     #
     # @param [String]  filename filename of a Jsonnet source file.
     # @param [Boolean] multi    enables multi-mode
+    # @param [Boolean] stream   enables stream mode. See {#evaluate}.
+    # @param [Boolean, Hash] parse  returns Ruby objects instead of a JSON
+    #                  string. See {#evaluate}.
+    # @param [String]  output_dir  writes the files of multi-mode into this
+    #                  directory. See {#evaluate}.
+    # @param [Boolean] fsync    syncs the written files. See {#evaluate}.
+    # @param [IO]      out      writes the result into this IO. See {#evaluate}.
+    # @param [Numeric] timeout  overrides {#timeout=} for this evaluation
+    # @yield (see #evaluate)
     # @return [String] a JSON representation of the evaluation result
+    # @return [Object] the evaluation result if +parse+ is enabled
+    # @return [Array<String>] the paths of the written files if +output_dir+
+    #                  is given
+    # @return [Integer] the number of the files if a block is given in
+    #                  multi-mode, or the number of the documents in stream
+    #                  mode
+    # @return [Enumerator] the documents if no block is given in stream mode.
+    # @return [Integer] the number of the written bytes if +out+ is given
     # @raise [EvaluationError] raised when the evaluation results an error.
+    # @raise [TimeoutError] raised when the evaluation exceeds the timeout.
+    # @raise [SystemCallError] raised when the file cannot be read for
+    #        {#result_cache}.
     # @note It is recommended to encode the source file in UTF-8 because
     #       Jsonnet expects it is ASCII-compatible, the result JSON string
     #       shall be UTF-{8,16,32} according to RFC 7159 thus the only
     #       intersection between the requirements is UTF-8.
-    def evaluate_file(filename, encoding: Encoding.default_external, multi: false)
-      eval_file(filename, encoding, multi)
+    def evaluate_file(filename, encoding: Encoding.default_external, multi: false, stream: false,
+                      parse: false, output_dir: nil, fsync: false, out: nil, timeout: nil, &block)
+      check_output_options(multi, stream, parse, output_dir, out)
+      if stream && !block
+        return enum_for(:evaluate_file, filename, encoding: encoding, stream: true, parse: parse,
+                        timeout: timeout)
+      end
+      if cached?(stream, output_dir, out, block)
+        # The content read for the key is evaluated so that the result matches
+        # the key even if the file changes meanwhile. Jsonnet evaluates a file
+        # as a snippet named after it.
+        source = File.binread(filename)
+        return cached(parse, :file, filename, multi, encoding, Jsonnet.content_hash(source)) do
+          evaluating(timeout) { eval_snippet(source.force_encoding(encoding), filename, multi,
+                                             false, nil, false, nil) }
+        end
+      end
+      evaluating(timeout) do
+        eval_file(filename, encoding, stream ? :stream : multi, parse, output_dir, fsync, out,
+                  &block)
+      end
+    end
+
+    ##
+    # Evaluates many Jsonnet files or snippets in parallel.
+    #
+    # The items are evaluated on native worker threads without the GVL.
+    # Each worker thread has its own copy of this VM, so the items share the
+    # configuration of this VM.
+    # Import callbacks and native functions are called on the current thread.
+    #
+    # @param [Array<String, Hash>] items  a String is a filename of a Jsonnet
+    #   source file. A Hash is either +{file: filename, encoding: encoding}+ or
+    #   +{snippet: jsonnet, filename: filename}+.
+    # @param [Integer] threads   the maximum number of worker threads
+    # @param [Encoding] encoding default encoding of the results of files
+    # @param [Boolean] multi     enables multi-mode
+    # @return [Array<String, Hash, EvaluationError>] the result of each item
+    #   in the order of +items+. Items which failed to evaluate have
+    #   EvaluationError instead of their results, and items which exceeded
+    #   {#timeout}, which limits each item, have TimeoutError.
+    def evaluate_many(items, threads: Etc.nprocessors, encoding: Encoding.default_external,
+                      multi: false)
+      specs = items.map do |item|
+        next [item, nil, encoding] unless item.is_a?(Hash)
+
+        if item.key?(:snippet)
+          [item.fetch(:filename, "(jsonnet)"), item[:snippet], nil]
+        else
+          [item.fetch(:file), nil, item.fetch(:encoding, encoding)]
+        end
+      end
+
+      if respond_to?(:eval_many, true)
+        eval_many(specs, threads, multi)
+      else
+        specs.map do |fname, snippet, enc|
+          snippet ? eval_snippet(snippet, fname, multi, false, nil, false, nil) :
+                    eval_file(fname, enc, multi, false, nil, false, nil)
+        rescue EvaluationError => e
+          e
+        end
+      end
     end
 
     ##
     # Format Jsonnet file.
     #
     # @param [String] filename filename of a Jsonnet source file.
+    # @param [IO] out writes the result into this IO instead of returning it.
+    #                 See {#evaluate}.
     # @return [String] a formatted Jsonnet representation
+    # @return [Integer] the number of the written bytes if +out+ is given
     # @raise [FormatError] raised when the formatting results an error.
-    def format_file(filename, encoding: Encoding.default_external)
-      fmt_file(filename, encoding)
+    # @raise [NotImplementedError] raised when the backend has no formatter.
+    def format_file(filename, encoding: Encoding.default_external, out: nil)
+      fmt_file(filename, encoding, out)
     end
 
     ##
@@ -103,24 +346,75 @@ module Jsonnet
     #
     # @param [String] jsonnet Jsonnet source string. Must be encoded in ASCII-compatible encoding.
     # @param [String] filename filename of the source. Used in stacktrace.
+    # @param [IO] out writes the result into this IO instead of returning it.
+    #                 See {#evaluate}.
     # @return [String] a formatted Jsonnet representation
+    # @return [Integer] the number of the written bytes if +out+ is given
     # @raise [FormatError] raised when the formatting results an error.
+    # @raise [NotImplementedError] raised when the backend has no formatter.
     # @raise [UnsupportedEncodingError] raised when the encoding of jsonnt is not ASCII-compatible.
-    def format(jsonnet, filename: "(jsonnet)")
-      fmt_snippet(jsonnet, filename)
+    def format(jsonnet, filename: "(jsonnet)", out: nil)
+      fmt_snippet(jsonnet, filename, out)
+    end
+
+    ##
+    # Formats many Jsonnet files in parallel, e.g. to lint them.
+    #
+    # The files are formatted on native worker threads without the GVL, and
+    # compared with the formatted results in native code, so unchanged files
+    # cost no Ruby objects.
+    #
+    # @param [Array<String>] paths  filenames of Jsonnet source files
+    # @param [Integer] threads  the maximum number of worker threads
+    # @param [Boolean] check    only reports the files which are not formatted
+    #   if true. Otherwise replaces them with the formatted files, through
+    #   temporary files renamed over them. Files which contain NUL bytes fail.
+    # @return [Array<String, FormatError>] the paths of the files which are
+    #   not formatted, or were rewritten, and FormatErrors for the files which
+    #   failed to format, in the order of +paths+.
+    # @raise [NotImplementedError] raised when the backend has no formatter.
+    def format_files(paths, threads: Etc.nprocessors, check: true)
+      return fmt_many(paths, threads, !check) if respond_to?(:fmt_many, true)
+
+      paths.map do |path|
+        source = File.binread(path)
+        next FormatError.new("#{path}: contains a NUL byte") if source.include?("\0")
+
+        formatted = fmt_snippet(source, path, nil)
+        next if formatted.b == source
+
+        replace_file(path, formatted) unless check
+        path
+      rescue FormatError => e
+        e
+      rescue SystemCallError => e
+        FormatError.new("#{path}: #{e.message}")
+      end.compact
     end
 
     ##
     # Lets the given block handle "import" expression of Jsonnet.
+    #
+    # If +patterns+ are given, the block handles only the imports whose paths
+    # match one of them. The other imports are resolved natively without
+    # Ruby, relative to the importing file or in the paths added by
+    # {#jpath_add}, just like Jsonnet does without the block.
+    #
+    # @example
+    #   vm.handle_import("secret://") {|base, rel| [fetch_secret(rel), rel] }
+    #
+    # @param [Array<String>] patterns prefixes of the paths to be handled, or
+    #   patterns of File.fnmatch if they contain "*", "?" or "[".
     # @yieldparam  [String] base base path to resolve "rel" from.
     # @yieldparam  [String] rel  a relative or absolute path to the file to be imported
     # @yieldreturn [Array<String>] a pair of the content of the imported file and
     #                              its path.
-    def handle_import(&block)
+    def handle_import(*patterns, &block)
       if block.nil?
         raise ArgumentError, 'handle_import requires a block'
       end
       self.import_callback = to_method(block)
+      self.import_patterns = patterns
       nil
     end
 
@@ -131,13 +425,30 @@ module Jsonnet
     # @param name [Symbol|String] name of the function.
     #   Must be a valid identifier in Jsonnet.
     # @param body [#to_proc] body of the function.
+    # @param memoize [Boolean, Symbol, Hash] memoizes the results by the
+    #   arguments so that the body is called only once for each combination
+    #   of arguments. The following calls return copies of the result without
+    #   entering Ruby. +true+ or +:vm+ keeps the results as long as the VM.
+    #   +:evaluation+ discards them when the next evaluation starts.
+    #   A Hash +{scope: :vm or :evaluation, max_size: n}+ also limits the
+    #   number of results, discarding the least recently used ones.
+    # @param json_args [Boolean, Array<Symbol|String>] decodes string
+    #   arguments as JSON documents into Hash, Array and so on before calling
+    #   the body. +true+ decodes all parameters, or an Array names the
+    #   parameters to decode. Jsonnet can pass only primitive values to
+    #   native functions, so pass arrays and objects encoded with
+    #   +std.manifestJsonMinified+.
     # @yield calls the given block instead of `body` if `body` is `nil`
     #
+    # @example
+    #   vm.define_function(:merge, json_args: [:objs]) {|objs| objs.reduce(:merge) }
+    #   vm.evaluate("std.native('merge')(std.manifestJsonMinified([{a: 1}, {b: 2}]))")
+    #
     # @note Currently it cannot define keyword or optional paramters in Jsonnet.
     #   Also all the positional optional parameters of the body are interpreted
     #   as required parameters. And the body cannot have keyword, rest or
     #   keyword rest paramters.
-    def define_function(name, body = nil, &block)
+    def define_function(name, body = nil, memoize: false, json_args: false, &block)
       body = body ? body.to_proc : block
       if body.nil?
         raise ArgumentError, 'define_function requires a body argument or a block'
@@ -149,10 +460,116 @@ module Jsonnet
         name || "p#{i}"
       end
 
-      register_native_callback(name.to_sym, to_method(body), params);
+      json_params =
+        case json_args
+        when true then params.map { true }
+        when nil, false then nil
+        else
+          names = Array(json_args).map(&:to_s)
+          unknown = names - params.map(&:to_s)
+          raise ArgumentError, "unknown parameters in json_args: #{unknown.join(', ')}" unless unknown.empty?
+
+          params.map {|param| names.include?(param.to_s) }
+        end
+
+      register_native_callback(name.to_sym, to_method(body), params, memo_spec(memoize), json_params)
     end
 
     private
+    # Runs an evaluation with the timeout and notifies the subscribers of
+    # its statistics.
+    def evaluating(timeout)
+      result = with_timeout(timeout) { yield }
+      publish_stats
+      result
+    rescue EvaluationError
+      publish_stats
+      raise
+    end
+
+    def with_timeout(timeout)
+      return yield unless timeout
+
+      saved = self.timeout
+      self.timeout = timeout
+      begin
+        yield
+      ensure
+        self.timeout = saved
+      end
+    end
+
+    def publish_stats
+      subscribers = VM.subscribers
+      return if subscribers.empty?
+
+      stats = last_stats
+      subscribers.each {|subscriber| subscriber.call(self, stats) }
+    end
+
+    def cached?(stream, output_dir, out, block)
+      @result_cache && !stream && !output_dir && !out && !block
+    end
+
+    # Looks up the result in #result_cache, or evaluates it with the block,
+    # and then parses it if requested. A hit notifies the subscribers with
+    # the restored statistics.
+    def cached(parse, *source)
+      evaluated = false
+      result = @result_cache.fetch(self, *source) { evaluated = true; yield }
+      publish_stats unless evaluated
+      return result unless parse
+
+      options = parse.is_a?(Hash) ? parse : {}
+      json_options = { symbolize_names: options[:symbolize_names], freeze: options[:freeze] }
+      return JSON.parse(result, json_options) unless result.is_a?(Hash)
+
+      result.to_h {|name, json| [name, JSON.parse(json, json_options)] }
+    end
+
+    # Writes a temporary file and renames it over +path+, as the native
+    # format_files does.
+    def replace_file(path, content)
+      tmp = "#{path}.#{Process.pid}.#{Thread.current.object_id}.tmp"
+      File.binwrite(tmp, content)
+      File.chmod(File.stat(path).mode & 0o7777, tmp)
+      File.rename(tmp, path)
+    rescue SystemCallError
+      File.unlink(tmp) rescue nil
+      raise
+    end
+
+    def check_output_options(multi, stream, parse, output_dir, out)
+      raise ArgumentError, "multi and stream are exclusive" if multi && stream
+      if out && (multi || stream || parse)
+        raise ArgumentError, "out cannot be combined with multi, stream or parse"
+      end
+      return unless output_dir
+      raise ArgumentError, "output_dir requires multi-mode" unless multi
+      raise ArgumentError, "output_dir cannot be combined with parse" if parse
+    end
+
+    # Translates the memoize option of #define_function into a pair of
+    # whether the memo is per evaluation and its maximum size.
+    def memo_spec(memoize)
+      case memoize
+      when nil, false
+        nil
+      when true, :vm
+        [false, nil]
+      when :evaluation
+        [true, nil]
+      when Hash
+        scope = memoize.fetch(:scope, :vm)
+        raise ArgumentError, "unknown memoize scope: #{scope}" unless [:vm, :evaluation].include?(scope)
+
+        [scope == :evaluation, memoize[:max_size]&.to_int]
+      else
+        raise ArgumentError, "unsupported memoize option: #{memoize.inspect}"
+      end
+    end
+
+
     # Wraps the function body with a method so that `break` and `return`
     # behave like `return` as they do in a body of Module#define_method.
     def to_method(body)
@@ -0,0 +1,176 @@
+require "jsonnet/vm"
+
+module Jsonnet
+  ##
+  # A thread-safe pool of preconfigured VMs.
+  #
+  # The pool configures a template VM once with the given options and setup
+  # block, copies it into its VMs with {VM.from_template}, and lends them out
+  # for each evaluation so that constructing and configuring a VM is not on
+  # the request path. The number of VMs never exceeds +size+,
+  # which bounds the memory used by concurrent evaluations.
+  #
+  # @example
+  #   pool = Jsonnet::VMPool.new(size: 4, max_stack: 1000) do |vm|
+  #     vm.jpath_add("/path/to/lib")
+  #     vm.define_function(:lookup) {|key| TABLE[key] }
+  #   end
+  #   pool.evaluate_file("main.jsonnet", tla_vars: {"env" => "prod"})
+  class VMPool
+    ##
+    # Raised when no VM becomes available within the checkout timeout.
+    class TimeoutError < RuntimeError; end
+
+    # @return [Integer] the maximum number of VMs in the pool.
+    attr_reader :size
+
+    ##
+    # @param size [Integer] the maximum number of VMs.
+    # @param checkout_timeout [Numeric, nil] default seconds to wait for a VM.
+    #   Waits forever if nil.
+    # @param options [Hash] options to {VM#initialize}
+    # @yieldparam [VM] vm the template VM to be configured, e.g. with
+    #   {VM#jpath_add}, {VM#ext_var} or {VM#define_function}.
+    def initialize(size: 4, checkout_timeout: nil, **options, &setup)
+      raise ArgumentError, "size must be positive: #{size}" unless size > 0
+
+      @size = size
+      @checkout_timeout = checkout_timeout
+      @template = VM.new(options)
+      setup.call(@template) if setup
+
+      @mutex = Mutex.new
+      @available = ConditionVariable.new
+      @idle = Array.new(size) { build_vm }
+      @checkouts = 0
+      @tla_rebuilds = 0
+      @wait_time = 0.0
+      @max_wait_time = 0.0
+    end
+
+    ##
+    # Takes a VM out of the pool. Blocks until a VM is available.
+    #
+    # The caller must return the VM with {#checkin}.
+    # @param timeout [Numeric, nil] seconds to wait.
+    # @return [VM]
+    # @raise [TimeoutError] raised when no VM is available in time.
+    def checkout(timeout: @checkout_timeout)
+      started = now
+      deadline = timeout && started + timeout
+      @mutex.synchronize do
+        while @idle.empty?
+          rest = deadline && deadline - now
+          if rest && rest <= 0
+            raise TimeoutError, "no Jsonnet VM became available in #{timeout} seconds"
+          end
+          @available.wait(@mutex, rest)
+        end
+
+        waited = now - started
+        @checkouts += 1
+        @wait_time += waited
+        @max_wait_time = waited if @max_wait_time < waited
+        @idle.pop
+      end
+    end
+
+    ##
+    # Returns a VM to the pool.
+    #
+    # @param vm [VM] a VM taken by {#checkout}
+    # @param discard [Boolean] replaces the VM with a new one instead of
+    #   reusing it. Use this when the VM got per-call state which cannot be
+    #   reset, e.g. variables bound directly with {VM#ext_var}.
+    def checkin(vm, discard: false)
+      vm = build_vm if discard
+      @mutex.synchronize do
+        @idle.push(vm)
+        @available.signal
+      end
+      nil
+    end
+
+    ##
+    # Lends a VM to the given block.
+    #
+    # @yieldparam [VM] vm
+    # @return the value of the block
+    def with_vm(timeout: @checkout_timeout)
+      vm = checkout(timeout: timeout)
+      begin
+        yield vm
+      ensure
+        checkin(vm)
+      end
+    end
+
+    ##
+    # Evaluates Jsonnet source with a VM in the pool.
+    #
+    # @param tla_vars [Hash] top-level arguments bound to string values for this call.
+    # @param tla_codes [Hash] top-level arguments bound to code fragments for this call.
+    # @see VM#evaluate
+    def evaluate(jsonnet, tla_vars: {}, tla_codes: {}, **options)
+      with_tla(tla_vars, tla_codes) {|vm| vm.evaluate(jsonnet, **options) }
+    end
+
+    ##
+    # Evaluates Jsonnet file with a VM in the pool.
+    #
+    # @param tla_vars [Hash] top-level arguments bound to string values for this call.
+    # @param tla_codes [Hash] top-level arguments bound to code fragments for this call.
+    # @see VM#evaluate_file
+    def evaluate_file(filename, tla_vars: {}, tla_codes: {}, **options)
+      with_tla(tla_vars, tla_codes) {|vm| vm.evaluate_file(filename, **options) }
+    end
+
+    ##
+    # Returns statistics of the pool.
+    #
+    # @return [Hash] +:size+, +:idle+ (number of VMs in the pool now),
+    #   +:checkouts+, +:wait_time+ (total seconds spent in {#checkout}),
+    #   +:max_wait_time+ and +:tla_rebuilds+ (number of evaluations which
+    #   rebuilt the VM to unbind top-level arguments of a previous call).
+    def stats
+      @mutex.synchronize do
+        {
+          size: @size,
+          idle: @idle.size,
+          checkouts: @checkouts,
+          wait_time: @wait_time,
+          max_wait_time: @max_wait_time,
+          tla_rebuilds: @tla_rebuilds,
+        }
+      end
+    end
+
+    private
+
+    def build_vm
+      VM.from_template(@template)
+    end
+
+    # Binds the top-level arguments of this call only, as Snippet#evaluate
+    # does, unbinding those of the previous call. The VM is rebuilt only if
+    # the previous call bound names which this call does not.
+    def with_tla(tla_vars, tla_codes)
+      vm = checkout
+      begin
+        names = tla_vars.keys.map(&:to_s) + tla_codes.keys.map(&:to_s)
+        if vm.__send__(:clear_tla, *names)
+          @mutex.synchronize { @tla_rebuilds += 1 }
+        end
+        tla_vars.each {|key, val| vm.tla_var(key.to_s, val) }
+        tla_codes.each {|key, code| vm.tla_code(key.to_s, code) }
+        yield vm
+      ensure
+        checkin(vm)
+      end
+    end
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+  end
+end
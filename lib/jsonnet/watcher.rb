@@ -0,0 +1,207 @@
+require "jsonnet/jsonnet_wrap"
+require "jsonnet/vm"
+require "fileutils"
+require "set"
+
+module Jsonnet
+  ##
+  # Re-renders Jsonnet files when they or the files they import change.
+  #
+  # The watcher renders each entry file once, remembers the files each render
+  # imported with {VM#last_dependencies}, and watches their directories with
+  # Linux inotify. When files change, only the entry files which depend on
+  # them are rendered again, after the changes have settled for +debounce+
+  # seconds. Entry files which failed to render are rendered again on any
+  # change because their imports may be incomplete.
+  #
+  # @example
+  #   watcher = Jsonnet::Watcher.new(Dir["config/**/*.jsonnet"], output_dir: "out") do |entry, result|
+  #     warn "#{entry}: #{result.message}" if result.is_a?(Jsonnet::EvaluationError)
+  #   end
+  #   watcher.run  # until watcher.stop is called on another thread
+  class Watcher
+    ##
+    # @return [Boolean] true if the platform supports watching files.
+    def self.supported?
+      private_method_defined?(:inotify_open)
+    end
+
+    # @return [Array<String>] the absolute paths of the entry files.
+    attr_reader :entries
+
+    ##
+    # @param entries [Array<String>] the Jsonnet files to render.
+    # @param vm [VM] the VM to render with. It is used only by this watcher,
+    #   which enables {VM#track_dependencies=} on it.
+    # @param multi [Boolean] renders in multi-mode.
+    # @param output_dir [String, nil] writes the results into this directory,
+    #   as +<basename>.json+ of each entry file, or the files of multi-mode.
+    #   Unchanged files are not rewritten.
+    # @param debounce [Numeric] seconds to wait for more changes before
+    #   rendering.
+    # @param options [Hash] other options to {VM#evaluate_file}, e.g. +parse+.
+    # @yieldparam [String] entry the absolute path of the rendered entry file
+    # @yieldparam [String, Hash, Array<String>, EvaluationError] result the
+    #   result of {VM#evaluate_file}, or the error.
+    # @raise [NotImplementedError] raised if the platform has no inotify.
+    def initialize(entries, vm: VM.new, multi: false, output_dir: nil, debounce: 0.1, **options,
+                   &on_render)
+      raise NotImplementedError, "Jsonnet::Watcher requires inotify" unless Watcher.supported?
+      if output_dir && options[:parse]
+        raise ArgumentError, "output_dir cannot be combined with parse"
+      end
+
+      @entries = entries.map {|entry| File.expand_path(entry) }.uniq
+      @vm = vm
+      @vm.track_dependencies = true
+      @multi = multi
+      @output_dir = output_dir
+      @debounce = debounce
+      @options = options
+      @on_render = on_render
+
+      @dependencies = {}
+      @dependents = Hash.new {|hash, path| hash[path] = Set.new }
+      @failed = Set.new
+      @watches = {}
+      @dirs = {}
+      @stop_reader, @stop_writer = IO.pipe
+    end
+
+    ##
+    # Renders all the entry files, and then renders them again on changes
+    # until {#stop} is called.
+    # @return [void]
+    def run
+      @watches.clear
+      @dirs.clear
+      @inotify = IO.for_fd(inotify_open, autoclose: true)
+      begin
+        render(@entries)
+        until stopped?
+          changes = wait_changes
+          render(affected(changes)) if changes
+        end
+      ensure
+        @inotify.close
+        @inotify = nil
+      end
+      nil
+    end
+
+    ##
+    # Makes {#run} return. Can be called from another thread or a signal handler.
+    # @return [void]
+    def stop
+      @stop_writer.write_nonblock(".", exception: false)
+      nil
+    end
+
+    ##
+    # @param entry [String] an entry file
+    # @return [Array<String>] the files which the last render of +entry+
+    #   depended on, including +entry+ itself.
+    def dependencies(entry)
+      @dependencies.fetch(File.expand_path(entry), [])
+    end
+
+    private
+    def stopped?
+      !IO.select([@stop_reader], nil, nil, 0).nil?
+    end
+
+    # Blocks until files change, and collects the changes which follow within
+    # the debounce time.
+    # @return [Set<String>, Symbol, nil] the changed paths, :all if some
+    #   events were lost, or nil if stopped.
+    def wait_changes
+      changes = Set.new
+      timeout = nil
+      loop do
+        ready, = IO.select([@inotify, @stop_reader], nil, nil, timeout)
+        return changes.empty? ? nil : changes if ready.nil?
+        return nil if ready.include?(@stop_reader)
+
+        inotify_read(@inotify.fileno).each do |wd, name|
+          return :all if wd < 0
+
+          if name.nil?
+            unwatch(wd, changes)
+          elsif (dir = @dirs[wd])
+            changes << File.join(dir, name)
+          end
+        end
+        timeout = @debounce unless changes.empty?
+      end
+    end
+
+    def affected(changes)
+      return @entries if changes == :all
+
+      targets = @failed.dup
+      changes.each do |path|
+        targets.merge(@dependents[path]) if @dependents.key?(path)
+      end
+      @entries.select {|entry| targets.include?(entry) }
+    end
+
+    def render(entries)
+      entries.each do |entry|
+        result = evaluate(entry)
+        @failed.delete(entry)
+        update_dependencies(entry, [entry] + @vm.last_dependencies.map(&:first))
+        @on_render&.call(entry, result)
+      rescue EvaluationError, SystemCallError => e
+        @failed << entry
+        update_dependencies(entry, [entry] + @vm.last_dependencies.map(&:first))
+        @on_render&.call(entry, e)
+      end
+    end
+
+    def evaluate(entry)
+      return @vm.evaluate_file(entry, multi: @multi, **@options) unless @output_dir
+      if @multi
+        return @vm.evaluate_file(entry, multi: true, output_dir: @output_dir, **@options)
+      end
+
+      json = @vm.evaluate_file(entry, **@options)
+      path = File.join(@output_dir, "#{File.basename(entry, '.*')}.json")
+      return [] if File.file?(path) && File.binread(path) == json.b
+
+      FileUtils.mkdir_p(@output_dir)
+      File.binwrite(path, json)
+      [path]
+    end
+
+    def update_dependencies(entry, paths)
+      paths = paths.map {|path| File.expand_path(path) }.uniq
+      @dependencies.fetch(entry, []).each {|path| @dependents[path].delete(entry) }
+      @dependencies[entry] = paths
+      paths.each do |path|
+        @dependents[path] << entry
+        watch(File.dirname(path))
+      end
+    end
+
+    # Forgets the watch of a directory which was removed or moved, so that the
+    # next render watches the directory at the path again, and takes all the
+    # files in it as changed.
+    def unwatch(wd, changes)
+      dir = @dirs.delete(wd)
+      return unless dir
+
+      @watches.delete(dir)
+      @dependents.each_key {|path| changes << path if File.dirname(path) == dir }
+    end
+
+    def watch(dir)
+      return if @watches.key?(dir)
+
+      wd = inotify_add_watch(@inotify.fileno, dir)
+      @watches[dir] = wd
+      @dirs[wd] = dir
+    rescue SystemCallError
+      # the directory was removed or is not readable; the next render retries
+    end
+  end
+end
@@ -0,0 +1,174 @@
+require 'jsonnet'
+
+require 'json'
+require 'tmpdir'
+require 'test/unit'
+
+class TestImportCache < Test::Unit::TestCase
+  test 'Jsonnet::ImportCache serves repeated imports without the callback' do
+    cache = Jsonnet::ImportCache.new
+    vm = Jsonnet::VM.new(import_cache: cache)
+    calls = 0
+    vm.handle_import do |base, rel|
+      calls += 1
+      ["{ rel: #{rel.dump} }", "/lib/#{rel}"]
+    end
+
+    3.times do
+      result = vm.evaluate('import "a.libsonnet"', filename: "/main.jsonnet")
+      assert_equal({ "rel" => "a.libsonnet" }, JSON.parse(result))
+    end
+    assert_equal 1, calls
+    assert_equal({ size: 1, hits: 2, misses: 1 }, cache.stats)
+  end
+
+  test 'Jsonnet::ImportCache can be shared by VMs with the same callback' do
+    cache = Jsonnet::ImportCache.new
+    calls = 0
+    callback = ->(base, rel) { calls += 1; ["1", "/lib/#{rel}"] }
+    vms = Array.new(2) do
+      vm = Jsonnet::VM.new(import_cache: cache)
+      vm.import_callback = callback
+      vm
+    end
+    vms << Jsonnet::VM.from_template(vms[0])
+    vms.each do |vm|
+      assert_equal "1\n", vm.evaluate('import "a.libsonnet"', filename: "/main.jsonnet")
+    end
+    assert_equal 1, calls
+  end
+
+  test 'Jsonnet::ImportCache keeps the imports of VMs which resolve them differently apart' do
+    cache = Jsonnet::ImportCache.new
+    vms = %w[a b].map do |name|
+      vm = Jsonnet::VM.new(import_cache: cache)
+      vm.handle_import {|base, rel| [name.dump, "/lib/#{rel}"] }
+      vm
+    end
+    assert_equal %W[\"a\"\n \"b\"\n],
+                 vms.map {|vm| vm.evaluate('import "x.libsonnet"', filename: "/main.jsonnet") }
+
+    Dir.mktmpdir do |dir|
+      vms = %w[a b].map do |name|
+        lib = File.join(dir, name)
+        Dir.mkdir(lib)
+        File.write(File.join(lib, "x.libsonnet"), name.dump)
+        Jsonnet::VM.new(import_cache: cache).tap {|vm| vm.jpath_add(lib) }
+      end
+      main = File.join(dir, "main.jsonnet")
+      2.times do
+        assert_equal %W[\"a\"\n \"b\"\n],
+                     vms.map {|vm| vm.evaluate('import "x.libsonnet"', filename: main) }
+      end
+    end
+  end
+
+  test 'Jsonnet::ImportCache does not cache errors' do
+    cache = Jsonnet::ImportCache.new
+    vm = Jsonnet::VM.new(import_cache: cache)
+    calls = 0
+    vm.handle_import {|base, rel| calls += 1; raise Errno::ENOENT, rel }
+    2.times do
+      assert_raise(Jsonnet::EvaluationError) { vm.evaluate('import "a.libsonnet"') }
+    end
+    assert_equal 2, calls
+    assert_equal 0, cache.size
+  end
+
+  test 'Jsonnet::ImportCache invalidates entries of modified files' do
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a.libsonnet")
+      File.write(path, "1")
+      vm = Jsonnet::VM.new(import_cache: Jsonnet::ImportCache.new)
+      vm.handle_import {|base, rel| [File.read(path), path] }
+      snippet = 'import "a.libsonnet"'
+
+      assert_equal "1\n", vm.evaluate(snippet, filename: File.join(dir, "main.jsonnet"))
+      File.write(path, "22")
+      assert_equal "22\n", vm.evaluate(snippet, filename: File.join(dir, "main.jsonnet"))
+    end
+  end
+
+  test 'Jsonnet::ImportCache#purge removes entries' do
+    cache = Jsonnet::ImportCache.new
+    vm = Jsonnet::VM.new(import_cache: cache)
+    vm.handle_import {|base, rel| ["1", "/lib/#{rel}"] }
+    vm.evaluate('[import "a.libsonnet", import "b.libsonnet"]', filename: "/main.jsonnet")
+    assert_equal 2, cache.size
+
+    assert_equal 1, cache.purge("/lib/a.libsonnet")
+    assert_equal 1, cache.size
+    assert_equal 1, cache.purge
+    assert_equal 0, cache.size
+  end
+
+  test 'Jsonnet::ImportCache#preload serves the files to native imports' do
+    Dir.mktmpdir do |dir|
+      lib = File.join(dir, "lib")
+      Dir.mkdir(lib)
+      File.write(File.join(lib, "a.libsonnet"), '{ a: import "b.libsonnet" }')
+      File.write(File.join(lib, "b.libsonnet"), '1')
+
+      cache = Jsonnet::ImportCache.new(check_mtime: false)
+      assert_equal 2, cache.preload(File.join(lib, "a.libsonnet"), File.join(lib, "b.libsonnet"))
+      assert_equal 2, cache.stats[:preloaded]
+      File.write(File.join(lib, "b.libsonnet"), '2')
+
+      vm = Jsonnet::VM.new(import_cache: cache)
+      vm.jpath_add(lib)
+      assert_equal({ "a" => 1 }, vm.evaluate('import "a.libsonnet"', parse: true))
+      vm = Jsonnet::VM.new(import_cache: cache)
+      main = File.join(dir, "main.jsonnet")
+      assert_equal 1, vm.evaluate('import "lib/b.libsonnet"', filename: main, parse: true)
+    end
+  end
+
+  test 'Jsonnet.preload fills a cache without sharing it by default' do
+    Dir.mktmpdir do |dir|
+      File.write(File.join(dir, "a.libsonnet"), '"preloaded"')
+
+      cache = Jsonnet.preload(jpaths: [dir])
+      assert_nil Jsonnet::ImportCache.shared
+      assert_equal 1, cache.stats[:preloaded]
+      cache.check_mtime = false
+      File.write(File.join(dir, "a.libsonnet"), '"read again"')
+
+      vm = Jsonnet::VM.new(import_cache: cache)
+      vm.jpath_add(dir)
+      assert_equal "preloaded", vm.evaluate('import "a.libsonnet"', parse: true)
+
+      vm = Jsonnet::VM.new
+      vm.jpath_add(dir)
+      assert_equal "read again", vm.evaluate('import "a.libsonnet"', parse: true)
+    end
+  end
+
+  test 'Jsonnet.preload fills the shared cache which new VMs use on request' do
+    Dir.mktmpdir do |dir|
+      File.write(File.join(dir, "a.libsonnet"), '"preloaded"')
+      File.write(File.join(dir, "README"), 'not Jsonnet')
+
+      cache = Jsonnet.preload(jpaths: [dir], shared: true)
+      begin
+        assert_same Jsonnet::ImportCache.shared, cache
+        assert_equal 1, cache.stats[:preloaded]
+        cache.check_mtime = false
+        File.write(File.join(dir, "a.libsonnet"), '"read again"')
+
+        vm = Jsonnet::VM.new
+        vm.jpath_add(dir)
+        assert_equal "preloaded", vm.evaluate('import "a.libsonnet"', parse: true)
+
+        vm = Jsonnet::VM.new(import_cache: nil)
+        vm.jpath_add(dir)
+        assert_equal "read again", vm.evaluate('import "a.libsonnet"', parse: true)
+      ensure
+        Jsonnet::ImportCache.shared = nil
+      end
+    end
+  end
+
+  test 'Jsonnet::VM#import_cache= rejects other objects' do
+    assert_raise(TypeError) { Jsonnet::VM.new.import_cache = {} }
+  end
+end
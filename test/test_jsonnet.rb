@@ -8,6 +8,20 @@ class TestJsonnet < Test::Unit::TestCase
     assert_kind_of String, Jsonnet.libversion
   end
 
+  test 'backend returns the implementation of Jsonnet' do
+    assert_include [:cpp, :go], Jsonnet.backend
+  end
+
+  test 'backend is go-jsonnet when built with JSONNET_USE_GO_JSONNET' do
+    omit "built with the C++ implementation" unless ENV['JSONNET_USE_GO_JSONNET']
+    assert_equal :go, Jsonnet.backend
+  end
+
+  test 'content_hash returns 64-bit FNV-1a of the string' do
+    assert_equal 0xcbf29ce484222325, Jsonnet.content_hash('')
+    assert_equal 0xaf63dc4c8601ec8c, Jsonnet.content_hash('a')
+  end
+
   test 'Jsonnet.evaluate returns a JSON parsed result' do
     result = Jsonnet.evaluate('{ foo: "bar" }')
     assert_equal result, { "foo" => "bar" }
@@ -18,6 +32,14 @@ class TestJsonnet < Test::Unit::TestCase
     assert_equal result, { foo: "bar" }
   end
 
+  test 'Jsonnet.evaluate falls back to JSON.parse for other options' do
+    result = Jsonnet.evaluate('{ foo: 1.5 }', json_options: { decimal_class: Rational })
+    assert_equal result, { "foo" => Rational(3, 2) }
+
+    result = Jsonnet.evaluate('"{}"', jsonnet_options: { string_output: true })
+    assert_equal result, {}
+  end
+
   test 'Jsonnet.evaluate can accept options for Jsonnet VM' do
     result = Jsonnet.evaluate(
       'import "imported.jsonnet"',
@@ -35,6 +57,12 @@ class TestJsonnet < Test::Unit::TestCase
     assert_equal result, { "foo1" => 1 }
   end
 
+  test 'Jsonnet.evaluate_many returns JSON parsed results' do
+    results = Jsonnet.evaluate_many([example_jsonnet_file.path, { snippet: '{ foo: "bar" }' }],
+                                    json_options: { symbolize_names: true })
+    assert_equal [{ foo1: 1 }, { foo: "bar" }], results
+  end
+
   private
 
   def example_jsonnet_file
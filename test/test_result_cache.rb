@@ -0,0 +1,165 @@
+require 'jsonnet'
+
+require 'json'
+require 'test/unit'
+require 'tmpdir'
+
+class TestResultCache < Test::Unit::TestCase
+  test 'Jsonnet::ResultCache serves repeated evaluations without evaluating' do
+    cache = Jsonnet::ResultCache.new
+    vm = Jsonnet::VM.new(result_cache: cache)
+    calls = 0
+    vm.define_function(:count) { calls += 1 }
+
+    2.times do
+      assert_equal "1\n", vm.evaluate('std.native("count")()')
+    end
+    assert_equal 1, calls
+    assert_equal({ size: 1, hits: 1, misses: 1 }, cache.stats)
+  end
+
+  test 'Jsonnet::ResultCache is keyed by the configuration of the VM' do
+    cache = Jsonnet::ResultCache.new
+    vm = Jsonnet::VM.new(result_cache: cache)
+    vm.ext_var('env', 'dev')
+    assert_equal "\"dev\"\n", vm.evaluate('std.extVar("env")')
+    vm.ext_var('env', 'prod')
+    assert_equal "\"prod\"\n", vm.evaluate('std.extVar("env")')
+    vm.string_output = true
+    assert_equal "prod\n", vm.evaluate('std.extVar("env")')
+
+    other = Jsonnet::VM.new(result_cache: cache)
+    other.ext_var('env', 'dev')
+    assert_equal "\"dev\"\n", other.evaluate('std.extVar("env")')
+    assert_equal 1, cache.stats[:hits]
+  end
+
+  test 'Jsonnet::ResultCache is invalidated by changes of the imported files' do
+    Dir.mktmpdir do |dir|
+      lib = File.join(dir, 'lib.libsonnet')
+      main = File.join(dir, 'main.jsonnet')
+      File.write(lib, '{ a: 1 }')
+      File.write(main, '(import "lib.libsonnet").a')
+      vm = Jsonnet::VM.new(result_cache: Jsonnet::ResultCache.new)
+
+      assert_equal 1, vm.evaluate_file(main, parse: true)
+      assert_equal 1, vm.evaluate_file(main, parse: true)
+      assert_equal 1, vm.result_cache.stats[:hits]
+
+      File.write(lib, '{ a: 2 }')
+      assert_equal 2, vm.evaluate_file(main, parse: true)
+      File.write(main, '(import "lib.libsonnet").a * 10')
+      assert_equal 20, vm.evaluate_file(main, parse: true)
+      assert_equal 1, vm.result_cache.stats[:hits]
+    end
+  end
+
+  test 'Jsonnet::ResultCache restores the dependencies and the statistics on hits' do
+    Dir.mktmpdir do |dir|
+      lib = File.join(dir, 'lib.libsonnet')
+      main = File.join(dir, 'main.jsonnet')
+      File.write(lib, '{ a: 1 }')
+      File.write(main, '(import "lib.libsonnet").a + std.native("f")(1)')
+      vm = Jsonnet::VM.new(result_cache: Jsonnet::ResultCache.new)
+      vm.define_function(:f) {|x| x }
+
+      vm.evaluate_file(main)
+      expected_deps = vm.last_dependencies
+      expected_stats = vm.last_stats
+      assert_equal 1, expected_deps.size
+
+      received = []
+      subscriber = Jsonnet::VM.subscribe {|_, stats| received << stats }
+      begin
+        vm.evaluate('1')
+        vm.evaluate_file(main)
+      ensure
+        Jsonnet::VM.unsubscribe(subscriber)
+      end
+      assert_equal 1, vm.result_cache.stats[:hits]
+      assert_equal expected_deps, vm.last_dependencies
+      assert_equal expected_stats, vm.last_stats
+      assert_equal 2, received.size
+      assert_equal expected_stats, received.last
+    end
+  end
+
+  test 'Jsonnet::ResultCache is invalidated by files which shadow the imported ones' do
+    Dir.mktmpdir do |dir|
+      first = File.join(dir, 'first')
+      second = File.join(dir, 'second')
+      [first, second].each {|path| Dir.mkdir(path) }
+      File.write(File.join(first, 'lib.libsonnet'), '"first"')
+      vm = Jsonnet::VM.new(result_cache: Jsonnet::ResultCache.new)
+      vm.jpath_add(first, second)
+
+      assert_equal 'first', vm.evaluate('import "lib.libsonnet"', parse: true)
+      assert_equal 'first', vm.evaluate('import "lib.libsonnet"', parse: true)
+      assert_equal 1, vm.result_cache.stats[:hits]
+
+      File.write(File.join(second, 'lib.libsonnet'), '"second"')
+      assert_equal 'second', vm.evaluate('import "lib.libsonnet"', parse: true)
+      assert_equal 1, vm.result_cache.stats[:hits]
+    end
+  end
+
+  test 'Jsonnet::ResultCache does not hide errors in reading the file' do
+    Dir.mktmpdir do |dir|
+      vm = Jsonnet::VM.new(result_cache: Jsonnet::ResultCache.new)
+      assert_raise(Errno::ENOENT) { vm.evaluate_file(File.join(dir, 'missing.jsonnet')) }
+      assert_raise(Errno::EISDIR) { vm.evaluate_file(dir) }
+    end
+  end
+
+  test 'Jsonnet::ResultCache persists entries in the directory' do
+    Dir.mktmpdir do |dir|
+      File.write(File.join(dir, 'lib.libsonnet'), '{ a: "b" }')
+      main = File.join(dir, 'main.jsonnet')
+      File.write(main, 'import "lib.libsonnet"')
+      cache_dir = File.join(dir, 'cache')
+
+      vm = Jsonnet::VM.new(result_cache: Jsonnet::ResultCache.new(dir: cache_dir))
+      expected = vm.evaluate_file(main)
+
+      cache = Jsonnet::ResultCache.new(dir: cache_dir)
+      vm = Jsonnet::VM.new(result_cache: cache)
+      assert_equal expected, vm.evaluate_file(main)
+      assert_equal({ 'a' => 'b' }, vm.evaluate_file(main, parse: true))
+      assert_equal 2, cache.stats[:hits]
+
+      cache.clear
+      assert_empty Dir.glob(File.join(cache_dir, '*'))
+    end
+  end
+
+  test 'Jsonnet::ResultCache evicts the least recently used entries' do
+    cache = Jsonnet::ResultCache.new(max_size: 2)
+    vm = Jsonnet::VM.new(result_cache: cache)
+    %w[1 2 1 3 1].each {|snippet| vm.evaluate(snippet) }
+    assert_equal 2, cache.size
+    assert_equal 2, cache.stats[:hits]
+  end
+
+  test 'Jsonnet::ResultCache caches multi-mode but not imports from Ruby' do
+    cache = Jsonnet::ResultCache.new
+    vm = Jsonnet::VM.new(result_cache: cache)
+    2.times do
+      assert_equal({ 'a.json' => "1\n" }, vm.evaluate('{ "a.json": 1 }', multi: true))
+    end
+    assert_equal 1, cache.stats[:hits]
+
+    vm.handle_import {|base, rel| ['42', "virtual://#{rel}"] }
+    2.times { vm.evaluate('import "x"') }
+    assert_equal 1, cache.stats[:hits]
+  end
+
+  test 'Jsonnet::ResultCache does not cache errors or streams' do
+    cache = Jsonnet::ResultCache.new
+    vm = Jsonnet::VM.new(result_cache: cache)
+    2.times do
+      assert_raise(Jsonnet::EvaluationError) { vm.evaluate('error "x"') }
+      assert_equal [1, 2], vm.evaluate('[1, 2]', stream: true, parse: true).to_a
+    end
+    assert_equal({ size: 0, hits: 0, misses: 2 }, cache.stats)
+  end
+end
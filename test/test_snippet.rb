@@ -0,0 +1,72 @@
+require 'jsonnet'
+
+require 'json'
+require 'test/unit'
+require 'tmpdir'
+
+class TestSnippet < Test::Unit::TestCase
+  test 'Jsonnet::Snippet#evaluate binds top-level arguments only for the call' do
+    snippet = Jsonnet::Snippet.new(<<~JSONNET)
+      function(env='dev', replicas=1) { env: env, replicas: replicas }
+    JSONNET
+
+    result = snippet.evaluate(tla_vars: { env: 'prod' }, tla_codes: { 'replicas' => '3' })
+    assert_equal({ 'env' => 'prod', 'replicas' => 3 }, JSON.parse(result))
+
+    result = snippet.evaluate(tla_vars: { 'env' => 'staging' })
+    assert_equal({ 'env' => 'staging', 'replicas' => 1 }, JSON.parse(result))
+
+    assert_equal({ 'env' => 'dev', 'replicas' => 1 }, snippet.evaluate(parse: true))
+  end
+
+  test 'Jsonnet::Snippet keeps the configuration and callbacks across evaluations' do
+    snippet = Jsonnet::Snippet.new('function(x) [std.extVar("a"), std.native("twice")(x)]') do |vm|
+      vm.ext_var('a', 'A')
+      vm.define_function(:twice) {|x| x * 2 }
+    end
+
+    assert_equal ['A', 2], snippet.evaluate(tla_codes: { x: '1' }, parse: true)
+    assert_equal ['A', 6], snippet.evaluate(tla_codes: { x: '3' }, parse: true)
+  end
+
+  test 'Jsonnet::Snippet.load resolves imports relative to the file and caches them' do
+    Dir.mktmpdir do |dir|
+      File.write(File.join(dir, 'lib.libsonnet'), '{ greeting: "hello" }')
+      path = File.join(dir, 'main.jsonnet')
+      File.write(path, 'function(name) { msg: (import "lib.libsonnet").greeting + " " + name }')
+
+      snippet = Jsonnet::Snippet.load(path)
+      File.write(path, 'error "must not be read again"')
+
+      assert_equal({ 'msg' => 'hello a' }, snippet.evaluate(tla_vars: { name: 'a' }, parse: true))
+      assert_equal 0, snippet.last_stats[:import_cache_hits]
+      assert_equal({ 'msg' => 'hello b' }, snippet.evaluate(tla_vars: { name: 'b' }, parse: true))
+      assert_equal 1, snippet.last_stats[:import_cache_hits]
+    end
+  end
+
+  test 'Jsonnet::Snippet#evaluate returns an Enumerator in stream mode' do
+    snippet = Jsonnet::Snippet.new('function(n) std.range(1, n)')
+    docs = snippet.evaluate(tla_codes: { n: '3' }, stream: true, parse: true)
+    assert_kind_of Enumerator, docs
+    assert_equal [1, 2, 3], docs.to_a
+  end
+
+  test 'Jsonnet::Snippet#evaluate yields after the evaluation so that the block can evaluate again' do
+    snippet = Jsonnet::Snippet.new('function(n) { [std.toString(i)]: i for i in std.range(1, n) }')
+    files = {}
+    count = snippet.evaluate(tla_codes: { n: '2' }, multi: true, parse: true) do |name, value|
+      files[name] = [value, snippet.evaluate(tla_codes: { n: '1' }, multi: true, parse: true)]
+    end
+    assert_equal 2, count
+    assert_equal({ '1' => [1, { '1' => 1 }], '2' => [2, { '1' => 1 }] }, files)
+  end
+
+  test 'Jsonnet::Snippet#evaluate raises EvaluationError' do
+    snippet = Jsonnet::Snippet.new('function(x) x', filename: 'tla.jsonnet')
+    assert_raise(Jsonnet::EvaluationError) do
+      snippet.evaluate
+    end
+    assert_equal 1, snippet.evaluate(tla_codes: { x: '1' }, parse: true)
+  end
+end
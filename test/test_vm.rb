@@ -1,9 +1,13 @@
 # -*- coding: UTF-8 -*-
 require 'jsonnet'
 
+require 'fileutils'
 require 'json'
+require 'objspace'
+require 'stringio'
 require 'tempfile'
 require 'test/unit'
+require 'tmpdir'
 
 class TestVM < Test::Unit::TestCase
   test 'Jsonnet::VM#evaluate_file evaluates file' do
@@ -159,6 +163,15 @@ class TestVM < Test::Unit::TestCase
     EOS
   end
 
+  test 'Jsonnet::VM.evaluate passes the options which only contain option names to the VM' do
+    assert_equal "a\n", Jsonnet::VM.evaluate('"a"', string_output: true)
+    Tempfile.create(%w[string_output .jsonnet]) do |f|
+      f.write('"a"')
+      f.close
+      assert_equal "a\n", Jsonnet::VM.evaluate_file(f.path, string_output: true)
+    end
+  end
+
   test 'Jsonnet::VM#evaluate returns a JSON per filename on multi mode' do
     vm = Jsonnet::VM.new
     [
@@ -237,6 +250,174 @@ class TestVM < Test::Unit::TestCase
     end
   end
 
+  test "Jsonnet::VM#evaluate returns Ruby objects with parse option" do
+    vm = Jsonnet::VM.new
+    result = vm.evaluate(%q[
+      {
+        str: "a\u00e9\n",
+        nums: [1, -2, 1.5, 1e3],
+        flags: [true, false, null],
+        nested: { empty: {}, list: [] },
+      }
+    ], parse: true)
+    assert_equal({
+      "str" => "a\u00e9\n",
+      "nums" => [1, -2, 1.5, 1000],
+      "flags" => [true, false, nil],
+      "nested" => { "empty" => {}, "list" => [] },
+    }, result)
+    assert_equal Encoding::UTF_8, result["str"].encoding
+    assert_predicate result.keys.first, :frozen?
+  end
+
+  test "Jsonnet::VM#evaluate shares equal keys on parse" do
+    vm = Jsonnet::VM.new
+    result = vm.evaluate('[{ key: 1 }, { key: 2 }]', parse: true)
+    assert_same result[0].keys.first, result[1].keys.first
+    assert_same result[0].keys.first, vm.evaluate('{ key: 3 }', parse: true).keys.first
+  end
+
+  test "Jsonnet::VM#evaluate supports symbolize_names and freeze on parse" do
+    vm = Jsonnet::VM.new
+    result = vm.evaluate('{ a: { b: ["c"] } }', parse: { symbolize_names: true, freeze: true })
+    assert_equal({ a: { b: ["c"] } }, result)
+    assert_predicate result, :frozen?
+    assert_predicate result[:a][:b], :frozen?
+    assert_predicate result[:a][:b][0], :frozen?
+
+    result = vm.evaluate('{ a: 1 }', multi: true, parse: { symbolize_names: true })
+    assert_equal({ "a" => 1 }, result)
+  end
+
+  test "Jsonnet::VM#evaluate limits the nesting on parse as JSON.parse does" do
+    vm = Jsonnet::VM.new
+    nested = ->(depth) { "std.foldl(function(acc, _) [acc], std.range(1, #{depth}), 1)" }
+    assert_equal JSON.parse(vm.evaluate(nested[100])), vm.evaluate(nested[100], parse: true)
+    assert_raise(JSON::NestingError) { JSON.parse(vm.evaluate(nested[101])) }
+    assert_raise(ArgumentError) { vm.evaluate(nested[101], parse: true) }
+  end
+
+  test "Jsonnet::VM#evaluate_file returns Ruby objects with parse option" do
+    vm = Jsonnet::VM.new
+    with_example_file('{ a: [1, "b"] }') {|fname|
+      assert_equal({ "a" => [1, "b"] }, vm.evaluate_file(fname, parse: true))
+    }
+  end
+
+  test "Jsonnet::VM#evaluate rejects parse option with string_output" do
+    vm = Jsonnet::VM.new
+    vm.string_output = true
+    assert_raise(ArgumentError) do
+      vm.evaluate(%q[ "foo" ], parse: true)
+    end
+  end
+
+  test "Jsonnet::VM#evaluate yields files one by one on multi mode with a block" do
+    vm = Jsonnet::VM.new
+    files = []
+    count = vm.evaluate('{ a: [1], b: { c: 2 } }', multi: true) {|name, json|
+      files << [name, JSON.parse(json)]
+    }
+    assert_equal 2, count
+    assert_equal [["a", [1]], ["b", { "c" => 2 }]], files.sort
+
+    files = []
+    vm.evaluate('{ a: [1] }', multi: true, parse: true) {|name, value| files << [name, value] }
+    assert_equal [["a", [1]]], files
+  end
+
+  test "Jsonnet::VM#evaluate_file writes files into output_dir on multi mode" do
+    vm = Jsonnet::VM.new
+    Dir.mktmpdir do |dir|
+      with_example_file('{ "a.json": [1], "sub/b.json": { c: 2 } }') {|fname|
+        written = vm.evaluate_file(fname, multi: true, output_dir: dir, fsync: true)
+        assert_equal [File.join(dir, "a.json"), File.join(dir, "sub/b.json")], written.sort
+        assert_equal [1], JSON.parse(File.read(File.join(dir, "a.json")))
+        assert_equal({ "c" => 2 }, JSON.parse(File.read(File.join(dir, "sub/b.json"))))
+
+        assert_equal [], vm.evaluate_file(fname, multi: true, output_dir: dir)
+      }
+
+      written = vm.evaluate('{ "a.json": [1], "sub/b.json": { c: 3 } }',
+                            multi: true, output_dir: dir)
+      assert_equal [File.join(dir, "sub/b.json")], written
+      assert_equal({ "c" => 3 }, JSON.parse(File.read(File.join(dir, "sub/b.json"))))
+    end
+  end
+
+  test "Jsonnet::VM#evaluate returns an Enumerator of documents on stream mode" do
+    vm = Jsonnet::VM.new
+    docs = vm.evaluate('[{ kind: "Service" }, { kind: "Deployment" }]', stream: true)
+    assert_kind_of Enumerator, docs
+    assert_equal [{ "kind" => "Service" }, { "kind" => "Deployment" }], docs.map {|doc| JSON.parse(doc) }
+    assert_equal [{ kind: "Service" }], vm.evaluate('[{ kind: "Service" }]', stream: true,
+                                                    parse: { symbolize_names: true }).to_a
+
+    yielded = []
+    assert_equal 2, vm.evaluate('[1, "a"]', stream: true, parse: true) {|doc| yielded << doc }
+    assert_equal [1, "a"], yielded
+  end
+
+  test "Jsonnet::VM#evaluate_file supports stream mode" do
+    vm = Jsonnet::VM.new
+    with_example_file('[{ a: 1 }, [2]]') {|fname|
+      assert_equal [{ "a" => 1 }, [2]], vm.evaluate_file(fname, stream: true, parse: true).to_a
+    }
+  end
+
+  test "Jsonnet::VM#evaluate raises EvaluationError on stream mode if the result is not an array" do
+    vm = Jsonnet::VM.new
+    assert_raise(Jsonnet::EvaluationError) do
+      vm.evaluate('{ a: 1 }', stream: true).to_a
+    end
+    assert_raise(ArgumentError) do
+      vm.evaluate('[]', stream: true, multi: true)
+    end
+  end
+
+  test "Jsonnet::VM#evaluate writes the result into out" do
+    vm = Jsonnet::VM.new
+    expected = vm.evaluate('{ a: [1, 2] }')
+    Tempfile.create('out') do |file|
+      assert_equal expected.bytesize, vm.evaluate('{ a: [1, 2] }', out: file)
+      file.flush
+      assert_equal expected, File.read(file.path)
+    end
+
+    io = StringIO.new
+    with_example_file('{ a: [1, 2] }') {|fname|
+      vm.evaluate_file(fname, out: io)
+    }
+    assert_equal expected, io.string
+
+    assert_raise(ArgumentError) do
+      vm.evaluate('{}', out: io, parse: true)
+    end
+  end
+
+  test "Jsonnet::VM#evaluate converts the result written into an IO with an encoding" do
+    vm = Jsonnet::VM.new
+    expected = vm.evaluate('{ a: "\u00e9" }')
+    Tempfile.create('out') do |tmp|
+      File.open(tmp.path, 'wb:UTF-16LE') do |file|
+        vm.evaluate('{ a: "\u00e9" }', out: file)
+      end
+      assert_equal expected.encode(Encoding::UTF_16LE).b, File.binread(tmp.path)
+    end
+  end
+
+  test "Jsonnet::VM#evaluate rejects output_dir without multi mode" do
+    vm = Jsonnet::VM.new
+    Dir.mktmpdir do |dir|
+      assert_raise(ArgumentError) do
+        vm.evaluate('{}', output_dir: dir)
+      end
+      assert_raise(ArgumentError) do
+        vm.evaluate('{}', multi: true, output_dir: dir, parse: true)
+      end
+    end
+  end
+
   test "Jsonnet::VM responds to max_stack=" do
     Jsonnet::VM.new.max_stack = 1
   end
@@ -319,6 +500,21 @@ class TestVM < Test::Unit::TestCase
     assert_true called
   end
 
+  test "Jsonnet::VM#evaluate returns an error if customized import callback returns an invalid result" do
+    [
+      ->(base, rel) { 1 },
+      ->(base, rel) { ["{}", nil] },
+      ->(base, rel) { ["{}", "/a\0b.jsonnet"] },
+      ->(base, rel) { [Object.new, "/a.jsonnet"] },
+    ].each do |callback|
+      vm = Jsonnet::VM.new
+      vm.import_callback = callback
+      error = assert_raise(Jsonnet::EvaluationError) { vm.evaluate('import "a.jsonnet"') }
+      assert_match(/TypeError|ArgumentError/, error.message)
+      assert_equal "1\n", vm.evaluate("1")
+    end
+  end
+
   test "Jsonnet::VM#handle_import treats global escapes as define_method does" do
     num_eval = 0
     begin
@@ -359,6 +555,106 @@ class TestVM < Test::Unit::TestCase
     end
   end
 
+  test "Jsonnet::VM#handle_import with patterns resolves other imports natively" do
+    vm = Jsonnet::VM.new
+    vm.jpath_add(File.join(__dir__, 'fixtures'))
+    handled = []
+    vm.handle_import("secret://", "*.yaml") do |base, rel|
+      handled << rel
+      [%Q["#{rel}"], rel]
+    end
+
+    result = vm.evaluate(<<-EOS)
+      (import 'jpath.libsonnet') {
+        b: import 'secret://token',
+        c: import 'config.yaml',
+      }
+    EOS
+    assert_equal({ "a" => 1, "b" => "secret://token", "c" => "config.yaml" }, JSON.parse(result))
+    assert_equal ["config.yaml", "secret://token"], handled.sort
+
+    error = assert_raise(Jsonnet::EvaluationError) {
+      vm.evaluate("import 'no_such_file.libsonnet'")
+    }
+    assert_match(/no match locally or in the Jsonnet library paths/, error.message)
+
+    with_example_file("{ d: 4 }") {|fname|
+      result = vm.evaluate("import '#{fname}'")
+      assert_equal({ "d" => 4 }, JSON.parse(result))
+    }
+  end
+
+  test "Jsonnet::VM#last_dependencies returns the files imported by the last evaluation" do
+    vm = Jsonnet::VM.new(track_dependencies: true)
+    vm.jpath_add(File.join(__dir__, 'fixtures'))
+    vm.handle_import("secret://") {|base, rel| ['"token"', rel] }
+
+    vm.evaluate(<<-EOS)
+      [import 'jpath.libsonnet', import 'jpath.libsonnet', import 'secret://a']
+    EOS
+    path = File.join(__dir__, 'fixtures', 'jpath.libsonnet')
+    content = File.binread(path)
+    assert_equal [
+      [path, Jsonnet.content_hash(content), content.bytesize],
+      ['secret://a', Jsonnet.content_hash('"token"'), 7],
+    ], vm.last_dependencies
+
+    vm.evaluate('1')
+    assert_empty vm.last_dependencies
+  end
+
+  test "Jsonnet::VM tracks dependencies only when enabled" do
+    vm = Jsonnet::VM.new
+    vm.jpath_add(File.join(__dir__, 'fixtures'))
+    assert_false vm.track_dependencies?
+    vm.evaluate("import 'jpath.libsonnet'")
+    assert_empty vm.last_dependencies
+
+    vm.track_dependencies = true
+    assert_true vm.track_dependencies?
+    vm.evaluate("import 'jpath.libsonnet'")
+    assert_equal 1, vm.last_dependencies.size
+
+    vm.track_dependencies = false
+    assert_empty vm.last_dependencies
+  end
+
+  test "Jsonnet::VM resolves imports in the same way with and without dependency tracking" do
+    Dir.mktmpdir do |dir|
+      %w[first second cwd].each do |name|
+        FileUtils.mkdir_p(File.join(dir, name))
+        File.write(File.join(dir, name, "lib.libsonnet"), name.dump)
+      end
+      File.write(File.join(dir, "cwd", "only_cwd.libsonnet"), '"cwd only"')
+      File.write(File.join(dir, "first", "only_first.libsonnet"), '"first only"')
+      snippet = <<~JSONNET
+        [
+          import 'lib.libsonnet',
+          import 'only_first.libsonnet',
+          import 'only_cwd.libsonnet',
+        ]
+      JSONNET
+
+      Dir.chdir(File.join(dir, "cwd")) do
+        [
+          [File.join(dir, "first"), File.join(dir, "second")],
+          [File.join(dir, "second"), File.join(dir, "first")],
+          ["", File.join(dir, "first")],
+          [File.join(dir, "first"), ""],
+        ].each do |jpaths|
+          results = [false, true].map do |track|
+            vm = Jsonnet::VM.new(track_dependencies: track)
+            vm.jpath_add(*jpaths)
+            vm.evaluate(snippet, parse: true)
+          rescue Jsonnet::EvaluationError => e
+            e.message.lines.first
+          end
+          assert_equal results[0], results[1], "jpaths: #{jpaths.inspect}"
+        end
+      end
+    end
+  end
+
   test "Jsonnet::VM#jpath_add adds a library search path" do
     vm = Jsonnet::VM.new
     snippet = "(import 'jpath.libsonnet') {b: 2}"
@@ -390,6 +686,155 @@ class TestVM < Test::Unit::TestCase
     assert_true called
   end
 
+  test "Jsonnet::VM#define_function can memoize the results" do
+    vm = Jsonnet::VM.new
+    calls = 0
+    vm.define_function("lookup", memoize: true) do |key, n|
+      calls += 1
+      { "key" => key, "values" => [n, nil, true] }
+    end
+
+    snippet = "[std.native('lookup')('a', 1), std.native('lookup')('a', 1), std.native('lookup')('b', 1)]"
+    expected = [
+      { "key" => "a", "values" => [1, nil, true] },
+      { "key" => "a", "values" => [1, nil, true] },
+      { "key" => "b", "values" => [1, nil, true] },
+    ]
+    assert_equal expected, JSON.parse(vm.evaluate(snippet))
+    assert_equal 2, calls
+    assert_equal expected, JSON.parse(vm.evaluate(snippet))
+    assert_equal 2, calls
+  end
+
+  test "Jsonnet::VM#define_function can memoize the results per evaluation" do
+    vm = Jsonnet::VM.new
+    calls = 0
+    vm.define_function("f", memoize: { scope: :evaluation, max_size: 1 }) {|x| calls += 1; x }
+
+    assert_equal [1, 1], JSON.parse(vm.evaluate("[std.native('f')(1), std.native('f')(1)]"))
+    assert_equal 1, calls
+    assert_equal [1], JSON.parse(vm.evaluate("[std.native('f')(1)]"))
+    assert_equal 2, calls
+
+    # the least recently used result is discarded
+    vm.evaluate("[std.native('f')(1), std.native('f')(2), std.native('f')(1)]")
+    assert_equal 5, calls
+  end
+
+  test "Jsonnet::VM#dup copies the configuration and the callbacks" do
+    Dir.mktmpdir do |dir|
+      File.write(File.join(dir, "lib.libsonnet"), '"lib"')
+      template = Jsonnet::VM.new(max_stack: 100, timeout: 10)
+      template.jpath_add(dir)
+      template.ext_var("a", "A")
+      template.fmt_indent = 4
+      template.handle_import("secret://") {|base, rel| ['"secret"', rel] }
+      template.define_function("f", memoize: true) {|x| x * 2 }
+
+      vm = template.dup
+      assert_not_same template, vm
+      assert_equal 10, vm.timeout
+      assert_equal ["A", "lib", "secret", 6],
+                   vm.evaluate(<<~JSONNET, parse: true)
+                     [std.extVar("a"), import "lib.libsonnet", import "secret://x", std.native("f")(3)]
+                   JSONNET
+      assert_equal "{\n    a: 1,\n}\n", vm.format("{\na: 1\n}") if formatter?
+
+      vm.ext_var("a", "B")
+      assert_equal "B", vm.evaluate('std.extVar("a")', parse: true)
+      assert_equal "A", template.evaluate('std.extVar("a")', parse: true)
+    end
+  end
+
+  test "Jsonnet::VM.from_template copies a VM" do
+    template = Jsonnet::VM.new
+    template.tla_var("x", "a")
+    vm = Jsonnet::VM.from_template(template)
+    assert_equal "a", vm.evaluate('function(x) x', parse: true)
+
+    assert_raise(TypeError) do
+      Jsonnet::VM.from_template(Object.new)
+    end
+  end
+
+  test "ObjectSpace.memsize_of reports the memory of Jsonnet::VM" do
+    vm = Jsonnet::VM.new
+    empty = ObjectSpace.memsize_of(vm)
+    assert_operator empty, :>, 0
+
+    vm.ext_var("payload", "x" * 10_000)
+    vm.define_function("f", memoize: true) {|x| "y" * 10_000 }
+    configured = ObjectSpace.memsize_of(vm)
+    assert_operator configured, :>=, empty + 10_000
+
+    vm.evaluate("std.native('f')(1)")
+    assert_operator ObjectSpace.memsize_of(vm), :>=, configured + 10_000
+  end
+
+  test "Jsonnet::VM keeps callbacks through GC.compact" do
+    omit "GC.compact is not supported" unless GC.respond_to?(:compact)
+
+    vm = Jsonnet::VM.new(import_cache: Jsonnet::ImportCache.new)
+    vm.handle_import {|base, rel| ["{ rel: #{rel.dump} }", rel] }
+    vm.define_function("f") {|x| x * 2 }
+    GC.compact
+    assert_equal({ "rel" => "a.libsonnet", "f" => 6 },
+                 vm.evaluate("(import 'a.libsonnet') + { f: std.native('f')(3) }", parse: true))
+  end
+
+  test "Jsonnet::VM#define_function decodes JSON arguments with json_args" do
+    vm = Jsonnet::VM.new
+    received = nil
+    vm.define_function("f", json_args: [:doc]) {|doc, str| received = [doc, str]; doc.size }
+
+    result = vm.evaluate(<<-EOS)
+      std.native('f')(std.manifestJsonMinified({ a: [1, "x", null], b: {} }), '{"raw": 1}')
+    EOS
+    assert_equal 2, JSON.parse(result)
+    assert_equal [{ "a" => [1, "x", nil], "b" => {} }, '{"raw": 1}'], received
+
+    assert_raise(Jsonnet::EvaluationError) {
+      vm.evaluate("std.native('f')('{', '')")
+    }
+    assert_raise(ArgumentError) {
+      vm.define_function("g", json_args: [:no_such_param]) {|x| x }
+    }
+  end
+
+  test "Jsonnet::VM#define_function does not memoize errors" do
+    vm = Jsonnet::VM.new
+    calls = 0
+    vm.define_function("f", memoize: true) {|x| calls += 1; raise "error" }
+    2.times do
+      assert_raise(Jsonnet::EvaluationError) { vm.evaluate("std.native('f')(1)") }
+    end
+    assert_equal 2, calls
+  end
+
+  test "Jsonnet::VM#define_function does not memoize results which cannot be converted" do
+    vm = Jsonnet::VM.new
+    calls = 0
+    vm.define_function("f", memoize: true) do |x|
+      calls += 1
+      calls == 1 ? { a: { "b" => [x] } } : { "a" => x }
+    end
+
+    assert_raise(Jsonnet::EvaluationError) { vm.evaluate("std.native('f')(1)") }
+    assert_equal({ "a" => 1 }, vm.evaluate("std.native('f')(1)", parse: true))
+    assert_equal({ "a" => 1 }, vm.evaluate("std.native('f')(1)", parse: true))
+    assert_equal 2, calls
+  end
+
+  test "Jsonnet::VM#define_function memoizes deeply nested results" do
+    vm = Jsonnet::VM.new
+    vm.define_function("f", memoize: true) {|x| 1000.times.inject(x) {|value, _| [value] } }
+
+    2.times do
+      result = vm.evaluate("std.native('f')(1)")
+      assert_equal "#{'[' * 1000}1#{']' * 1000}", result.delete(" \n")
+    end
+  end
+
   test "Jsonnet::VM#define_function passes various types of arguments" do
     [
       [%q(null), nil],
@@ -453,6 +898,30 @@ class TestVM < Test::Unit::TestCase
     EOS
   end
 
+  test "Jsonnet::VM#define_function converts large and nested results in order" do
+    vm = Jsonnet::VM.new
+    vm.define_function("myLarge") do
+      {
+        "list" => (0...10000).to_a,
+        "nested" => [[1, { "a" => [2**64, 0.5] }], {}],
+        "converted" => Struct.new(:to_ary).new([1, 2]),
+      }
+    end
+
+    result = JSON.parse(vm.evaluate("std.native('myLarge')()"))
+    assert_equal (0...10000).to_a, result["list"]
+    assert_equal [[1, { "a" => [2**64, 0.5] }], {}], result["nested"]
+    assert_equal [1, 2], result["converted"]
+  end
+
+  test "Jsonnet::VM#define_function rejects recursive results" do
+    vm = Jsonnet::VM.new
+    vm.define_function("myRecursive") { a = []; a << a }
+    assert_raise(Jsonnet::EvaluationError) {
+      vm.evaluate("std.native('myRecursive')()")
+    }
+  end
+
   test "Jsonnet::VM#define_function treats global escapes as define_method does" do
     num_eval = 0
     begin
@@ -493,7 +962,202 @@ class TestVM < Test::Unit::TestCase
     end
   end
 
+  test "Jsonnet::VM#evaluate can run on multiple threads at a time" do
+    threads = 4.times.map do |i|
+      Thread.new do
+        vm = Jsonnet::VM.new
+        vm.define_function(:twice) {|x| x * 2 }
+        vm.import_callback = ->(base, rel) { return "{ id: #{i} }", "/#{rel}" }
+        vm.evaluate(<<-EOS)
+          local lib = import "lib.libsonnet";
+          [std.native("twice")(lib.id + n) for n in std.range(0, 99)]
+        EOS
+      end
+    end
+    threads.each_with_index do |th, i|
+      assert_equal (0..99).map {|n| (i + n) * 2.0 }, JSON.parse(th.value)
+    end
+  end
+
+  test "Jsonnet::VM#evaluate raises TimeoutError when the evaluation exceeds timeout" do
+    vm = Jsonnet::VM.new
+    vm.define_function(:tick) {|x| sleep 0.01; x }
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    assert_raise(Jsonnet::TimeoutError) do
+      vm.evaluate('[std.native("tick")(n) for n in std.range(1, 1000)]', timeout: 0.1)
+    end
+    assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, :<, 5
+    assert_nil vm.timeout
+    assert_equal "1\n", vm.evaluate('std.native("tick")(1)')
+
+    vm.timeout = 0.1
+    assert_equal 0.1, vm.timeout
+    assert_raise(Jsonnet::TimeoutError) do
+      vm.evaluate('[std.native("tick")(n) for n in std.range(1, 1000)]')
+    end
+    assert_raise(ArgumentError) do
+      vm.timeout = 0
+    end
+  end
+
+  test "Jsonnet::VM#evaluate can be aborted by Thread#kill" do
+    vm = Jsonnet::VM.new
+    vm.define_function(:tick) {|x| sleep 0.01; x }
+    th = Thread.new do
+      vm.evaluate('[std.native("tick")(n) for n in std.range(1, 1000)]')
+    end
+    sleep 0.1
+    th.kill
+    assert_not_nil th.join(5)
+    assert_equal "1\n", vm.evaluate('std.native("tick")(1)')
+  end
+
+  test "Jsonnet::VM#last_stats returns statistics of the last evaluation" do
+    vm = Jsonnet::VM.new
+    vm.define_function(:twice) {|x| x * 2 }
+    vm.define_function(:unused) {|x| x }
+    vm.handle_import {|base, rel| ["{ a: 1 }", "/#{rel}"] }
+    result = vm.evaluate('[(import "lib.libsonnet").a, std.native("twice")(1), std.native("twice")(2)]')
+
+    stats = vm.last_stats
+    assert_equal 1, stats[:imports]
+    assert_equal 0, stats[:import_cache_hits]
+    assert_equal 2, stats[:native_calls]["twice"][:calls]
+    assert_equal 0, stats[:native_calls]["unused"][:calls]
+    assert_equal result.bytesize, stats[:output_bytes]
+    assert_operator stats[:wall_time], :>=, stats[:import_time]
+
+    vm.evaluate('1')
+    assert_equal 0, vm.last_stats[:native_calls]["twice"][:calls]
+  end
+
+  test "Jsonnet::VM.subscribe receives statistics of each evaluation" do
+    received = []
+    subscriber = Jsonnet::VM.subscribe {|vm, stats| received << [vm, stats] }
+    begin
+      vm = Jsonnet::VM.new
+      vm.evaluate('{ a: 1 }')
+      assert_raise(Jsonnet::EvaluationError) { vm.evaluate('error "x"') }
+    ensure
+      Jsonnet::VM.unsubscribe(subscriber)
+    end
+    vm.evaluate('1')
+
+    assert_equal 2, received.size
+    assert_same vm, received[0][0]
+    assert_equal vm.evaluate('{ a: 1 }').bytesize, received[0][1][:output_bytes]
+  end
+
+  test "Jsonnet::VM rejects reentrant use during an evaluation" do
+    vm = Jsonnet::VM.new
+    vm.define_function(:reenter) {|x| vm.evaluate(x) }
+    assert_raise_message(/being used by another evaluation/) {
+      vm.evaluate('std.native("reenter")("1")')
+    }
+
+    vm = Jsonnet::VM.new
+    vm.define_function(:configure) {|x| vm.ext_var("x", x) }
+    assert_raise(Jsonnet::EvaluationError) {
+      vm.evaluate('std.native("configure")("1")')
+    }
+  end
+
+  test "Jsonnet::VM#evaluate_many evaluates files and snippets in order" do
+    vm = Jsonnet::VM.new
+    vm.ext_var("var1", "foo")
+    with_example_file(%<{ file: std.extVar("var1") }>) {|fname|
+      items = [
+        fname,
+        { snippet: "{ snippet: 1 + 1 }" },
+        { snippet: "{ // unterminated", filename: "broken.jsonnet" },
+        { file: fname, encoding: Encoding::UTF_8 },
+      ] * 8
+      results = vm.evaluate_many(items, threads: 3)
+      assert_equal items.size, results.size
+      results.each_slice(4) do |file1, snippet, broken, file2|
+        assert_equal({ "file" => "foo" }, JSON.parse(file1))
+        assert_equal({ "snippet" => 2 }, JSON.parse(snippet))
+        assert_kind_of Jsonnet::EvaluationError, broken
+        assert_match(/broken\.jsonnet/, broken.message)
+        assert_equal Encoding::UTF_8, file2.encoding
+      end
+    }
+  end
+
+  test "Jsonnet::VM#evaluate_many calls callbacks on the current thread" do
+    vm = Jsonnet::VM.new
+    threads = []
+    vm.define_function(:square) {|x| threads << Thread.current; x * x }
+    vm.import_callback = ->(base, rel) {
+      threads << Thread.current
+      return "{ n: #{rel.to_i} }", "/#{rel}"
+    }
+
+    items = (1..20).map {|i| { snippet: "std.native('square')((import '#{i}').n)" } }
+    results = vm.evaluate_many(items, threads: 4)
+    assert_equal (1..20).map {|i| i * i }, results.map {|r| JSON.parse(r) }
+    assert_equal [Thread.current], threads.uniq
+  end
+
+  test "Jsonnet::VM#evaluate_many keeps the items through GC.compact" do
+    omit "GC.compact is not supported" unless GC.respond_to?(:compact)
+
+    vm = Jsonnet::VM.new
+    vm.define_function(:compact) {|x| GC.compact; x }
+    items = (1..8).map {|i| { snippet: "std.native('compact')(#{i})", filename: "f#{i}" } }
+    assert_equal (1..8).map {|i| "#{i}\n" }, vm.evaluate_many(items, threads: 2)
+  end
+
+  test "Jsonnet::VM#evaluate_many applies the timeout to each item" do
+    vm = Jsonnet::VM.new(timeout: 0.1)
+    vm.define_function(:tick) {|x| sleep 0.01; x }
+    items = [
+      { snippet: '[std.native("tick")(n) for n in std.range(1, 1000)]' },
+      { snippet: 'std.native("tick")(1)' },
+    ] * 2
+    results = vm.evaluate_many(items, threads: 2)
+    assert_equal [Jsonnet::TimeoutError, String] * 2, results.map(&:class)
+    assert_match(/timed out after 0\.1 seconds/, results[0].message)
+  end
+
+  test "Jsonnet::VM#evaluate_many supports multi mode" do
+    vm = Jsonnet::VM.new
+    results = vm.evaluate_many([{ snippet: "{ a: [1], b: [2] }" }], multi: true)
+    assert_equal [{ "a" => [1], "b" => [2] }],
+                 results.map {|fileset| fileset.transform_values {|json| JSON.parse(json) } }
+  end
+
+  test "Jsonnet::VM#evaluate_many is safe on throw in callbacks" do
+    vm = Jsonnet::VM.new
+    vm.define_function(:myFunc) {|x| throw :dummy }
+    items = [{ snippet: 'std.native("myFunc")(1)' }] * 4
+    catch(:dummy) {
+      vm.evaluate_many(items, threads: 2)
+      flunk "never reach here"
+    }
+    assert_equal "1\n", vm.evaluate("1")
+  end
+
+  test "Jsonnet::VM#evaluate_many stops calling back once the batch is cancelled" do
+    vm = Jsonnet::VM.new
+    calls = 0
+    vm.define_function(:tick) {|x| calls += 1; sleep 0.01; x }
+    items = [{ snippet: '[std.native("tick")(n) for n in std.range(1, 100)]' }] * 4
+    th = Thread.new { vm.evaluate_many(items, threads: 4) }
+    Thread.pass until calls > 0
+    th.kill
+    th.join
+    assert_operator calls, :<, 100
+
+    calls = 0
+    vm.define_function(:escape) {|x| calls += 1; throw :escape if x == 1; sleep 0.01; x }
+    items = [{ snippet: '[std.native("escape")(n) for n in std.range(1, 100)]' }] * 4
+    catch(:escape) { vm.evaluate_many(items, threads: 4) }
+    assert_operator calls, :<, 100
+  end
+
   test "Jsonnet::VM#format_file formats Jsonnet file" do
+    omit "the backend has no formatter" unless formatter?
     vm = Jsonnet::VM.new
     vm.fmt_indent = 4
     with_example_file(%<
@@ -513,6 +1177,7 @@ local myvar = 1;
   end
 
   test "Jsonnet::VM#format formats Jsonnet snippet" do
+    omit "the backend has no formatter" unless formatter?
     vm = Jsonnet::VM.new
     vm.fmt_string = 'd'
     result = vm.format(<<-EOS)
@@ -529,6 +1194,53 @@ local myvar = "myvar";
     EOS
   end
 
+  test "Jsonnet::VM#format writes the result into out" do
+    omit "the backend has no formatter" unless formatter?
+    vm = Jsonnet::VM.new
+    io = StringIO.new
+    vm.format("{foo: [1,2]}", out: io)
+    assert_equal vm.format("{foo: [1,2]}"), io.string
+  end
+
+  test "Jsonnet::VM#format_files reports or rewrites the files which are not formatted" do
+    omit "the backend has no formatter" unless formatter?
+    Dir.mktmpdir do |dir|
+      formatted = File.join(dir, 'formatted.jsonnet')
+      File.write(formatted, "{ a: 1 }\n")
+      unformatted = File.join(dir, 'unformatted.jsonnet')
+      File.write(unformatted, "{a:1}")
+      broken = File.join(dir, 'broken.jsonnet')
+      File.write(broken, "{")
+      paths = [formatted, unformatted, broken, File.join(dir, 'missing.jsonnet')]
+
+      result = Jsonnet::VM.format_files(paths, threads: 2)
+      assert_equal unformatted, result[0]
+      assert_equal [Jsonnet::FormatError] * 2, result[1..].map(&:class)
+      assert_match(/missing\.jsonnet/, result[2].message)
+      assert_equal "{a:1}", File.read(unformatted)
+
+      File.chmod(0o640, unformatted)
+      assert_equal [unformatted], Jsonnet::VM.new.format_files([formatted, unformatted], check: false)
+      assert_equal "{ a: 1 }\n", File.read(unformatted)
+      assert_equal 0o640, File.stat(unformatted).mode & 0o777
+      assert_equal [formatted, unformatted].sort, Dir.glob(File.join(dir, '*.jsonnet*')).sort - [broken]
+      assert_empty Jsonnet::VM.new.format_files([formatted, unformatted])
+    end
+  end
+
+  test "Jsonnet::VM#format_files does not format files which contain NUL bytes" do
+    omit "the backend has no formatter" unless formatter?
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'nul.jsonnet')
+      File.binwrite(path, "{a:1}\0{b:2}")
+
+      result = Jsonnet::VM.new.format_files([path], check: false)
+      assert_equal [Jsonnet::FormatError], result.map(&:class)
+      assert_match(/NUL/, result[0].message)
+      assert_equal "{a:1}\0{b:2}", File.binread(path)
+    end
+  end
+
   test "Jsonnet::VM#fmt_string only accepts 'd', 's', or 'l'" do
     vm = Jsonnet::VM.new
     vm.fmt_string = Jsonnet::STRING_STYLE_DOUBLE
@@ -568,6 +1280,7 @@ local myvar = "myvar";
   end
 
   test "Jsonnet::VM#fmt_file raises FormatError on error" do
+    omit "the backend has no formatter" unless formatter?
     vm = Jsonnet::VM.new
     with_example_file('{foo: }') do |fname|
       assert_raise(Jsonnet::FormatError) do
@@ -577,6 +1290,7 @@ local myvar = "myvar";
   end
 
   test "Jsonnet::VM#fmt_snippet raises FormatError on error" do
+    omit "the backend has no formatter" unless formatter?
     vm = Jsonnet::VM.new
     assert_raise(Jsonnet::FormatError) do
       vm.format('{foo: }')
@@ -584,6 +1298,10 @@ local myvar = "myvar";
   end
 
   private
+  def formatter?
+    Jsonnet::VM.new.respond_to?(:fmt_snippet, true)
+  end
+
   def with_example_file(content)
     Tempfile.open("example.jsonnet") {|f|
       f.print content
@@ -0,0 +1,86 @@
+require 'jsonnet'
+
+require 'json'
+require 'test/unit'
+
+class TestVMPool < Test::Unit::TestCase
+  test 'Jsonnet::VMPool#evaluate evaluates snippet with a configured VM' do
+    pool = Jsonnet::VMPool.new(size: 2) do |vm|
+      vm.ext_var("greeting", "hello")
+    end
+    result = pool.evaluate('{ a: std.extVar("greeting") }')
+    assert_equal({ "a" => "hello" }, JSON.parse(result))
+  end
+
+  test 'Jsonnet::VMPool passes options to Jsonnet::VM' do
+    pool = Jsonnet::VMPool.new(size: 1, string_output: true)
+    assert_equal "foo\n", pool.evaluate('"foo"')
+
+    assert_raise(Jsonnet::VM::UnsupportedOptionError) do
+      Jsonnet::VMPool.new(size: 1, no_such_option: 1)
+    end
+  end
+
+  test 'Jsonnet::VMPool reuses VMs' do
+    pool = Jsonnet::VMPool.new(size: 1)
+    vm1 = pool.with_vm {|vm| vm }
+    vm2 = pool.with_vm {|vm| vm }
+    assert_same vm1, vm2
+  end
+
+  test 'Jsonnet::VMPool#evaluate binds top-level arguments per call' do
+    pool = Jsonnet::VMPool.new(size: 1)
+    assert_equal ["a", 1], JSON.parse(pool.evaluate('function(x, y) [x, y]',
+                                                    tla_vars: { x: "a" }, tla_codes: { y: "1" }))
+    assert_equal ["b", 2], JSON.parse(pool.evaluate('function(x, y) [x, y]',
+                                                    tla_vars: { x: "b" }, tla_codes: { y: "2" }))
+    assert_equal [1], JSON.parse(pool.evaluate('[1]'))
+    assert_equal ["c"], JSON.parse(pool.evaluate('function(z) [z]', tla_vars: { z: "c" }))
+    assert_equal ["d"], JSON.parse(pool.evaluate('function(z="d") [z]'))
+  end
+
+  test 'Jsonnet::VMPool#evaluate does not rebuild the VM for the same top-level argument names' do
+    pool = Jsonnet::VMPool.new(size: 1)
+    3.times do |i|
+      assert_equal [i], JSON.parse(pool.evaluate('function(x) [x]', tla_codes: { x: i.to_s }))
+    end
+    assert_equal 0, pool.stats[:tla_rebuilds]
+
+    assert_equal ["a"], JSON.parse(pool.evaluate('function(x) [x]', tla_vars: { 'x' => "a" }))
+    assert_equal 0, pool.stats[:tla_rebuilds]
+    assert_equal ["d"], JSON.parse(pool.evaluate('function(x="d") [x]'))
+    assert_equal 1, pool.stats[:tla_rebuilds]
+  end
+
+  test 'Jsonnet::VMPool#checkout blocks until a VM is returned' do
+    pool = Jsonnet::VMPool.new(size: 1)
+    vm = pool.checkout
+    assert_raise(Jsonnet::VMPool::TimeoutError) do
+      pool.checkout(timeout: 0.01)
+    end
+
+    th = Thread.new { pool.checkout(timeout: 10) }
+    Thread.pass until th.status == "sleep"
+    pool.checkin(vm)
+    assert_same vm, th.value
+  end
+
+  test 'Jsonnet::VMPool#checkin can discard the VM' do
+    pool = Jsonnet::VMPool.new(size: 1)
+    vm = pool.checkout
+    pool.checkin(vm, discard: true)
+    assert_not_same vm, pool.with_vm {|v| v }
+  end
+
+  test 'Jsonnet::VMPool#stats reports checkouts and wait time' do
+    pool = Jsonnet::VMPool.new(size: 2)
+    pool.evaluate('{}')
+    pool.evaluate('{}')
+    stats = pool.stats
+    assert_equal 2, stats[:size]
+    assert_equal 2, stats[:idle]
+    assert_equal 2, stats[:checkouts]
+    assert_kind_of Float, stats[:wait_time]
+    assert_operator stats[:max_wait_time], :<=, stats[:wait_time]
+  end
+end
@@ -0,0 +1,89 @@
+require 'jsonnet'
+
+require 'test/unit'
+require 'timeout'
+require 'tmpdir'
+
+class TestWatcher < Test::Unit::TestCase
+  setup do
+    omit 'inotify is not supported' unless Jsonnet::Watcher.supported?
+    @dir = Dir.mktmpdir
+    @rendered = Queue.new
+  end
+
+  teardown do
+    if @thread
+      @watcher.stop
+      @thread.join(5)
+    end
+    FileUtils.remove_entry(@dir) if @dir
+  end
+
+  def write(name, content)
+    path = File.join(@dir, name)
+    File.write(path, content)
+    path
+  end
+
+  def start(entries, **options)
+    @watcher = Jsonnet::Watcher.new(entries, debounce: 0.05, **options) do |entry, result|
+      @rendered << [File.basename(entry), result]
+    end
+    @thread = Thread.new { @watcher.run }
+  end
+
+  def next_render
+    Timeout.timeout(5) { @rendered.pop }
+  end
+
+  test 'Jsonnet::Watcher renders only the entries which import the changed file' do
+    write('a.libsonnet', '{ a: 1 }')
+    write('b.libsonnet', '{ b: 1 }')
+    a = write('a.jsonnet', 'import "a.libsonnet"')
+    b = write('b.jsonnet', 'import "b.libsonnet"')
+    start([a, b], parse: true)
+    assert_equal [['a.jsonnet', { 'a' => 1 }], ['b.jsonnet', { 'b' => 1 }]],
+                 [next_render, next_render].sort
+    assert_equal [a, File.join(@dir, 'a.libsonnet')], @watcher.dependencies(a)
+
+    write('b.libsonnet', '{ b: 2 }')
+    assert_equal ['b.jsonnet', { 'b' => 2 }], next_render
+    assert_true @rendered.empty?
+  end
+
+  test 'Jsonnet::Watcher retries failed entries on any change' do
+    main = write('main.jsonnet', 'import "missing.libsonnet"')
+    start([main])
+    name, error = next_render
+    assert_equal 'main.jsonnet', name
+    assert_kind_of Jsonnet::EvaluationError, error
+
+    write('missing.libsonnet', '"found"')
+    assert_equal ['main.jsonnet', "\"found\"\n"], next_render
+  end
+
+  test 'Jsonnet::Watcher watches a directory again after it is replaced' do
+    lib = File.join(@dir, 'lib')
+    Dir.mkdir(lib)
+    File.write(File.join(lib, 'a.libsonnet'), '1')
+    main = write('main.jsonnet', 'import "lib/a.libsonnet"')
+    start([main])
+    assert_equal ['main.jsonnet', "1\n"], next_render
+
+    FileUtils.rm_rf(lib)
+    Dir.mkdir(lib)
+    File.write(File.join(lib, 'a.libsonnet'), '2')
+    loop { break if next_render == ['main.jsonnet', "2\n"] }
+
+    File.write(File.join(lib, 'a.libsonnet'), '3')
+    assert_equal ['main.jsonnet', "3\n"], next_render
+  end
+
+  test 'Jsonnet::Watcher writes the results into output_dir' do
+    out = File.join(@dir, 'out')
+    main = write('main.jsonnet', '{ x: 1 }')
+    start([main], output_dir: out)
+    assert_equal ['main.jsonnet', [File.join(out, 'main.json')]], next_render
+    assert_equal "{\n   \"x\": 1\n}\n", File.read(File.join(out, 'main.json'))
+  end
+end